@@ -0,0 +1,385 @@
+/**
+ *  Micro-benchmark of containers (vl_queue and bdl_list)
+ *  Each case is repeated until the period passes, and time per operation is printed
+ *
+ *  Usage: ContainerBench [-t milliseconds_per_case] [-f filter]
+ *  filter is a substring of case names (e.g. "vl_queue", "delete")
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "hr_clock.h"
+#include "vl_queue.h"
+#include "bdl_list.h"
+
+/**
+ *  vl_queue drops its oldest packet beyond this number (VL_QUEUE_MAXIMUM_SIZE)
+ */
+#define BENCH_VL_QUEUE_CAPACITY	(64)
+
+static uint64_t period_us = 200 * 1000;
+static const char *filter = "";
+static volatile uint32_t sink; /// keeps results alive from optimizer
+
+static uint32_t rand_state = 2463534242u;
+
+static uint32_t xorshift(void) {
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+	return rand_state;
+}
+
+/**
+ *  Case is skipped unless its name matches filter
+ */
+static int selected(const char *name) {
+	return strstr(name, filter) != 0;
+}
+
+static void print_result(const char *name, const char *params, uint64_t elapsed_us, uint64_t ops) {
+	printf("%-26s %-18s : %10.1f ns/op (%llu ops)\n", name, params,
+		ops? elapsed_us * 1000.0 / ops: 0.0, (unsigned long long) ops);
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// vl_queue
+//////////////////////////////////////////////////////////////////////////
+
+/**
+ *  Push and pop one packet while the queue holds fill packets
+ */
+static void bench_vl_queue_push_pop(size_t size, int fill) {
+	uint8_t src[256], dst[256];
+	vl_queue_t q = vl_queue_create_sized(size);
+	uint64_t start_us, ops = 0;
+	char params[32];
+	int i;
+
+	memset(src, 0x5a, sizeof(src));
+	for (i = 0; i < fill; i++) vl_queue_push(q, src, size);
+
+	start_us = hr_clock_get_us();
+	do {
+		for (i = 0; i < 1000; i++) {
+			vl_queue_push(q, src, size);
+			sink += vl_queue_pop(q, dst, sizeof(dst));
+		}
+		ops += 1000;
+	} while (hr_clock_get_us() - start_us < period_us);
+
+	sprintf(params, "size %3u fill %2d", (unsigned) size, fill);
+	print_result("vl_queue push+pop", params, hr_clock_get_us() - start_us, ops);
+	vl_queue_destroy(q);
+}
+
+/**
+ *  Push into the full queue, which drops the oldest packet each time
+ */
+static void bench_vl_queue_overflow(size_t size) {
+	uint8_t src[256];
+	vl_queue_t q = vl_queue_create_sized(size);
+	uint64_t start_us, ops = 0;
+	char params[32];
+	int i;
+
+	memset(src, 0x5a, sizeof(src));
+	for (i = 0; i < BENCH_VL_QUEUE_CAPACITY; i++) vl_queue_push(q, src, size);
+
+	start_us = hr_clock_get_us();
+	do {
+		for (i = 0; i < 1000; i++) sink += vl_queue_push(q, src, size);
+		ops += 1000;
+	} while (hr_clock_get_us() - start_us < period_us);
+
+	sprintf(params, "size %3u", (unsigned) size);
+	print_result("vl_queue push (full)", params, hr_clock_get_us() - start_us, ops);
+	vl_queue_destroy(q);
+}
+
+/**
+ *  Fill the queue with fill packets and drain them at once, time per packet
+ */
+static void bench_vl_queue_pop_all(size_t size, int fill) {
+	uint8_t src[256];
+	uint8_t *dst = (uint8_t *)malloc(256 * BENCH_VL_QUEUE_CAPACITY);
+	vl_queue_t q = vl_queue_create_sized(size);
+	uint64_t start_us, ops = 0;
+	char params[32];
+	int i;
+
+	memset(src, 0x5a, sizeof(src));
+	start_us = hr_clock_get_us();
+	do {
+		for (i = 0; i < fill; i++) vl_queue_push(q, src, size);
+		sink += vl_queue_pop_all(q, 0, 0); // measure size first as webhid did
+		sink += vl_queue_pop_all(q, dst, 256 * BENCH_VL_QUEUE_CAPACITY);
+		ops += fill;
+	} while (hr_clock_get_us() - start_us < period_us);
+
+	sprintf(params, "size %3u fill %2d", (unsigned) size, fill);
+	print_result("vl_queue push+pop_all", params, hr_clock_get_us() - start_us, ops);
+	vl_queue_destroy(q);
+	free(dst);
+}
+
+/**
+ *  Fill the queue with fill packets and consume them in place through spans, time per packet
+ */
+static void bench_vl_queue_peek_commit(size_t size, int fill) {
+	uint8_t src[256];
+	vl_queue_t q = vl_queue_create_sized(size);
+	uint64_t start_us, ops = 0;
+	char params[32];
+	int i;
+
+	memset(src, 0x5a, sizeof(src));
+	start_us = hr_clock_get_us();
+	do {
+		struct vl_queue_span spans[2];
+		size_t len = 0;
+		int num;
+		for (i = 0; i < fill; i++) vl_queue_push(q, src, size);
+		num = vl_queue_peek(q, spans);
+		for (i = 0; i < num; i++) {
+			sink += spans[i].data[0];
+			len += spans[i].size;
+		}
+		vl_queue_commit(q, len);
+		ops += fill;
+	} while (hr_clock_get_us() - start_us < period_us);
+
+	sprintf(params, "size %3u fill %2d", (unsigned) size, fill);
+	print_result("vl_queue push+peek/commit", params, hr_clock_get_us() - start_us, ops);
+	vl_queue_destroy(q);
+}
+
+/**
+ *  Queue of each thread as a reading thread of HID would own
+ */
+struct bench_vl_queue_thread {
+	pthread_t th;
+	size_t size;
+	uint64_t ops;
+};
+
+static void *proc_vl_queue_push_pop(void *param) {
+	struct bench_vl_queue_thread *t = (struct bench_vl_queue_thread *)param;
+	uint8_t src[256], dst[256];
+	vl_queue_t q = vl_queue_create_sized(t->size);
+	uint64_t start_us = hr_clock_get_us();
+	uint32_t sum = 0;
+	int i;
+
+	memset(src, 0x5a, sizeof(src));
+	for (i = 0; i < 8; i++) vl_queue_push(q, src, t->size);
+	do {
+		for (i = 0; i < 1000; i++) {
+			vl_queue_push(q, src, t->size);
+			sum += vl_queue_pop(q, dst, sizeof(dst));
+		}
+		t->ops += 1000;
+	} while (hr_clock_get_us() - start_us < period_us);
+
+	sink += sum;
+	vl_queue_destroy(q);
+	return 0;
+}
+
+/**
+ *  Push and pop on queues of num_threads threads at once, time per operation of a thread
+ *  It grows from single thread case as the threads contend for the heap
+ */
+static void bench_vl_queue_threads(size_t size, int num_threads) {
+	struct bench_vl_queue_thread threads[16];
+	uint64_t start_us, ops = 0;
+	char params[32];
+	int i, n = 0;
+
+	start_us = hr_clock_get_us();
+	for (i = 0; i < num_threads; i++) {
+		threads[i].size = size;
+		threads[i].ops = 0;
+		if (pthread_create(&threads[i].th, 0, proc_vl_queue_push_pop, threads + i) != 0) break;
+		n++;
+	}
+	for (i = 0; i < n; i++) {
+		pthread_join(threads[i].th, NULL);
+		ops += threads[i].ops;
+	}
+
+	sprintf(params, "size %3u thread %2d", (unsigned) size, n);
+	print_result("vl_queue push+pop (mt)", params, (hr_clock_get_us() - start_us) * n, ops);
+}
+
+static void bench_vl_queue(void) {
+	static const size_t sizes[] = { 8, 64, 256 };
+	static const int fills[] = { 0, 8, 32, 63 };
+	size_t s, f;
+
+	if (selected("vl_queue push+pop")) {
+		for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+			for (f = 0; f < sizeof(fills) / sizeof(fills[0]); f++) bench_vl_queue_push_pop(sizes[s], fills[f]);
+		}
+	}
+	if (selected("vl_queue push (full)")) {
+		for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) bench_vl_queue_overflow(sizes[s]);
+	}
+	if (selected("vl_queue push+pop_all")) {
+		for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+			bench_vl_queue_pop_all(sizes[s], 8);
+			bench_vl_queue_pop_all(sizes[s], BENCH_VL_QUEUE_CAPACITY);
+		}
+	}
+	if (selected("vl_queue push+peek/commit")) {
+		for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+			bench_vl_queue_peek_commit(sizes[s], 8);
+			bench_vl_queue_peek_commit(sizes[s], BENCH_VL_QUEUE_CAPACITY);
+		}
+	}
+	if (selected("vl_queue push+pop (mt)")) {
+		static const int threads[] = { 1, 4, 16 };
+		for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+			for (f = 0; f < sizeof(threads) / sizeof(threads[0]); f++) bench_vl_queue_threads(sizes[s], threads[f]);
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// bdl_list
+//////////////////////////////////////////////////////////////////////////
+
+static void no_release(void *content) {
+	(void) content;
+}
+
+/**
+ *  Append n nodes and delete them in order (0: appended order, 1: reverse, 2: random)
+ *  Deletion validates membership by walking to both ends, so its cost depends on position
+ */
+static void bench_bdl_list_append_delete(int n, int order) {
+	static const char *names[] = { "bdl_list append+delete", "bdl_list delete (reverse)", "bdl_list delete (random)" };
+	bdl_list_node_t *nodes;
+	bdl_list_t ls;
+	uint64_t start_us, ops = 0;
+	char params[32];
+	int i;
+
+	if (!selected(names[order])) return;
+	nodes = (bdl_list_node_t *)malloc(n * sizeof(bdl_list_node_t));
+	ls = bdl_list_create();
+	start_us = hr_clock_get_us();
+	do {
+		for (i = 0; i < n; i++) nodes[i] = bdl_list_append_node(ls, nodes + i);
+		if (order == 2) {
+			for (i = n - 1; i > 0; i--) {
+				int j = (int)(xorshift() % (i + 1));
+				bdl_list_node_t t = nodes[i];
+				nodes[i] = nodes[j];
+				nodes[j] = t;
+			}
+		}
+		for (i = 0; i < n; i++) {
+			sink += (bdl_list_delete_node(ls, nodes[order == 1? n - 1 - i: i]) != 0);
+		}
+		ops += n;
+	} while (hr_clock_get_us() - start_us < period_us);
+
+	sprintf(params, "n %5d", n);
+	print_result(names[order], params, hr_clock_get_us() - start_us, ops);
+	bdl_list_destroy(ls, no_release);
+	free(nodes);
+}
+
+/**
+ *  Find a content by walking the list from head (as connections were searched)
+ */
+static void bench_bdl_list_lookup(int n) {
+	int *contents = (int *)malloc(n * sizeof(int));
+	bdl_list_t ls = bdl_list_create();
+	uint64_t start_us, ops = 0;
+	char params[32];
+	int i;
+
+	for (i = 0; i < n; i++) {
+		contents[i] = i;
+		bdl_list_append_node(ls, contents + i);
+	}
+	start_us = hr_clock_get_us();
+	do {
+		for (i = 0; i < 100; i++) {
+			const int *target = contents + xorshift() % n;
+			bdl_list_node_t node = bdl_list_get_head(ls);
+			while (node && bdl_list_extract_content(node) != target) node = bdl_list_get_next(ls, node);
+			sink += (node != 0);
+		}
+		ops += 100;
+	} while (hr_clock_get_us() - start_us < period_us);
+
+	sprintf(params, "n %5d", n);
+	print_result("bdl_list lookup", params, hr_clock_get_us() - start_us, ops);
+	bdl_list_destroy(ls, no_release);
+	free(contents);
+}
+
+/**
+ *  Walk all nodes, time per node
+ */
+static void bench_bdl_list_iterate(int n) {
+	bdl_list_t ls = bdl_list_create();
+	uint64_t start_us, ops = 0;
+	char params[32];
+	int i;
+
+	for (i = 0; i < n; i++) bdl_list_append_node(ls, &i);
+	start_us = hr_clock_get_us();
+	do {
+		bdl_list_node_t node;
+		for (node = bdl_list_get_head(ls); node; node = bdl_list_get_next(ls, node)) {
+			sink += (bdl_list_extract_content(node) != 0);
+		}
+		ops += n;
+	} while (hr_clock_get_us() - start_us < period_us);
+
+	sprintf(params, "n %5d", n);
+	print_result("bdl_list iterate", params, hr_clock_get_us() - start_us, ops);
+	bdl_list_destroy(ls, no_release);
+}
+
+static void bench_bdl_list(void) {
+	static const int sizes[] = { 10, 100, 1000, 10000 };
+	size_t s;
+	int order;
+
+	for (order = 0; order < 3; order++) {
+		for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) bench_bdl_list_append_delete(sizes[s], order);
+	}
+	if (selected("bdl_list lookup")) {
+		for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) bench_bdl_list_lookup(sizes[s]);
+	}
+	if (selected("bdl_list iterate")) {
+		for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) bench_bdl_list_iterate(sizes[s]);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	int i;
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			period_us = (uint64_t) atoi(argv[++i]) * 1000;
+		} else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+			filter = argv[++i];
+		} else {
+			fprintf(stderr, "Unknown option: [%s]\n", argv[i]);
+			exit(1);
+		}
+	}
+
+	bench_vl_queue();
+	bench_bdl_list();
+
+	return 0;
+}
@@ -0,0 +1,400 @@
+/**
+ *  End-to-end benchmark
+ *  WebHID server is run against simulated HIDs on mongoose thread (main thread),
+ *  and a WebSocket load client on another thread measures throughput and device-to-socket latency
+ *
+ *  Usage: WebHIDBench [-S scenario] [-d devices] [-r rate_hz] [-s report_size] [-i report_ids]
+ *                     [-c connections_per_device] [-t seconds] [-w warmup_seconds] [-q query] [-p port]
+ *  Scenarios: "8k" (1 x 8 kHz), "50x1k" (50 x 1 kHz), "idle500" (500 idle connections)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <mongoose.h>
+
+#include "webhid.h"
+#include "atom.h"
+#include "hr_clock.h"
+#include "sim_hid.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <sys/resource.h>
+#endif
+
+/**
+ *  Batch frame layout (see README.md), the client asks for "format=batch"
+ */
+#define BENCH_BATCH_HEADER_SIZE	(16)
+#define BENCH_BATCH_REPORT_SIZE	(16)
+
+/**
+ *  Latency histogram: 1 us buckets below 1 ms, 10 us below 10 ms, 1 ms below 1 s, and overflow
+ */
+#define BENCH_HIST_FINE		(1000)
+#define BENCH_HIST_MEDIUM	(900)
+#define BENCH_HIST_COARSE	(990)
+#define BENCH_HIST_SIZE		(BENCH_HIST_FINE + BENCH_HIST_MEDIUM + BENCH_HIST_COARSE + 1)
+
+/**
+ *  Phases of client thread, told by main thread
+ */
+#define BENCH_PHASE_WARMUP	(0)
+#define BENCH_PHASE_MEASURE	(1)
+#define BENCH_PHASE_STOP	(2)
+
+struct bench_options {
+	struct sim_hid_config hid;
+	int connections_per_device;
+	int seconds;
+	int warmup_seconds;
+	const char *query; /// appended to the query string of WebSocket URI
+	const char *port;
+};
+
+/// Results gathered by client thread, read by main thread after joining it
+struct bench_results {
+	uint64_t reports;
+	uint64_t bytes;
+	uint64_t frames;
+	uint64_t dropped;
+	uint64_t latency_max_us;
+	uint64_t hist[BENCH_HIST_SIZE];
+	uint64_t cpu_us; /// of client thread while measuring
+	int num_open;
+	int num_failed;
+};
+
+static struct bench_options options;
+static struct bench_results results;
+static atom_t phase = BENCH_PHASE_WARMUP;
+static atom_t phase_acked = BENCH_PHASE_WARMUP;
+static atom_t num_open = 0;
+
+static uint64_t get_process_cpu_us(void) {
+#ifdef _WIN32
+	FILETIME creation, exited, kernel, user;
+	ULARGE_INTEGER k, u;
+	GetProcessTimes(GetCurrentProcess(), &creation, &exited, &kernel, &user);
+	k.LowPart = kernel.dwLowDateTime; k.HighPart = kernel.dwHighDateTime;
+	u.LowPart = user.dwLowDateTime; u.HighPart = user.dwHighDateTime;
+	return (k.QuadPart + u.QuadPart) / 10; // 100 ns unit
+#else
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+#endif
+}
+
+static uint64_t get_thread_cpu_us(void) {
+#ifdef _WIN32
+	FILETIME creation, exited, kernel, user;
+	ULARGE_INTEGER k, u;
+	GetThreadTimes(GetCurrentThread(), &creation, &exited, &kernel, &user);
+	k.LowPart = kernel.dwLowDateTime; k.HighPart = kernel.dwHighDateTime;
+	u.LowPart = user.dwLowDateTime; u.HighPart = user.dwHighDateTime;
+	return (k.QuadPart + u.QuadPart) / 10;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static void hist_record(uint64_t us) {
+	size_t i;
+	if (us < 1000) i = (size_t) us;
+	else if (us < 10000) i = BENCH_HIST_FINE + (size_t)((us - 1000) / 10);
+	else if (us < 1000000) i = BENCH_HIST_FINE + BENCH_HIST_MEDIUM + (size_t)((us - 10000) / 1000);
+	else i = BENCH_HIST_SIZE - 1;
+	results.hist[i]++;
+	if (us > results.latency_max_us) results.latency_max_us = us;
+}
+
+/**
+ *  Upper bound of the bucket holding the percentile
+ */
+static uint64_t hist_percentile(double percent) {
+	uint64_t target = (uint64_t)(results.reports * percent / 100.0);
+	uint64_t count = 0;
+	size_t i;
+	for (i = 0; i < BENCH_HIST_SIZE; i++) {
+		count += results.hist[i];
+		if (count > target) break;
+	}
+	if (i < BENCH_HIST_FINE) return i + 1;
+	if (i < BENCH_HIST_FINE + BENCH_HIST_MEDIUM) return 1000 + (i - BENCH_HIST_FINE + 1) * 10;
+	if (i < BENCH_HIST_SIZE - 1) return 10000 + (i - BENCH_HIST_FINE - BENCH_HIST_MEDIUM + 1) * 1000;
+	return results.latency_max_us;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// Load client
+//////////////////////////////////////////////////////////////////////////
+
+static void handle_batch_frame(const uint8_t *p, size_t len, int measuring) {
+	uint64_t now_us = hr_clock_get_us();
+	uint16_t count;
+	uint32_t dropped;
+	size_t pos = BENCH_BATCH_HEADER_SIZE;
+
+	if (len < BENCH_BATCH_HEADER_SIZE) return;
+	memcpy(&count, p + 2, sizeof(count));
+	memcpy(&dropped, p + 4, sizeof(dropped));
+	if (!measuring) return;
+
+	results.frames++;
+	results.bytes += len;
+	results.dropped += dropped;
+	while (count-- && pos + BENCH_BATCH_REPORT_SIZE <= len) {
+		uint32_t size;
+		memcpy(&size, p + pos + 4, sizeof(size));
+		pos += BENCH_BATCH_REPORT_SIZE;
+		if (pos + size > len) break;
+		if (size >= SIM_HID_REPORT_MIN_SIZE) {
+			uint64_t gen_us;
+			memcpy(&gen_us, p + pos + SIM_HID_OFFSET_TIMESTAMP, sizeof(gen_us));
+			hist_record(now_us > gen_us? now_us - gen_us: 0);
+		}
+		results.reports++;
+		pos += size;
+	}
+}
+
+static void client_handler(struct mg_connection *nc, int ev, void *ev_data) {
+	struct websocket_message *wm = (struct websocket_message *) ev_data;
+
+	switch (ev) {
+	case MG_EV_WEBSOCKET_HANDSHAKE_DONE:
+		nc->user_data = (void *) 1;
+		atom_fetch_add(&num_open, 1);
+		break;
+	case MG_EV_WEBSOCKET_FRAME:
+		handle_batch_frame(wm->data, wm->size, atom_load_acq(&phase_acked) == BENCH_PHASE_MEASURE);
+		break;
+	case MG_EV_CLOSE:
+		if (nc->user_data) {
+			atom_fetch_add(&num_open, (uint32_t) -1);
+		} else {
+			results.num_failed++;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static void *proc_client(void *param) {
+	struct mg_mgr mgr;
+	uint64_t cpu_start_us = 0;
+	int d, c;
+	(void) param;
+
+	mg_mgr_init(&mgr, NULL);
+	for (d = 0; d < options.hid.num_devices; d++) {
+		for (c = 0; c < options.connections_per_device; c++) {
+			char url[256];
+			_snprintf_s(url, sizeof(url), sizeof(url) - 1, "ws://127.0.0.1:%s/hid/0000/%04x/%04x/%04x/%04x/?mode=push&format=batch%s%s",
+				options.port, SIM_HID_VENDOR_ID, d, SIM_HID_USAGE_PAGE, SIM_HID_USAGE,
+				options.query[0]? "&": "", options.query);
+			if (!mg_connect_ws(&mgr, client_handler, url, NULL, NULL)) results.num_failed++;
+		}
+	}
+
+	for (;;) {
+		uint32_t ph = atom_load_acq(&phase);
+		if (ph != atom_load_acq(&phase_acked)) {
+			if (ph == BENCH_PHASE_MEASURE) {
+				cpu_start_us = get_thread_cpu_us();
+			} else if (ph == BENCH_PHASE_STOP) {
+				results.cpu_us = get_thread_cpu_us() - cpu_start_us;
+				results.num_open = (int) atom_load_acq(&num_open);
+			}
+			atom_store_rel(&phase_acked, ph);
+			if (ph == BENCH_PHASE_STOP) break;
+		}
+		mg_mgr_poll(&mgr, 10);
+	}
+
+	mg_mgr_free(&mgr);
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// Server
+//////////////////////////////////////////////////////////////////////////
+
+static void server_handler(struct mg_connection *nc, int ev, void *ev_data) {
+	struct http_message *hm = (struct http_message *) ev_data;
+	struct websocket_message *wm = (struct websocket_message *) ev_data;
+
+	switch (ev) {
+	case MG_EV_HTTP_REQUEST:
+		if (!webhid_handle_request(nc, hm)) mg_printf(nc, "%s", "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+		break;
+	case MG_EV_WEBSOCKET_HANDSHAKE_REQUEST:
+		if (!webhid_handshake(nc, hm)) nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+		break;
+	case MG_EV_WEBSOCKET_FRAME:
+		webhid_handle_frame(nc, wm);
+		break;
+	case MG_EV_WEBSOCKET_CONTROL_FRAME:
+		webhid_control(nc, wm);
+		break;
+	case MG_EV_SEND:
+		if (nc->flags & MG_F_IS_WEBSOCKET) webhid_handle_sent(nc);
+		break;
+	case MG_EV_CLOSE:
+		if (!(nc->flags & MG_F_IS_WEBSOCKET)) webhid_cancel_request(nc);
+		else if (webhid_exists(nc)) webhid_disconnect(nc);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ *  Run mongoose loop of server until the period passes
+ */
+static void serve_for(struct mg_mgr *mgr, uint64_t us) {
+	uint64_t end_us = hr_clock_get_us() + us;
+	while (hr_clock_get_us() < end_us) mg_mgr_poll(mgr, 50);
+}
+
+/**
+ *  Tell client thread a phase and serve until it is acknowledged
+ */
+static void change_phase(struct mg_mgr *mgr, uint32_t ph) {
+	atom_store_rel(&phase, ph);
+	while (atom_load_acq(&phase_acked) != ph) mg_mgr_poll(mgr, 1);
+}
+
+static int set_scenario(const char *name) {
+	if (strcmp(name, "8k") == 0) {
+		options.hid.num_devices = 1;
+		options.hid.rate_hz = 8000;
+		options.connections_per_device = 1;
+	} else if (strcmp(name, "50x1k") == 0) {
+		options.hid.num_devices = 50;
+		options.hid.rate_hz = 1000;
+		options.connections_per_device = 1;
+	} else if (strcmp(name, "idle500") == 0) {
+		options.hid.num_devices = 500;
+		options.hid.rate_hz = 0;
+		options.connections_per_device = 1;
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+static void print_results(uint64_t wall_us, uint64_t cpu_us) {
+	int num_conns = options.hid.num_devices * options.connections_per_device;
+	double sec = wall_us / 1000000.0;
+	double cpu_server = (cpu_us > results.cpu_us? cpu_us - results.cpu_us: 0) * 100.0 / wall_us;
+
+	printf("devices          : %d x %d Hz, %d byte(s), %d report ID(s)\n",
+		options.hid.num_devices, options.hid.rate_hz, options.hid.report_size, options.hid.num_report_ids);
+	printf("connections      : %d / %d open (%d failed)\n", results.num_open, num_conns, results.num_failed);
+	printf("reports/sec      : %.1f (expected %.1f)\n",
+		results.reports / sec, (double) options.hid.rate_hz * num_conns);
+	printf("frames/sec       : %.1f, %.1f KiB/s\n", results.frames / sec, results.bytes / sec / 1024);
+	printf("dropped          : %llu\n", (unsigned long long) results.dropped);
+	if (results.reports) {
+		printf("latency (us)     : p50 %llu, p99 %llu, p99.9 %llu, max %llu\n",
+			(unsigned long long) hist_percentile(50.0), (unsigned long long) hist_percentile(99.0),
+			(unsigned long long) hist_percentile(99.9), (unsigned long long) results.latency_max_us);
+	}
+	printf("CPU server       : %.2f %% (%.3f %% per device)\n", cpu_server, cpu_server / options.hid.num_devices);
+	printf("CPU client       : %.2f %%\n", results.cpu_us * 100.0 / wall_us);
+}
+
+int main(int argc, char *argv[]) {
+	struct mg_mgr mgr;
+	struct mg_connection *nc;
+	pthread_t th;
+	uint64_t start_us, cpu_start_us, wall_us, cpu_us;
+	int i;
+
+	options.hid.num_devices = 1;
+	options.hid.rate_hz = 1000;
+	options.hid.report_size = 64;
+	options.hid.num_report_ids = 0;
+	options.connections_per_device = 1;
+	options.seconds = 10;
+	options.warmup_seconds = 1;
+	options.query = "";
+	options.port = "8100";
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+			if (!set_scenario(argv[++i])) {
+				fprintf(stderr, "Unknown scenario: [%s]\n", argv[i]);
+				exit(1);
+			}
+		} else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+			options.hid.num_devices = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			options.hid.rate_hz = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			options.hid.report_size = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+			options.hid.num_report_ids = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+			options.connections_per_device = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			options.seconds = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+			options.warmup_seconds = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+			options.query = argv[++i];
+		} else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+			options.port = argv[++i];
+		} else {
+			fprintf(stderr, "Unknown option: [%s]\n", argv[i]);
+			exit(1);
+		}
+	}
+	if (options.hid.num_devices < 1 || options.connections_per_device < 1 || options.seconds < 1) {
+		fprintf(stderr, "Invalid options\n");
+		exit(1);
+	}
+	if (options.hid.report_size < SIM_HID_REPORT_MIN_SIZE) options.hid.report_size = SIM_HID_REPORT_MIN_SIZE;
+	sim_hid_configure(&options.hid);
+
+	mg_mgr_init(&mgr, NULL);
+	webhid_initialize(&mgr);
+	nc = mg_bind(&mgr, options.port, server_handler);
+	if (nc == NULL) {
+		fprintf(stderr, "Error starting server on port %s\n", options.port);
+		exit(1);
+	}
+	mg_set_protocol_http_websocket(nc);
+
+	if (pthread_create(&th, 0, proc_client, 0) != 0) {
+		fprintf(stderr, "Error starting client thread\n");
+		exit(1);
+	}
+
+	// connections are opened while warming up
+	serve_for(&mgr, (uint64_t) options.warmup_seconds * 1000000);
+
+	change_phase(&mgr, BENCH_PHASE_MEASURE);
+	start_us = hr_clock_get_us();
+	cpu_start_us = get_process_cpu_us();
+	serve_for(&mgr, (uint64_t) options.seconds * 1000000);
+	change_phase(&mgr, BENCH_PHASE_STOP);
+	wall_us = hr_clock_get_us() - start_us;
+	cpu_us = get_process_cpu_us() - cpu_start_us;
+
+	pthread_join(th, NULL);
+	print_results(wall_us, cpu_us);
+	webhid_finalize();
+	mg_mgr_free(&mgr);
+
+	return 0;
+}
@@ -0,0 +1,257 @@
+/**
+ *  Check of hidraw_epoll module (Linux only)
+ *  HID IFs are simulated by SOCK_SEQPACKET socket pairs: the test writes reports into one end,
+ *  and the other end is read by the epoll thread as a hidraw node (one report per read).
+ *  Closing the writing end stands for unplugging the HID.
+ *
+ *  Usage: gcc -o check_hidraw_epoll bench/check_hidraw_epoll.c src/hidraw_epoll.c -Isrc -lpthread && ./check_hidraw_epoll
+ *  It prints each case and exits with 0 when all of them pass
+ */
+
+#ifdef __linux__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "atom.h"
+#include "hidraw_epoll.h"
+
+/**
+ *  A condition is waited for this period at most
+ */
+#define CHECK_TIMEOUT_MS	(2000)
+
+/// State of a simulated HID, written by callbacks on the epoll thread
+struct sim_device {
+	int peer; /// writing end of socket pair
+	atom_t readable; /// boolean, returned by can_read
+	atom_t inputs;
+	atom_t drained;
+	atom_t errors;
+	atom_t after_error; /// callbacks called after on_error
+	atom_t wrong_thread; /// callbacks called on a thread other than the epoll thread
+	atom_t last_byte; /// the first byte of the last report
+	pthread_t main_thread;
+};
+
+static int num_failed = 0;
+
+static void check(int cond, const char *what) {
+	printf("%-60s : %s\n", what, cond? "ok": "FAILED");
+	if (!cond) num_failed++;
+}
+
+static void sleep_ms(int ms) {
+	struct timespec ts;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+	nanosleep(&ts, 0);
+}
+
+/**
+ *  Wait until *a reaches value, it returns 1 when reached
+ */
+static int wait_for(atom_t *a, atom_t value) {
+	int ms;
+	for (ms = 0; ms < CHECK_TIMEOUT_MS; ms++) {
+		if (atom_load_acq(a) >= value) return 1;
+		sleep_ms(1);
+	}
+	return atom_load_acq(a) >= value;
+}
+
+static void on_any_callback(struct sim_device *d) {
+	if (pthread_equal(pthread_self(), d->main_thread)) atom_fetch_add(&d->wrong_thread, 1);
+	if (atom_load_acq(&d->errors)) atom_fetch_add(&d->after_error, 1);
+}
+
+static int sim_can_read(void *ctx) {
+	struct sim_device *d = (struct sim_device *) ctx;
+	on_any_callback(d);
+	return (int) atom_load_acq(&d->readable);
+}
+
+static void sim_on_input(void *ctx, const uint8_t *data, int len) {
+	struct sim_device *d = (struct sim_device *) ctx;
+	on_any_callback(d);
+	atom_store_rel(&d->last_byte, len > 0? data[0]: 0);
+	atom_fetch_add(&d->inputs, 1);
+}
+
+static void sim_on_drained(void *ctx) {
+	struct sim_device *d = (struct sim_device *) ctx;
+	on_any_callback(d);
+	atom_fetch_add(&d->drained, 1);
+}
+
+static void sim_on_error(void *ctx) {
+	struct sim_device *d = (struct sim_device *) ctx;
+	on_any_callback(d);
+	atom_fetch_add(&d->errors, 1);
+}
+
+static const struct hidraw_epoll_callbacks sim_callbacks = {
+	sim_can_read, sim_on_input, sim_on_drained, sim_on_error
+};
+
+/**
+ *  Open a simulated HID and let the module read it, it returns 0 on fail
+ */
+static hidraw_epoll_handle_t open_device(struct sim_device *d) {
+	int fds[2];
+	memset(d, 0, sizeof(struct sim_device));
+	d->readable = 1;
+	d->main_thread = pthread_self();
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0) return 0;
+	d->peer = fds[1];
+	return hidraw_epoll_add_fd(fds[0], &sim_callbacks, d);
+}
+
+static int send_report(struct sim_device *d, uint8_t first) {
+	uint8_t report[8];
+	memset(report, first, sizeof(report));
+	// fails without SIGPIPE once the reading end is closed
+	return send(d->peer, report, sizeof(report), MSG_NOSIGNAL) == (ssize_t) sizeof(report);
+}
+
+/**
+ *  Reports are read one by one and the HID is drained after them
+ */
+static void check_reading(void) {
+	struct sim_device d;
+	hidraw_epoll_handle_t h = open_device(&d);
+	int i;
+
+	check(h != 0, "reading: handle is added");
+	if (!h) return;
+	for (i = 1; i <= 3; i++) send_report(&d, (uint8_t) i);
+	check(wait_for(&d.inputs, 3) && atom_load_acq(&d.inputs) == 3, "reading: 3 reports are read");
+	check(atom_load_acq(&d.last_byte) == 3, "reading: reports are read in order");
+	check(wait_for(&d.drained, 1), "reading: drained is told");
+	check(atom_load_acq(&d.wrong_thread) == 0, "reading: callbacks run on the epoll thread");
+	hidraw_epoll_remove(h);
+	close(d.peer);
+}
+
+/**
+ *  can_read of 0 pauses the handle by EPOLL_CTL_MOD, and reports are left in the HID until resumed
+ */
+static void check_pause_resume(void) {
+	struct sim_device d;
+	hidraw_epoll_handle_t h = open_device(&d);
+	atom_t drained;
+
+	check(h != 0, "pause: handle is added");
+	if (!h) return;
+	atom_store_rel(&d.readable, 0);
+	send_report(&d, 1);
+	check(wait_for(&d.drained, 1), "pause: drained is told when paused");
+	drained = atom_load_acq(&d.drained);
+	send_report(&d, 2);
+	sleep_ms(50);
+	check(atom_load_acq(&d.inputs) == 0, "pause: no report is read while paused");
+	check(atom_load_acq(&d.drained) == drained, "pause: paused handle does not wake the thread");
+
+	atom_store_rel(&d.readable, 1);
+	hidraw_epoll_resume(h);
+	check(wait_for(&d.inputs, 2) && atom_load_acq(&d.last_byte) == 2, "pause: reports left are read after resume");
+	hidraw_epoll_resume(h); // resuming a handle not paused does nothing
+	send_report(&d, 3);
+	check(wait_for(&d.inputs, 3) && atom_load_acq(&d.inputs) == 3, "pause: reading goes on after resume");
+	hidraw_epoll_remove(h);
+	close(d.peer);
+}
+
+/**
+ *  Unplugged HID is told once by on_error, and no callback follows it
+ */
+static void check_unplug(void) {
+	struct sim_device d;
+	hidraw_epoll_handle_t h = open_device(&d);
+
+	check(h != 0, "unplug: handle is added");
+	if (!h) return;
+	send_report(&d, 1);
+	check(wait_for(&d.inputs, 1), "unplug: report before unplug is read");
+	close(d.peer);
+	check(wait_for(&d.errors, 1), "unplug: error is told");
+	sleep_ms(50);
+	check(atom_load_acq(&d.errors) == 1, "unplug: error is told once");
+	check(atom_load_acq(&d.after_error) == 0, "unplug: no callback follows error");
+	hidraw_epoll_remove(h); // still removed by the owner
+}
+
+static void *proc_flooding(void *param) {
+	struct sim_device *d = (struct sim_device *) param;
+	uint8_t n = 0;
+	while (send_report(d, n++)) ;
+	return 0;
+}
+
+/**
+ *  Removing a handle while its reports are dispatched: no callback runs after remove returns,
+ *  and the handle is freed on the epoll thread after events already taken for it (checked by AddressSanitizer)
+ */
+static void check_remove_while_reading(void) {
+	struct sim_device d[4];
+	hidraw_epoll_handle_t h[4];
+	pthread_t writers[4];
+	int i, ok = 1, quiet = 1;
+
+	for (i = 0; i < 4; i++) {
+		h[i] = open_device(&d[i]);
+		if (!h[i] || pthread_create(&writers[i], 0, proc_flooding, &d[i]) != 0) {
+			check(0, "remove: handles are added");
+			return;
+		}
+	}
+	for (i = 0; i < 4; i++) ok = wait_for(&d[i].inputs, 100) && ok;
+	check(ok, "remove: reports are flooding");
+
+	for (i = 0; i < 4; i++) {
+		atom_t inputs;
+		hidraw_epoll_remove(h[i]);
+		inputs = atom_load_acq(&d[i].inputs);
+		sleep_ms(10);
+		if (atom_load_acq(&d[i].inputs) != inputs) quiet = 0;
+	}
+	check(quiet, "remove: no callback runs after remove returns");
+
+	for (i = 0; i < 4; i++) {
+		shutdown(d[i].peer, SHUT_RDWR); // writer fails once its reading end is closed
+		pthread_join(writers[i], NULL);
+		close(d[i].peer);
+	}
+	sleep_ms(10); // let handles be freed on the epoll thread before finalizing
+}
+
+int main(void) {
+	if (!hidraw_epoll_initialize(0)) {
+		printf("failed to start epoll thread\n");
+		return 1;
+	}
+	check_reading();
+	check_pause_resume();
+	check_unplug();
+	check_remove_while_reading();
+	hidraw_epoll_finalize();
+
+	printf("%d case(s) failed\n", num_failed);
+	return num_failed? 1: 0;
+}
+
+#else //__linux__
+
+#include <stdio.h>
+
+int main(void) {
+	printf("hidraw_epoll is available only on Linux\n");
+	return 0;
+}
+
+#endif //__linux__
@@ -0,0 +1,199 @@
+/**
+ *  Check of ws_deflate module
+ *  Messages are compressed and inflated back; messages compressed with context takeover
+ *  are inflated as one stream, as a peer keeping its window reads them.
+ *  Malformed data must be refused without reading or writing out of buffers (checked by AddressSanitizer)
+ *
+ *  Usage: gcc -fsanitize=address -o check_ws_deflate bench/check_ws_deflate.c src/ws_deflate.c -Isrc && ./check_ws_deflate
+ *  It prints each case and exits with 0 when all of them pass
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ws_deflate.h"
+
+/**
+ *  Longest message of the cases
+ */
+#define CHECK_MESSAGE_MAX	(64 * 1024)
+
+static int num_failed = 0;
+
+static void check(int cond, const char *what) {
+	printf("%-60s : %s\n", what, cond? "ok": "FAILED");
+	if (!cond) num_failed++;
+}
+
+/**
+ *  Input reports as sent in a frame: a few fields changing slowly among constant bytes
+ */
+static void make_reports(uint8_t *buf, size_t len, unsigned seed) {
+	size_t i;
+	for (i = 0; i < len; i++) {
+		size_t k = i % 64;
+		buf[i] = (uint8_t)((k < 4)? (seed + i / 64) >> (k * 2): (k < 8)? k: 0);
+	}
+}
+
+static void make_random(uint8_t *buf, size_t len, unsigned seed) {
+	size_t i;
+	srand(seed);
+	for (i = 0; i < len; i++) buf[i] = (uint8_t) rand();
+}
+
+/**
+ *  A message is compressed and inflated back alone, without context takeover
+ */
+static void check_round_trip(void) {
+	static const size_t sizes[] = { 1, 3, 64, 258, 259, 4096, 4097, CHECK_MESSAGE_MAX };
+	ws_deflate_t d = ws_deflate_create(15, 1);
+	uint8_t *src = (uint8_t *) malloc(CHECK_MESSAGE_MAX);
+	uint8_t *dst = (uint8_t *) malloc(ws_deflate_bound(CHECK_MESSAGE_MAX));
+	uint8_t *back = (uint8_t *) malloc(CHECK_MESSAGE_MAX);
+	int ok = 1, smaller = 1;
+	size_t i;
+
+	check(d && src && dst && back, "round trip: context is created");
+	if (d && src && dst && back) {
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			size_t len;
+			make_reports(src, sizes[i], (unsigned) i);
+			len = ws_deflate_compress(d, src, sizes[i], dst);
+			if (len == 0) {
+				if (sizes[i] >= 64) smaller = 0; // repeated reports must get smaller
+				continue;
+			}
+			if (ws_deflate_inflate(dst, len, back, CHECK_MESSAGE_MAX) != (int) sizes[i] ||
+				memcmp(src, back, sizes[i]) != 0) ok = 0;
+		}
+		check(ok, "round trip: reports are inflated back");
+		check(smaller, "round trip: reports get smaller");
+
+		make_random(src, 4096, 1);
+		check(ws_deflate_compress(d, src, 4096, dst) == 0, "round trip: random bytes are left uncompressed");
+	}
+	if (d) ws_deflate_destroy(d);
+	free(src);
+	free(dst);
+	free(back);
+}
+
+/**
+ *  Messages compressed with context takeover refer to the previous ones,
+ *  they are inflated as one stream with the tails removed by the compressor put back between them
+ */
+static void check_context_takeover(int window_bits, const char *what) {
+	static const uint8_t tail[4] = { 0x00, 0x00, 0xff, 0xff };
+	const size_t message_len = 3000, num_messages = 8;
+	ws_deflate_t d = ws_deflate_create(window_bits, 0);
+	uint8_t *src = (uint8_t *) malloc(message_len * num_messages);
+	uint8_t *stream = (uint8_t *) malloc((ws_deflate_bound(message_len) + sizeof(tail)) * num_messages);
+	uint8_t *back = (uint8_t *) malloc(message_len * num_messages);
+	size_t i, pos = 0, first_len = 0, last_len = 0;
+	int ok = 1;
+
+	if (!d || !src || !stream || !back) {
+		check(0, what);
+		goto FINISH;
+	}
+	make_reports(src, message_len * num_messages, 7);
+	for (i = 0; i < num_messages; i++) {
+		size_t len = ws_deflate_compress(d, src + i * message_len, message_len, stream + pos);
+		if (len == 0) {
+			ok = 0;
+			break;
+		}
+		if (i == 0) first_len = len;
+		last_len = len;
+		pos += len;
+		if (i + 1 < num_messages) {
+			memcpy(stream + pos, tail, sizeof(tail));
+			pos += sizeof(tail);
+		}
+	}
+	ok = ok && ws_deflate_inflate(stream, pos, back, message_len * num_messages) == (int)(message_len * num_messages) &&
+		memcmp(src, back, message_len * num_messages) == 0;
+	check(ok, what);
+	if (ok && window_bits == WS_DEFLATE_WINDOW_BITS_MAX) check(last_len < first_len, "context takeover: later messages refer to window");
+
+FINISH:
+	if (d) ws_deflate_destroy(d);
+	free(src);
+	free(stream);
+	free(back);
+}
+
+/**
+ *  Window beyond WS_DEFLATE_WINDOW_BITS_MAX is limited, so a match is not taken farther than the window
+ *  told by server_max_window_bits: random bytes repeated after 5000 bytes are left uncompressed
+ */
+static void check_window_limit(void) {
+	const size_t part = 3000, gap = 5000;
+	ws_deflate_t d = ws_deflate_create(15, 1);
+	uint8_t *src = (uint8_t *) malloc(part * 2 + gap);
+	uint8_t *dst = (uint8_t *) malloc(ws_deflate_bound(part * 2 + gap));
+
+	if (d && src && dst) {
+		make_random(src, part + gap, 5);
+		memcpy(src + part + gap, src, part);
+		check(ws_deflate_compress(d, src, part * 2 + gap, dst) == 0, "window limit: no match beyond the window");
+		make_random(src, part + 1000, 5);
+		memcpy(src + part + 1000, src, part);
+		check(ws_deflate_compress(d, src, part * 2 + 1000, dst) > 0, "window limit: match within the window is taken");
+	} else {
+		check(0, "window limit: context is created");
+	}
+	if (d) ws_deflate_destroy(d);
+	free(src);
+	free(dst);
+}
+
+/**
+ *  Malformed data is refused, and output never exceeds dst_size
+ */
+static void check_malformed(void) {
+	static const uint8_t reserved_type[] = { 0x07 }; // final block of type 3
+	static const uint8_t bad_nlen[] = { 0x01, 0x04, 0x00, 0x00, 0x00, 'a', 'b', 'c', 'd' }; // stored, NLEN is not ~LEN
+	static const uint8_t far_distance[] = { 0x03, 0x02, 0x00 }; // fixed block beginning with a match
+	static const uint8_t stored_long[] = { 0x01, 0x08, 0x00, 0xf7, 0xff, 'a', 'b' }; // 8 bytes told, 2 given and 4 of tail
+	uint8_t src[256], dst[512], back[256]; // dst is longer than ws_deflate_bound(256)
+	ws_deflate_t d = ws_deflate_create(8, 1);
+	size_t len = 0, i;
+	int no_overrun = 1;
+
+	check(ws_deflate_inflate(reserved_type, sizeof(reserved_type), back, sizeof(back)) < 0, "malformed: reserved block type is refused");
+	check(ws_deflate_inflate(bad_nlen, sizeof(bad_nlen), back, sizeof(back)) < 0, "malformed: stored block of wrong NLEN is refused");
+	check(ws_deflate_inflate(far_distance, sizeof(far_distance), back, sizeof(back)) < 0, "malformed: distance beyond output is refused");
+	check(ws_deflate_inflate(stored_long, sizeof(stored_long), back, sizeof(back)) < 0, "malformed: stored block longer than data is refused");
+
+	if (d) {
+		make_reports(src, sizeof(src), 3);
+		len = ws_deflate_compress(d, src, sizeof(src), dst);
+		ws_deflate_destroy(d);
+	}
+	check(len > 0 && ws_deflate_inflate(dst, len, back, sizeof(src) - 1) < 0, "malformed: message longer than dst_size is refused");
+
+	// random data must end in a result within dst_size, AddressSanitizer watches buffers
+	for (i = 0; i < 10000; i++) {
+		size_t n = 1 + (size_t)(i % sizeof(dst));
+		int r;
+		make_random(dst, n, (unsigned) i);
+		r = ws_deflate_inflate(dst, n, back, sizeof(back));
+		if (r > (int) sizeof(back)) no_overrun = 0;
+	}
+	check(no_overrun, "malformed: random data stays within dst_size");
+}
+
+int main(void) {
+	check_round_trip();
+	check_context_takeover(WS_DEFLATE_WINDOW_BITS_MAX, "context takeover: messages are inflated as a stream");
+	check_context_takeover(8, "context takeover: small window is kept");
+	check_context_takeover(15, "context takeover: window beyond the maximum works");
+	check_window_limit();
+	check_malformed();
+
+	printf("%d case(s) failed\n", num_failed);
+	return num_failed? 1: 0;
+}
@@ -0,0 +1,206 @@
+/**
+ *  Simulated HID module
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <hidapi.h>
+
+#include "atom.h"
+#include "hr_clock.h"
+#include "sim_hid.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/**
+ *  Reading thread is never blocked longer than this in a call (for hid_read without timeout)
+ */
+#define SIM_HID_BLOCK_SLICE_US	(100 * 1000)
+
+/**
+ *  State of an opened HID, touched only by the thread reading it
+ */
+struct hid_device_ {
+	int index;
+	uint64_t next_ns; /// when the next report is generated
+	uint32_t seq;
+};
+
+static struct sim_hid_config sim_config = { 1, 1000, 64, 0 };
+static atom_t sim_num_writes = 0;
+
+static void sleep_us(uint64_t us) {
+#ifdef _WIN32
+	Sleep((DWORD)((us + 999) / 1000));
+#else
+	struct timespec ts;
+	ts.tv_sec = (time_t)(us / 1000000);
+	ts.tv_nsec = (long)(us % 1000000) * 1000;
+	nanosleep(&ts, 0);
+#endif
+}
+
+void sim_hid_configure(const struct sim_hid_config *cfg) {
+	sim_config = *cfg;
+	if (sim_config.report_size < SIM_HID_REPORT_MIN_SIZE) sim_config.report_size = SIM_HID_REPORT_MIN_SIZE;
+}
+
+uint32_t sim_hid_get_numof_writes(void) {
+	return atom_load_acq(&sim_num_writes);
+}
+
+int HID_API_EXPORT hid_init(void) {
+	return 0;
+}
+
+int HID_API_EXPORT hid_exit(void) {
+	return 0;
+}
+
+struct hid_device_info HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id) {
+	struct hid_device_info *root = 0;
+	int i;
+	for (i = sim_config.num_devices - 1; i >= 0; i--) {
+		struct hid_device_info *info;
+		char path[32];
+		if (vendor_id && vendor_id != SIM_HID_VENDOR_ID) break;
+		if (product_id && product_id != i) continue;
+
+		info = (struct hid_device_info *)calloc(1, sizeof(struct hid_device_info));
+		if (!info) break;
+		sprintf(path, "sim#%d", i);
+		info->path = (char *)malloc(strlen(path) + 1);
+		if (info->path) strcpy(info->path, path);
+		info->vendor_id = SIM_HID_VENDOR_ID;
+		info->product_id = (unsigned short) i;
+		info->usage_page = SIM_HID_USAGE_PAGE;
+		info->usage = SIM_HID_USAGE;
+		info->interface_number = 0;
+		info->manufacturer_string = (wchar_t *)malloc(sizeof(L"WebHID"));
+		if (info->manufacturer_string) wcscpy(info->manufacturer_string, L"WebHID");
+		info->product_string = (wchar_t *)malloc(sizeof(L"Simulated HID"));
+		if (info->product_string) wcscpy(info->product_string, L"Simulated HID");
+		info->next = root;
+		root = info;
+	}
+	return root;
+}
+
+void HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs) {
+	while (devs) {
+		struct hid_device_info *next = devs->next;
+		free(devs->path);
+		free(devs->manufacturer_string);
+		free(devs->product_string);
+		free(devs);
+		devs = next;
+	}
+}
+
+HID_API_EXPORT hid_device *HID_API_CALL hid_open_path(const char *path) {
+	hid_device *dev;
+	int index;
+	if (sscanf(path, "sim#%d", &index) != 1 || index < 0 || index >= sim_config.num_devices) return 0;
+
+	dev = (hid_device *)malloc(sizeof(hid_device));
+	if (dev) {
+		dev->index = index;
+		dev->next_ns = hr_clock_get_us() * 1000;
+		dev->seq = 0;
+	}
+	return dev;
+}
+
+HID_API_EXPORT hid_device *HID_API_CALL hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number) {
+	char path[32];
+	(void) serial_number;
+	if (vendor_id != SIM_HID_VENDOR_ID) return 0;
+	sprintf(path, "sim#%d", product_id);
+	return hid_open_path(path);
+}
+
+void HID_API_EXPORT hid_close(hid_device *dev) {
+	free(dev);
+}
+
+/**
+ *  Reports are generated on schedule; a late reader gets overdue ones at once,
+ *  and each report carries its scheduled time, so latency of reading is included in measurement
+ */
+int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds) {
+	uint64_t now_us = hr_clock_get_us();
+	uint64_t gen_us;
+	size_t size = (size_t) sim_config.report_size;
+	uint8_t report_id = 0;
+
+	if (sim_config.rate_hz <= 0) {
+		// idle HID never reports
+		if (milliseconds != 0) sleep_us(milliseconds > 0? (uint64_t) milliseconds * 1000: SIM_HID_BLOCK_SLICE_US);
+		return 0;
+	}
+
+	gen_us = dev->next_ns / 1000;
+	if (gen_us > now_us) {
+		uint64_t wait_us = gen_us - now_us;
+		uint64_t limit_us = milliseconds >= 0? (uint64_t) milliseconds * 1000: SIM_HID_BLOCK_SLICE_US;
+		if (wait_us > limit_us) {
+			if (limit_us) sleep_us(limit_us);
+			return 0;
+		}
+		sleep_us(wait_us);
+	}
+
+	if (size > length) size = length;
+	if (sim_config.num_report_ids > 0) report_id = (uint8_t)(1 + dev->seq % sim_config.num_report_ids);
+	memset(data, 0, size);
+	data[0] = report_id;
+	if (size >= SIM_HID_REPORT_MIN_SIZE) {
+		memcpy(data + SIM_HID_OFFSET_SEQUENCE, &dev->seq, sizeof(uint32_t));
+		memcpy(data + SIM_HID_OFFSET_TIMESTAMP, &gen_us, sizeof(uint64_t));
+	}
+	dev->seq++;
+	dev->next_ns += 1000000000ull / sim_config.rate_hz;
+
+	return (int) size;
+}
+
+int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length) {
+	return hid_read_timeout(dev, data, length, -1);
+}
+
+int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock) {
+	(void) dev;
+	(void) nonblock;
+	return 0;
+}
+
+int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length) {
+	(void) dev;
+	(void) data;
+	atom_fetch_add(&sim_num_writes, 1);
+	return (int) length;
+}
+
+int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length) {
+	(void) dev;
+	(void) data;
+	return (int) length;
+}
+
+int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data, size_t length) {
+	(void) dev;
+	if (length < 2) return -1;
+	memset(data + 1, 0, length - 1); // report ID in data[0] is kept
+	return (int) length;
+}
+
+HID_API_EXPORT const wchar_t *HID_API_CALL hid_error(hid_device *dev) {
+	(void) dev;
+	return L"simulated HID error";
+}
@@ -0,0 +1,45 @@
+/**
+ *  Simulated HID module
+ *  It implements HIDAPI with virtual HIDs generating input reports at a fixed rate,
+ *  so the server can be measured without hardware
+ */
+
+#ifndef _SIM_HID_H_
+#define _SIM_HID_H_
+
+#include <stdint.h>
+
+/**
+ *  Every simulated HID has these IDs; product ID is its index
+ *  Virtual-path of the n-th one is "/hid/0000/f055/{n}/ff00/0001/"
+ */
+#define SIM_HID_VENDOR_ID	(0xf055)
+#define SIM_HID_USAGE_PAGE	(0xff00)
+#define SIM_HID_USAGE		(0x0001)
+
+/**
+ *  Each input report is laid out as
+ *  [uint8_t report ID (0 without IDs)][uint32_t sequence][uint64_t time generated (hr_clock_get_us)][padding...]
+ */
+#define SIM_HID_OFFSET_SEQUENCE		(1)
+#define SIM_HID_OFFSET_TIMESTAMP	(5)
+#define SIM_HID_REPORT_MIN_SIZE		(13)
+
+struct sim_hid_config {
+	int num_devices;
+	int rate_hz; /// input reports per second of each HID, 0 for an idle one
+	int report_size; /// bytes of an input report including report ID
+	int num_report_ids; /// report IDs are cycled from 1, 0 for a HID without report ID
+};
+
+/**
+ *  Set up simulated HIDs, it must be called before any HIDAPI call
+ */
+void sim_hid_configure(const struct sim_hid_config *cfg);
+
+/**
+ *  Returns number of output reports written so far
+ */
+uint32_t sim_hid_get_numof_writes(void);
+
+#endif //#ifndef _SIM_HID_H_
@@ -0,0 +1,219 @@
+/**
+ *  Variable Length Queue module
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "vl_queue.h"
+
+#define VL_QUEUE_DEFAULT_SIZE (8)
+#define VL_QUEUE_MAXIMUM_SIZE (64)
+#define VL_QUEUE_DEFAULT_SLOT_SIZE (64) /// report of full-speed USB HID
+
+/**
+ *  Byte arrays are concatenated in a circular store, and their sizes are kept in a ring,
+ *  so pushing and popping are O(1) and pending bytes are one or two contiguous spans.
+ *  The store grows only when pending bytes exceed it, so there is no heap traffic in steady state
+ */
+struct _vl_queue {
+	uint8_t *store;
+	size_t capacity; /// bytes of store
+	size_t head; /// offset of the oldest byte in store
+	size_t num_bytes;
+	size_t sizes[VL_QUEUE_MAXIMUM_SIZE]; /// ring of sizes of byte arrays
+	size_t first; /// index of the oldest byte array in sizes
+	size_t num_packets;
+};
+
+#ifdef _DEBUG
+#include <stdio.h>
+#define VL_QUEUE_ASSERT(exp)	\
+	do { if(!(exp)) printf("%s (% 4d): [ASSERT] \"%s\" is falsy\r\n", __FUNCTION__, __LINE__, #exp); } while(0)
+#define VL_QUEUE_TRACE(q)		\
+	do { printf("%s (% 4d): %s = { num_packets: %d, num_bytes: %d, capacity: %d }\r\n", __FUNCTION__, __LINE__, #q, q->num_packets, q->num_bytes, q->capacity); }while(0)
+#else //_DEBUG
+#define VL_QUEUE_ASSERT(exp)
+#define VL_QUEUE_TRACE(q)
+#endif //_DEBUG
+
+vl_queue_t vl_queue_create(void) {
+	return vl_queue_create_sized(VL_QUEUE_DEFAULT_SLOT_SIZE);
+}
+
+vl_queue_t vl_queue_create_sized(size_t max_size_byte) {
+	vl_queue_t q = (vl_queue_t) malloc(sizeof(struct _vl_queue));
+	if (q)
+	{
+		size_t capacity = (max_size_byte? max_size_byte: 1) * VL_QUEUE_DEFAULT_SIZE;
+		uint8_t *store = (uint8_t *)malloc(capacity);
+
+		if (store) {
+			q->store = store;
+			q->capacity = capacity;
+			q->head = 0;
+			q->num_bytes = 0;
+			q->first = 0;
+			q->num_packets = 0;
+		} else {
+			free(q);
+			q = 0;
+		}
+	}
+
+	return q;
+}
+
+void vl_queue_destroy(vl_queue_t q) {
+	free(q->store);
+	free(q);
+}
+
+/**
+ *  Copy bytes out of store from offset, which may wrap around
+ */
+static void vlq_copy_out(const vl_queue_t q, size_t offset, uint8_t *dst, size_t size_byte) {
+	size_t first = q->capacity - offset;
+	if (first >= size_byte) {
+		memcpy(dst, q->store + offset, size_byte);
+	} else {
+		memcpy(dst, q->store + offset, first);
+		memcpy(dst + first, q->store, size_byte - first);
+	}
+}
+
+/**
+ *  Release bytes of the oldest byte arrays, a byte array partially released keeps the rest
+ */
+static void vlq_release(vl_queue_t q, size_t size_byte) {
+	VL_QUEUE_ASSERT(size_byte <= q->num_bytes);
+	q->head += size_byte;
+	if (q->head >= q->capacity) q->head -= q->capacity;
+	q->num_bytes -= size_byte;
+	while (size_byte && q->num_packets) {
+		size_t *size = &q->sizes[q->first];
+		if (*size > size_byte) {
+			*size -= size_byte;
+			break;
+		}
+		size_byte -= *size;
+		q->first = (q->first + 1) % VL_QUEUE_MAXIMUM_SIZE;
+		q->num_packets--;
+	}
+	if (q->num_packets == 0) q->head = 0; // keep the next push contiguous
+}
+
+/**
+ *  Release the oldest num byte arrays as a whole (even when they are empty), which hold size_byte
+ */
+static void vlq_drop(vl_queue_t q, size_t num, size_t size_byte) {
+	q->first = (q->first + num) % VL_QUEUE_MAXIMUM_SIZE;
+	q->num_packets -= num;
+	q->num_bytes -= size_byte;
+	q->head += size_byte;
+	if (q->head >= q->capacity) q->head -= q->capacity;
+	if (q->num_packets == 0) q->head = 0; // keep the next push contiguous
+}
+
+/**
+ *  Grow store to hold size_byte more, pending bytes are unwrapped to its front
+ *  It returns 1 on success; 0 on fail
+ */
+static int vlq_extend(vl_queue_t q, size_t size_byte) {
+	size_t capacity = q->capacity * 2;
+	uint8_t *store;
+	if (capacity < q->num_bytes + size_byte) capacity = q->num_bytes + size_byte;
+	store = (uint8_t *)malloc(capacity);
+	if (!store) {
+		VL_QUEUE_TRACE(q);
+		return 0;
+	}
+	if (q->num_bytes) vlq_copy_out(q, q->head, store, q->num_bytes);
+	free(q->store);
+	q->store = store;
+	q->capacity = capacity;
+	q->head = 0;
+	return 1;
+}
+
+int vl_queue_push(vl_queue_t q, const uint8_t *src, size_t size_byte) {
+	size_t tail, first;
+
+	// check queue size
+	VL_QUEUE_ASSERT(q->num_packets <= VL_QUEUE_MAXIMUM_SIZE);
+	if (q->num_packets == VL_QUEUE_MAXIMUM_SIZE) { // erase head packet
+		vlq_drop(q, 1, q->sizes[q->first]);
+	}
+	if (q->num_bytes + size_byte > q->capacity && !vlq_extend(q, size_byte)) return -1;
+
+	tail = q->head + q->num_bytes;
+	if (tail >= q->capacity) tail -= q->capacity;
+	first = q->capacity - tail;
+	if (first >= size_byte) {
+		memcpy(q->store + tail, src, size_byte);
+	} else {
+		memcpy(q->store + tail, src, first);
+		memcpy(q->store, src + first, size_byte - first);
+	}
+	q->num_bytes += size_byte;
+	q->sizes[(q->first + q->num_packets) % VL_QUEUE_MAXIMUM_SIZE] = size_byte;
+	q->num_packets++;
+	return size_byte;
+}
+
+int vl_queue_pop(vl_queue_t q, uint8_t *dst, size_t size_byte) {
+	if (q->num_packets) {
+		size_t size = q->sizes[q->first];
+		if (dst && size_byte) {
+			int ret = size < size_byte? size: size_byte;
+			vlq_copy_out(q, q->head, dst, ret);
+			vlq_drop(q, 1, size); // rest of the array is discarded
+			return ret;
+		} else {
+			return size;
+		}
+	} else {
+		return 0;
+	}
+}
+
+int vl_queue_pop_all(vl_queue_t q, uint8_t *dst, size_t size_byte) {
+	size_t len = 0;
+	if (dst && size_byte) {
+		size_t i;
+		// whole byte arrays fitting in buffer
+		for (i = 0; i < q->num_packets; i++) {
+			size_t size = q->sizes[(q->first + i) % VL_QUEUE_MAXIMUM_SIZE];
+			if (len + size > size_byte) break;
+			len += size;
+		}
+		if (len) vlq_copy_out(q, q->head, dst, len);
+		vlq_drop(q, i, len);
+	} else {
+		len = q->num_bytes;
+	}
+	return len;
+}
+
+int vl_queue_peek(const vl_queue_t q, struct vl_queue_span spans[2]) {
+	size_t first = q->capacity - q->head;
+	if (q->num_bytes == 0) return 0;
+	spans[0].data = q->store + q->head;
+	if (first >= q->num_bytes) {
+		spans[0].size = q->num_bytes;
+		return 1;
+	}
+	spans[0].size = first;
+	spans[1].data = q->store;
+	spans[1].size = q->num_bytes - first;
+	return 2;
+}
+
+void vl_queue_commit(vl_queue_t q, size_t size_byte) {
+	if (size_byte > q->num_bytes) size_byte = q->num_bytes;
+	vlq_release(q, size_byte);
+}
+
+int vl_queue_get_size(const vl_queue_t q)
+{
+	return q->num_packets;
+}
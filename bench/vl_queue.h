@@ -1,6 +1,8 @@
 /**
  *  Variable Length Queue module 
  *  It is only for queuing byte array
+ *  The server does not link it (input reports are queued in bc_ring),
+ *  it is kept under bench/ as the subject of ContainerBench
  */
 
 #ifndef _VL_QUEUE_H_
@@ -14,11 +16,25 @@
 struct _vl_queue;
 typedef struct _vl_queue *vl_queue_t;
 
+/**
+ *  Read-only bytes in queue
+ */
+struct vl_queue_span {
+	const uint8_t *data;
+	size_t size;
+};
+
 /**
  *  Create a new queue
  */
 vl_queue_t vl_queue_create(void);
 
+/**
+ *  Create a new queue for byte arrays up to max_size_byte (e.g. the longest report of a device)
+ *  Its store is sized for them at first, and grows when more bytes are pending
+ */
+vl_queue_t vl_queue_create_sized(size_t max_size_byte);
+
 /**
  *  Release all byte arrays held in queue and resouce to manage the queue
  */
@@ -44,6 +60,20 @@ int vl_queue_pop(vl_queue_t q, uint8_t *dst, size_t size_byte);
  */
 int vl_queue_pop_all(vl_queue_t q, uint8_t *dst, size_t size_byte);
 
+/**
+ *  Get all bytes held in queue without copying, as concatenated byte arrays
+ *  They are in one span, or two when they wrap around the store
+ *  It returns number of spans filled (0 when queue is empty); spans are valid until queue is changed
+ *  ContainerBench compares it with vl_queue_pop_all, which copies them
+ */
+int vl_queue_peek(const vl_queue_t q, struct vl_queue_span spans[2]);
+
+/**
+ *  Release bytes from front of queue after they are consumed through vl_queue_peek
+ *  A byte array partially released keeps the rest of its bytes
+ */
+void vl_queue_commit(vl_queue_t q, size_t size_byte);
+
 /**
  *  Returns number of byte-arrays buffered in Queue
  */
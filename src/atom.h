@@ -0,0 +1,171 @@
+/**
+ *  Atomic operation module
+ *  Minimal wrappers of compiler intrinsics to share words between threads
+ */
+
+#ifndef _ATOM_H_
+#define _ATOM_H_
+
+#include <stdint.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#pragma intrinsic(_ReadWriteBarrier, _InterlockedExchange, _InterlockedExchangeAdd, _InterlockedCompareExchange)
+#if defined(_WIN64)
+#pragma intrinsic(_InterlockedExchangePointer, _InterlockedCompareExchangePointer)
+#endif
+
+/**
+ *  Type of a word shared between threads
+ */
+typedef volatile long atom_t;
+
+#define ATOM_INLINE static __inline
+
+/**
+ *  Load a word; later loads/stores are not reordered before it
+ *  (x86 loads are acquire by nature, so only the compiler must be fenced)
+ */
+ATOM_INLINE uint32_t atom_load_acq(const atom_t *p) {
+	uint32_t v = (uint32_t) *p;
+	_ReadWriteBarrier();
+	return v;
+}
+
+/**
+ *  Store a word; earlier loads/stores are not reordered after it
+ */
+ATOM_INLINE void atom_store_rel(atom_t *p, uint32_t v) {
+	_ReadWriteBarrier();
+	*p = (long) v;
+}
+
+/**
+ *  Add to a word and return the previous value
+ *  Read-modify-write operations below are full barriers
+ */
+ATOM_INLINE uint32_t atom_fetch_add(atom_t *p, uint32_t v) {
+	return (uint32_t) _InterlockedExchangeAdd(p, (long) v);
+}
+
+/**
+ *  Replace a word and return the previous value
+ */
+ATOM_INLINE uint32_t atom_exchange(atom_t *p, uint32_t v) {
+	return (uint32_t) _InterlockedExchange(p, (long) v);
+}
+
+/**
+ *  Replace a word only when it equals to expected one
+ *  It returns 1 on replaced; 0 on not
+ */
+ATOM_INLINE int atom_cas(atom_t *p, uint32_t expected, uint32_t desired) {
+	return (uint32_t) _InterlockedCompareExchange(p, (long) desired, (long) expected) == expected;
+}
+
+/**
+ *  Loads after it are not reordered before loads prior to it
+ *  (x86 never reorders loads with other loads)
+ */
+ATOM_INLINE void atom_fence_acq(void) {
+	_ReadWriteBarrier();
+}
+
+/**
+ *  Type of a pointer shared between threads
+ */
+typedef void *volatile atom_ptr_t;
+
+/**
+ *  Load and store of a pointer, ordered as atom_load_acq and atom_store_rel
+ */
+ATOM_INLINE void *atom_ptr_load_acq(const atom_ptr_t *p) {
+	void *v = *p;
+	_ReadWriteBarrier();
+	return v;
+}
+
+ATOM_INLINE void atom_ptr_store_rel(atom_ptr_t *p, void *v) {
+	_ReadWriteBarrier();
+	*p = v;
+}
+
+/**
+ *  Replace a pointer and return the previous one, it is a full barrier
+ */
+ATOM_INLINE void *atom_ptr_exchange(atom_ptr_t *p, void *v) {
+#if defined(_WIN64)
+	return _InterlockedExchangePointer(p, v);
+#else
+	return (void *) _InterlockedExchange((volatile long *) p, (long) v);
+#endif
+}
+
+/**
+ *  Replace a pointer only when it equals to expected one, it is a full barrier
+ *  It returns 1 on replaced; 0 on not
+ */
+ATOM_INLINE int atom_ptr_cas(atom_ptr_t *p, void *expected, void *desired) {
+#if defined(_WIN64)
+	return _InterlockedCompareExchangePointer(p, desired, expected) == expected;
+#else
+	return (void *) _InterlockedCompareExchange((volatile long *) p, (long) desired, (long) expected) == expected;
+#endif
+}
+
+#else // GCC, Clang
+
+typedef volatile uint32_t atom_t;
+
+#define ATOM_INLINE static __inline__
+
+ATOM_INLINE uint32_t atom_load_acq(const atom_t *p) {
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+ATOM_INLINE void atom_store_rel(atom_t *p, uint32_t v) {
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+ATOM_INLINE uint32_t atom_fetch_add(atom_t *p, uint32_t v) {
+	return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST);
+}
+
+ATOM_INLINE uint32_t atom_exchange(atom_t *p, uint32_t v) {
+	return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+ATOM_INLINE int atom_cas(atom_t *p, uint32_t expected, uint32_t desired) {
+	return __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+ATOM_INLINE void atom_fence_acq(void) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+}
+
+typedef void *volatile atom_ptr_t;
+
+ATOM_INLINE void *atom_ptr_load_acq(const atom_ptr_t *p) {
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+ATOM_INLINE void atom_ptr_store_rel(atom_ptr_t *p, void *v) {
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+ATOM_INLINE void *atom_ptr_exchange(atom_ptr_t *p, void *v) {
+	return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+ATOM_INLINE int atom_ptr_cas(atom_ptr_t *p, void *expected, void *desired) {
+	return __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+#endif
+
+/**
+ *  Size of a cache line to separate words written by different threads
+ */
+#define ATOM_CACHE_LINE_SIZE (64)
+
+#endif //#ifndef _ATOM_H_
@@ -0,0 +1,110 @@
+/**
+ *  Broadcast Ring module
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "atom.h"
+#include "bc_ring.h"
+
+#ifdef _DEBUG
+#include <stdio.h>
+#define BC_RING_TRACE(msg)	\
+	printf("%s (% 4d): %s\r\n", __FUNCTION__, __LINE__, msg)
+#else //_DEBUG
+#define BC_RING_TRACE(msg)
+#endif //_DEBUG
+
+/**
+ *  Each slot begins with this header
+ *  seq is (sequence number + 1) of the array held, or 0 while it is written
+ */
+struct bc_ring_slot {
+	atom_t seq;
+	uint32_t size;
+};
+
+struct _bc_ring {
+	uint32_t mask;
+	size_t slot_size;
+	size_t slot_stride;
+	uint8_t *slots;
+	uint8_t pad[ATOM_CACHE_LINE_SIZE];
+	atom_t head; /// written by producer only
+	uint8_t pad_tail[ATOM_CACHE_LINE_SIZE - sizeof(atom_t)];
+};
+
+#define BC_RING_SLOT(r, seq)	((struct bc_ring_slot *)((r)->slots + ((seq) & (r)->mask) * (r)->slot_stride))
+
+bc_ring_t bc_ring_create(size_t num_slots, size_t slot_size) {
+	bc_ring_t r = (bc_ring_t) malloc(sizeof(struct _bc_ring));
+	if (r) {
+		uint32_t n = 1;
+		while (n < num_slots) n <<= 1;
+
+		r->mask = n - 1;
+		r->slot_size = slot_size;
+		r->slot_stride = (sizeof(struct bc_ring_slot) + slot_size + 7) & ~(size_t)7;
+		r->slots = (uint8_t *)calloc(n, r->slot_stride); // seq = 0: nothing is held
+		r->head = 0;
+		if (!r->slots) {
+			BC_RING_TRACE("failed to allocate memory");
+			free(r);
+			r = 0;
+		}
+	}
+
+	return r;
+}
+
+void bc_ring_destroy(bc_ring_t r) {
+	free(r->slots);
+	free(r);
+}
+
+uint32_t bc_ring_get_capacity(const bc_ring_t r) {
+	return r->mask + 1;
+}
+
+int bc_ring_push(bc_ring_t r, const uint8_t *src, size_t size_byte) {
+	uint32_t head = r->head; // only producer writes it
+	struct bc_ring_slot *slot;
+
+	if (size_byte > r->slot_size) return -1;
+
+	slot = BC_RING_SLOT(r, head);
+	atom_exchange(&slot->seq, 0); // readers of the old array see it being overwritten
+	slot->size = (uint32_t) size_byte;
+	memcpy(slot + 1, src, size_byte);
+	atom_store_rel(&slot->seq, head + 1);
+	atom_store_rel(&r->head, head + 1);
+
+	return size_byte;
+}
+
+uint32_t bc_ring_get_head(const bc_ring_t r) {
+	return atom_load_acq(&r->head);
+}
+
+uint32_t bc_ring_catch_up(const bc_ring_t r, uint32_t *cursor, uint32_t head) {
+	uint32_t behind = head - *cursor;
+	if (behind > r->mask + 1) {
+		uint32_t lost = behind - (r->mask + 1);
+		*cursor += lost;
+		return lost;
+	}
+	return 0;
+}
+
+const uint8_t *bc_ring_peek(const bc_ring_t r, uint32_t seq, size_t *size_byte) {
+	const struct bc_ring_slot *slot = BC_RING_SLOT(r, seq);
+	if (atom_load_acq(&slot->seq) != seq + 1) return 0;
+	*size_byte = slot->size <= r->slot_size? slot->size: r->slot_size;
+	return (const uint8_t *)(slot + 1);
+}
+
+int bc_ring_is_valid(const bc_ring_t r, uint32_t seq) {
+	const struct bc_ring_slot *slot = BC_RING_SLOT(r, seq);
+	atom_fence_acq(); // reading the content completes before seq is checked again
+	return atom_load_acq(&slot->seq) == seq + 1;
+}
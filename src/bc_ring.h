@@ -0,0 +1,68 @@
+/**
+ *  Broadcast Ring module
+ *  It is a lock-free ring of byte arrays written by one producer
+ *  and read by any number of consumers, each with its own cursor
+ *  Producer never waits; a consumer lapped by the producer loses the oldest arrays
+ */
+
+#ifndef _BC_RING_H_
+#define _BC_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ *  Type of the ring is pointer to struct
+ */
+struct _bc_ring;
+typedef struct _bc_ring *bc_ring_t;
+
+/**
+ *  Create a new ring
+ *  num_slots is rounded up to power of 2, slot_size is the maximum length of a byte array
+ */
+bc_ring_t bc_ring_create(size_t num_slots, size_t slot_size);
+
+/**
+ *  Release the ring
+ *  Producer and all of consumers must have stopped
+ */
+void bc_ring_destroy(bc_ring_t r);
+
+/**
+ *  Returns number of byte arrays the ring can hold
+ */
+uint32_t bc_ring_get_capacity(const bc_ring_t r);
+
+/**
+ *  [Producer] Push a new byte array, overwriting the oldest one when ring is full
+ *  It returns size_byte on success; -1 when array is too long
+ */
+int bc_ring_push(bc_ring_t r, const uint8_t *src, size_t size_byte);
+
+/**
+ *  [Consumer] Returns sequence number which next pushed array will get
+ *  A new consumer starts its cursor from it
+ */
+uint32_t bc_ring_get_head(const bc_ring_t r);
+
+/**
+ *  [Consumer] Move cursor to the oldest array held when it has been lapped by producer
+ *  It returns number of arrays lost
+ */
+uint32_t bc_ring_catch_up(const bc_ring_t r, uint32_t *cursor, uint32_t head);
+
+/**
+ *  [Consumer] Refer an array in place by its sequence number
+ *  It returns 0 when the array is not held (overwritten or being written)
+ *  The content must be verified by bc_ring_is_valid after it is read
+ */
+const uint8_t *bc_ring_peek(const bc_ring_t r, uint32_t seq, size_t *size_byte);
+
+/**
+ *  [Consumer] Check the array peeked has not been overwritten while reading
+ *  It returns 1 on valid; 0 on overwritten
+ */
+int bc_ring_is_valid(const bc_ring_t r, uint32_t seq);
+
+#endif //#ifndef _BC_RING_H_
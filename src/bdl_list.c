@@ -109,7 +109,7 @@ void *bdl_list_delete_node(bdl_list_t ls, bdl_list_node_t node) {
 		bdl_list_node_t tl = node->next;
 
 		while (hd->prev) hd = hd->prev;
-		while (tl->next) tl = hd->next;
+		while (tl->next) tl = tl->next;
 		// now, head->prev == 0 && tail->next == 0
 		if (hd == &ls->head && tl == &ls->tail) {
 			// node is in this list
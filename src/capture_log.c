@@ -0,0 +1,662 @@
+/**
+ *  Capture Log module
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "atom.h"
+#include "hr_clock.h"
+#include "capture_log.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else //_WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif //_WIN32
+
+#ifdef _DEBUG
+#define CAPTURE_LOG_TRACE(msg)	\
+	printf("%s (% 4d): %s\r\n", __FUNCTION__, __LINE__, msg)
+#else //_DEBUG
+#define CAPTURE_LOG_TRACE(msg)
+#endif //_DEBUG
+
+/**
+ *  Longest path of a segment file
+ */
+#define CAPTURE_LOG_PATH_MAX	(CAPTURE_LOG_PREFIX_MAX + 16)
+/**
+ *  Interval to retry creating a segment after it failed (e.g. disk full), not to try it on every report
+ */
+#define CAPTURE_LOG_RETRY_US	(1000000)
+
+#define CAPTURE_LOG_MAGIC	"WHIDCAP1"
+#define CAPTURE_LOG_VERSION	(1)
+
+/**
+ *  Header at the top of a segment file (little-endian)
+ */
+struct capture_segment_header {
+	char magic[8]; /// CAPTURE_LOG_MAGIC
+	uint32_t version;
+	uint32_t header_size; /// records start at this offset
+	atom_t used; /// bytes of records after the header, stored after a record is written
+	uint32_t segment; /// index of the segment in the log
+	uint64_t first_us; /// timestamp of the first record, valid when used is not 0
+	uint64_t started_us; /// monotonic time when the log was created
+	uint64_t wall_clock_offset_us; /// add it to monotonic time to get microseconds since 1970-01-01 UTC
+	uint8_t reserved[16];
+};
+
+/**
+ *  Header of a record, followed by the report and padding to a multiple of 8 bytes
+ */
+struct capture_record_header {
+	uint64_t timestamp_us; /// monotonic time when the report was read
+	uint32_t length; /// of the report
+	uint32_t seq; /// number of the record in the log
+};
+
+#define RECORD_SIZE(len)	((sizeof(struct capture_record_header) + (len) + 7) & ~(size_t) 7)
+
+/// File mapped in memory
+
+struct segment_map {
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int fd;
+#endif
+	uint8_t *base; /// 0 when not mapped
+	size_t size;
+};
+
+#ifdef _WIN32
+
+static uint64_t get_wall_clock_us(void) {
+	FILETIME ft;
+	ULARGE_INTEGER t;
+	GetSystemTimeAsFileTime(&ft);
+	t.LowPart = ft.dwLowDateTime;
+	t.HighPart = ft.dwHighDateTime;
+	return (t.QuadPart - 116444736000000000ULL) / 10; // 100ns since 1601 to us since 1970
+}
+
+static void delete_file(const char *path) {
+	DeleteFileA(path); // fails while a reader maps it, then it is left
+}
+
+/**
+ *  Map a file, created with size when writable (existing one is overwritten) or opened with its size when not
+ */
+static int map_file(struct segment_map *m, const char *path, size_t size, int writable) {
+	LARGE_INTEGER file_size;
+	m->base = 0;
+	m->mapping = 0;
+	m->file = CreateFileA(path, writable? GENERIC_READ | GENERIC_WRITE: GENERIC_READ,
+		writable? FILE_SHARE_READ | FILE_SHARE_DELETE: FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, writable? CREATE_ALWAYS: OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m->file == INVALID_HANDLE_VALUE) return 0;
+	if (!writable) {
+		if (!GetFileSizeEx(m->file, &file_size) || file_size.QuadPart == 0) goto FAIL;
+		size = (size_t) file_size.QuadPart;
+	}
+	m->mapping = CreateFileMappingA(m->file, NULL, writable? PAGE_READWRITE: PAGE_READONLY,
+		(DWORD)((uint64_t) size >> 32), (DWORD)(size & 0xffffffff), NULL);
+	if (!m->mapping) goto FAIL;
+	m->base = (uint8_t *) MapViewOfFile(m->mapping, writable? FILE_MAP_WRITE: FILE_MAP_READ, 0, 0, size);
+	if (!m->base) goto FAIL;
+	m->size = size;
+	return 1;
+
+FAIL:
+	if (m->mapping) CloseHandle(m->mapping);
+	CloseHandle(m->file);
+	return 0;
+}
+
+/**
+ *  Unmap a file, truncating it to length unless it is 0
+ */
+static void unmap_file(struct segment_map *m, size_t length) {
+	UnmapViewOfFile(m->base);
+	CloseHandle(m->mapping);
+	if (length) {
+		LARGE_INTEGER pos;
+		pos.QuadPart = (LONGLONG) length;
+		// it fails while a reader maps the file, which is left as it is
+		if (SetFilePointerEx(m->file, pos, NULL, FILE_BEGIN)) SetEndOfFile(m->file);
+	}
+	CloseHandle(m->file);
+	m->base = 0;
+}
+
+#else //_WIN32
+
+static uint64_t get_wall_clock_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void delete_file(const char *path) {
+	unlink(path); // a reader mapping it still reads it
+}
+
+/**
+ *  Map a file, created with size when writable (existing one is overwritten) or opened with its size when not
+ */
+static int map_file(struct segment_map *m, const char *path, size_t size, int writable) {
+	void *p;
+	m->base = 0;
+	if (writable) {
+		unlink(path); // not to truncate a file a reader maps
+		m->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (m->fd < 0) return 0;
+#ifdef __linux__
+		// allocate blocks now, or the thread writing the mapping gets SIGBUS when disk is full
+		if (posix_fallocate(m->fd, 0, (off_t) size) != 0) goto FAIL;
+#else
+		if (ftruncate(m->fd, (off_t) size) != 0) goto FAIL;
+#endif
+	} else {
+		struct stat st;
+		m->fd = open(path, O_RDONLY);
+		if (m->fd < 0) return 0;
+		if (fstat(m->fd, &st) != 0 || st.st_size == 0) goto FAIL;
+		size = (size_t) st.st_size;
+	}
+	p = mmap(NULL, size, writable? PROT_READ | PROT_WRITE: PROT_READ, MAP_SHARED, m->fd, 0);
+	if (p == MAP_FAILED) goto FAIL;
+	m->base = (uint8_t *) p;
+	m->size = size;
+	return 1;
+
+FAIL:
+	close(m->fd);
+	if (writable) unlink(path);
+	return 0;
+}
+
+/**
+ *  Unmap a file, truncating it to length unless it is 0
+ */
+static void unmap_file(struct segment_map *m, size_t length) {
+	munmap(m->base, m->size);
+	if (length && ftruncate(m->fd, (off_t) length) != 0) {
+		CAPTURE_LOG_TRACE("failed to truncate segment");
+	}
+	close(m->fd);
+	m->base = 0;
+}
+
+#endif //_WIN32
+
+static void make_segment_path(char *buf, const char *prefix, uint32_t segment) {
+	sprintf(buf, "%s-%06u.whc", prefix, (unsigned) segment);
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// Writer
+//////////////////////////////////////////////////////////////////////////
+
+struct _capture_log {
+	char prefix[CAPTURE_LOG_PREFIX_MAX];
+	size_t segment_size;
+	uint32_t max_segments;
+	struct segment_map map; /// segment being written
+	struct capture_segment_header *header;
+	uint32_t used; /// bytes of records in the segment (writer only)
+	uint64_t started_us;
+	uint64_t wall_clock_offset_us;
+	atom_t first_segment; /// changed by helper thread after create
+	atom_t last_segment; /// changed by writer after create
+	atom_t records;
+	atom_t lost;
+	/// Next segment created by helper thread, the writer takes it while spare_ready is set
+	struct segment_map spare;
+	uint32_t spare_segment;
+	atom_t spare_ready; /// boolean
+	/// Fields below are changed under mutex of the module
+	struct segment_map retired; /// segment left by writer, to be closed by helper thread
+	uint32_t retired_used;
+	int has_retired; /// boolean
+	int wants_spare; /// boolean, helper thread is asked to create the next segment
+	int busy; /// boolean, helper thread works for the log without mutex
+	uint64_t retry_us; /// when creating a spare is retried after it failed
+	struct _capture_log *next; /// in the list of logs served by helper thread
+};
+
+/// Helper thread of the module, it creates and closes segment files so that the writer makes no system call
+
+static pthread_t helper_thread;
+static int helper_started = 0; /// boolean
+static pthread_mutex_t helper_mutex;
+static pthread_cond_t helper_cond; /// helper waits for work, and destroy waits for helper leaving a log
+static int helper_stop = 0; /// boolean
+static capture_log_t helper_logs = 0; /// logs being written
+
+/**
+ *  Create segment of index as a file mapped in m, with its header
+ *  It returns the header on success; 0 on fail
+ */
+static struct capture_segment_header *create_segment(capture_log_t c, uint32_t segment, struct segment_map *m) {
+	char path[CAPTURE_LOG_PATH_MAX];
+	struct capture_segment_header *h;
+
+	make_segment_path(path, c->prefix, segment);
+	if (!map_file(m, path, c->segment_size, 1)) {
+		CAPTURE_LOG_TRACE("failed to create segment");
+		return 0;
+	}
+	h = (struct capture_segment_header *) m->base;
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, CAPTURE_LOG_MAGIC, sizeof(h->magic));
+	h->version = CAPTURE_LOG_VERSION;
+	h->header_size = sizeof(*h);
+	h->segment = segment;
+	h->started_us = c->started_us;
+	h->wall_clock_offset_us = c->wall_clock_offset_us;
+	return h;
+}
+
+/**
+ *  Delete the oldest segments beyond the limit, called by helper thread
+ */
+static void delete_old_segments(capture_log_t c) {
+	uint32_t first = atom_load_acq(&c->first_segment);
+	uint32_t last = atom_load_acq(&c->last_segment);
+	while (last - first + 1 > c->max_segments) {
+		char path[CAPTURE_LOG_PATH_MAX];
+		atom_store_rel(&c->first_segment, first + 1); // readers do not start to read it from now on
+		make_segment_path(path, c->prefix, first);
+		delete_file(path);
+		first++;
+	}
+}
+
+/**
+ *  Find a log having work for helper thread, called under mutex
+ *  *wait_us is made shorter to the earliest retry of a log waiting for it (left as it is when none waits)
+ */
+static capture_log_t find_work(uint64_t now_us, uint64_t *wait_us) {
+	capture_log_t c;
+	for (c = helper_logs; c; c = c->next) {
+		if (c->has_retired) return c;
+		if (c->wants_spare) {
+			if (now_us >= c->retry_us) return c;
+			if (c->retry_us - now_us < *wait_us) *wait_us = c->retry_us - now_us;
+		}
+	}
+	return 0;
+}
+
+static void *proc_helper(void *param) {
+	(void) param;
+	pthread_mutex_lock(&helper_mutex);
+	while (!helper_stop) {
+		uint64_t now_us = hr_clock_get_us(), wait_us = UINT64_MAX;
+		capture_log_t c = find_work(now_us, &wait_us);
+		struct segment_map retired;
+		uint32_t retired_used = 0;
+		int has_retired, wants_spare, created = 0;
+
+		if (!c) {
+			if (wait_us == UINT64_MAX) {
+				pthread_cond_wait(&helper_cond, &helper_mutex);
+			} else {
+				// deadline of pthread_cond_timedwait is on the wall clock
+				uint64_t deadline_us = get_wall_clock_us() + wait_us;
+				struct timespec ts;
+				ts.tv_sec = (time_t)(deadline_us / 1000000);
+				ts.tv_nsec = (long)(deadline_us % 1000000) * 1000;
+				pthread_cond_timedwait(&helper_cond, &helper_mutex, &ts);
+			}
+			continue;
+		}
+		has_retired = c->has_retired;
+		wants_spare = c->wants_spare && now_us >= c->retry_us;
+		if (has_retired) {
+			retired = c->retired;
+			retired_used = c->retired_used;
+			c->has_retired = 0;
+		}
+		c->busy = 1;
+		pthread_mutex_unlock(&helper_mutex);
+
+		// the log is not destroyed while busy, and the writer touches neither retired nor spare meanwhile
+		if (has_retired) {
+			unmap_file(&retired, sizeof(struct capture_segment_header) + retired_used);
+			delete_old_segments(c);
+		}
+		if (wants_spare) {
+			c->spare_segment = atom_load_acq(&c->last_segment) + 1;
+			created = create_segment(c, c->spare_segment, &c->spare) != 0;
+			if (created) atom_store_rel(&c->spare_ready, 1);
+		}
+
+		pthread_mutex_lock(&helper_mutex);
+		c->busy = 0;
+		if (wants_spare) {
+			if (created) c->wants_spare = 0;
+			else c->retry_us = hr_clock_get_us() + CAPTURE_LOG_RETRY_US; // e.g. disk is full
+		}
+		pthread_cond_broadcast(&helper_cond);
+	}
+	pthread_mutex_unlock(&helper_mutex);
+	return 0;
+}
+
+int capture_log_initialize(void) {
+	if (helper_started) return 1;
+	pthread_mutex_init(&helper_mutex, NULL);
+	pthread_cond_init(&helper_cond, NULL);
+	helper_stop = 0;
+	helper_logs = 0;
+	if (pthread_create(&helper_thread, 0, proc_helper, 0) != 0) {
+		CAPTURE_LOG_TRACE("failed to start helper thread");
+		pthread_cond_destroy(&helper_cond);
+		pthread_mutex_destroy(&helper_mutex);
+		return 0;
+	}
+	helper_started = 1;
+	return 1;
+}
+
+void capture_log_finalize(void) {
+	if (!helper_started) return;
+	pthread_mutex_lock(&helper_mutex);
+	helper_stop = 1;
+	pthread_cond_broadcast(&helper_cond);
+	pthread_mutex_unlock(&helper_mutex);
+	pthread_join(helper_thread, NULL);
+	pthread_cond_destroy(&helper_cond);
+	pthread_mutex_destroy(&helper_mutex);
+	helper_started = 0;
+}
+
+/**
+ *  Move on to the spare segment created by helper thread, and let helper close the full one
+ *  It makes no system call but waking helper thread up
+ *  It returns 1 on success; 0 when the spare is not ready yet (e.g. it could not be created)
+ */
+static int rotate_segment(capture_log_t c) {
+	struct segment_map full = c->map;
+	uint32_t used = c->used;
+
+	if (!atom_load_acq(&c->spare_ready)) return 0;
+	c->map = c->spare;
+	c->header = (struct capture_segment_header *) c->map.base;
+	c->used = 0;
+	atom_store_rel(&c->spare_ready, 0);
+	atom_store_rel(&c->last_segment, c->spare_segment);
+
+	pthread_mutex_lock(&helper_mutex); // helper holds it only to take work, never while making system calls
+	c->retired = full;
+	c->retired_used = used;
+	c->has_retired = 1;
+	c->wants_spare = 1;
+	c->retry_us = 0;
+	pthread_cond_broadcast(&helper_cond);
+	pthread_mutex_unlock(&helper_mutex);
+	return 1;
+}
+
+capture_log_t capture_log_create(const char *prefix, size_t segment_size, uint32_t max_segments) {
+	capture_log_t c;
+
+	if (!helper_started || strlen(prefix) >= CAPTURE_LOG_PREFIX_MAX) return 0;
+	if (segment_size == 0) segment_size = CAPTURE_LOG_SEGMENT_SIZE_DEFAULT;
+	if (segment_size < CAPTURE_LOG_SEGMENT_SIZE_MIN) segment_size = CAPTURE_LOG_SEGMENT_SIZE_MIN;
+	if (segment_size > CAPTURE_LOG_SEGMENT_SIZE_MAX) segment_size = CAPTURE_LOG_SEGMENT_SIZE_MAX;
+	if (max_segments == 0) max_segments = CAPTURE_LOG_SEGMENTS_DEFAULT;
+
+	c = (capture_log_t) malloc(sizeof(struct _capture_log));
+	if (!c) return 0;
+	strcpy(c->prefix, prefix);
+	c->segment_size = segment_size & ~(size_t) 7;
+	c->max_segments = max_segments;
+	c->used = 0;
+	c->started_us = hr_clock_get_us();
+	c->wall_clock_offset_us = get_wall_clock_us() - c->started_us;
+	c->first_segment = 0;
+	c->last_segment = 0;
+	c->records = 0;
+	c->lost = 0;
+	c->spare_segment = 0;
+	c->spare_ready = 0;
+	c->retired_used = 0;
+	c->has_retired = 0;
+	c->wants_spare = 1; // the second segment is made ahead
+	c->busy = 0;
+	c->retry_us = 0;
+	c->header = create_segment(c, 0, &c->map);
+	if (!c->header) {
+		free(c);
+		return 0;
+	}
+
+	pthread_mutex_lock(&helper_mutex);
+	c->next = helper_logs;
+	helper_logs = c;
+	pthread_cond_broadcast(&helper_cond);
+	pthread_mutex_unlock(&helper_mutex);
+	return c;
+}
+
+int capture_log_append(capture_log_t c, uint64_t timestamp_us, const uint8_t *report, size_t len) {
+	struct capture_record_header *rec;
+	size_t size;
+
+	if (len > CAPTURE_LOG_REPORT_MAX) len = CAPTURE_LOG_REPORT_MAX;
+	size = RECORD_SIZE(len);
+	if (sizeof(struct capture_segment_header) + c->used + size > c->segment_size) {
+		if (!rotate_segment(c)) goto LOST;
+	}
+
+	rec = (struct capture_record_header *)(c->map.base + sizeof(struct capture_segment_header) + c->used);
+	rec->timestamp_us = timestamp_us;
+	rec->length = (uint32_t) len;
+	rec->seq = c->records;
+	memcpy(rec + 1, report, len);
+	if (c->used == 0) c->header->first_us = timestamp_us;
+	c->used += (uint32_t) size;
+	atom_store_rel(&c->header->used, c->used); // the record is visible to readers from now on
+	atom_store_rel(&c->records, c->records + 1);
+	return 1;
+
+LOST:
+	atom_fetch_add(&c->lost, 1);
+	return 0;
+}
+
+void capture_log_get_info(capture_log_t c, struct capture_log_info *info) {
+	info->first_segment = atom_load_acq(&c->first_segment);
+	info->last_segment = atom_load_acq(&c->last_segment);
+	info->records = atom_load_acq(&c->records);
+	info->lost = atom_load_acq(&c->lost);
+	info->started_us = c->started_us;
+	info->wall_clock_offset_us = c->wall_clock_offset_us;
+}
+
+const char *capture_log_get_prefix(const capture_log_t c) {
+	return c->prefix;
+}
+
+void capture_log_destroy(capture_log_t c) {
+	capture_log_t *p;
+
+	pthread_mutex_lock(&helper_mutex);
+	while (c->busy) pthread_cond_wait(&helper_cond, &helper_mutex); // a segment being created or closed
+	for (p = &helper_logs; *p; p = &(*p)->next) {
+		if (*p == c) {
+			*p = c->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&helper_mutex);
+
+	if (c->has_retired) unmap_file(&c->retired, sizeof(struct capture_segment_header) + c->retired_used);
+	unmap_file(&c->map, sizeof(struct capture_segment_header) + c->used);
+	if (atom_load_acq(&c->spare_ready)) {
+		// the spare beyond last_segment has no record
+		char path[CAPTURE_LOG_PATH_MAX];
+		unmap_file(&c->spare, 0);
+		make_segment_path(path, c->prefix, c->spare_segment);
+		delete_file(path);
+	}
+	delete_old_segments(c);
+	free(c);
+}
+
+void capture_log_delete(const char *prefix, uint32_t first_segment, uint32_t last_segment) {
+	uint32_t s;
+	for (s = first_segment; ; s++) {
+		char path[CAPTURE_LOG_PATH_MAX];
+		make_segment_path(path, prefix, s);
+		delete_file(path);
+		if (s == last_segment) break;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// Reader of a range
+//////////////////////////////////////////////////////////////////////////
+
+struct _capture_log_range {
+	char prefix[CAPTURE_LOG_PREFIX_MAX];
+	uint32_t segment; /// next segment to be read, or being read
+	uint32_t last_segment;
+	uint64_t from_us;
+	uint64_t to_us;
+	struct segment_map map; /// segment being read, base is 0 when none
+	size_t offset; /// of the next record in the segment
+	size_t end; /// of records in the segment when it was mapped
+	int found; /// boolean, the first record of range has been passed
+	int done; /// boolean
+};
+
+/**
+ *  Map a segment to be read, checking its header
+ *  It returns 1 on success; 0 when it is missing (e.g. deleted by rotation) or broken
+ */
+static int map_segment(struct segment_map *m, const char *prefix, uint32_t segment, uint32_t *used) {
+	char path[CAPTURE_LOG_PATH_MAX];
+	const struct capture_segment_header *h;
+
+	make_segment_path(path, prefix, segment);
+	if (!map_file(m, path, 0, 0)) return 0;
+	h = (const struct capture_segment_header *) m->base;
+	if (m->size < sizeof(*h) || memcmp(h->magic, CAPTURE_LOG_MAGIC, sizeof(h->magic)) != 0 ||
+		h->header_size != sizeof(*h) || h->segment != segment) {
+		unmap_file(m, 0);
+		return 0;
+	}
+	*used = atom_load_acq(&h->used);
+	if (sizeof(*h) + *used > m->size) *used = (uint32_t)(m->size - sizeof(*h));
+	return 1;
+}
+
+/**
+ *  Check whether all records of a segment are older than from_us by the first record of the next segment
+ */
+static int is_segment_before(const char *prefix, uint32_t next_segment, uint64_t from_us) {
+	struct segment_map m;
+	uint32_t used;
+	int before;
+	if (!map_segment(&m, prefix, next_segment, &used)) return 0;
+	before = used > 0 && ((const struct capture_segment_header *) m.base)->first_us < from_us;
+	unmap_file(&m, 0);
+	return before;
+}
+
+capture_log_range_t capture_log_open_range(const char *prefix, uint32_t first_segment, uint32_t last_segment,
+	uint64_t from_us, uint64_t to_us) {
+	capture_log_range_t r;
+
+	if (strlen(prefix) >= CAPTURE_LOG_PREFIX_MAX) return 0;
+	r = (capture_log_range_t) malloc(sizeof(struct _capture_log_range));
+	if (!r) return 0;
+	strcpy(r->prefix, prefix);
+	r->segment = first_segment;
+	r->last_segment = last_segment;
+	r->from_us = from_us;
+	r->to_us = to_us;
+	r->map.base = 0;
+	r->offset = 0;
+	r->end = 0;
+	r->found = 0;
+	r->done = 0;
+	// segments entirely before the range are skipped without scanning their records
+	while (r->segment != r->last_segment && is_segment_before(prefix, r->segment + 1, from_us)) r->segment++;
+	return r;
+}
+
+const uint8_t *capture_log_read_range(capture_log_range_t r, size_t max_len, size_t *len) {
+	while (!r->done) {
+		const uint8_t *records;
+		size_t start, n = 0;
+
+		if (!r->map.base) {
+			uint32_t used;
+			if (map_segment(&r->map, r->prefix, r->segment, &used)) {
+				r->offset = sizeof(struct capture_segment_header);
+				r->end = r->offset + used;
+			} else if (r->segment == r->last_segment) {
+				r->done = 1;
+				break;
+			} else {
+				r->segment++;
+				continue;
+			}
+		}
+
+		records = r->map.base;
+		start = r->offset;
+		while (r->offset + sizeof(struct capture_record_header) <= r->end) {
+			const struct capture_record_header *rec = (const struct capture_record_header *)(records + r->offset);
+			size_t size = RECORD_SIZE(rec->length);
+			if (rec->length > CAPTURE_LOG_REPORT_MAX || r->offset + size > r->end) {
+				r->offset = r->end; // broken, the rest of segment is ignored
+				break;
+			}
+			if (rec->timestamp_us > r->to_us) {
+				r->done = 1;
+				break;
+			}
+			if (!r->found) {
+				if (rec->timestamp_us < r->from_us) {
+					r->offset += size;
+					start = r->offset;
+					continue;
+				}
+				r->found = 1;
+			}
+			if (n > 0 && n + size > max_len) break;
+			n += size;
+			r->offset += size;
+		}
+		if (n > 0) {
+			*len = n;
+			return records + start; // the segment stays mapped until next call
+		}
+
+		unmap_file(&r->map, 0);
+		if (r->segment == r->last_segment) r->done = 1;
+		else r->segment++;
+	}
+	return 0;
+}
+
+void capture_log_close_range(capture_log_range_t r) {
+	if (r->map.base) unmap_file(&r->map, 0);
+	free(r);
+}
@@ -0,0 +1,127 @@
+/**
+ *  Capture Log module
+ *  Input reports are appended with their timestamps into segment files mapped in memory,
+ *  so recording costs a copy into the mapping and no system call per report.
+ *  The next segment is created ahead by a helper thread of the module, and the writer moves on to it when its segment is full;
+ *  the full one is closed and the oldest ones beyond a limit are deleted by the helper thread as well.
+ *  Files are named "{prefix}-{index of segment (6 digits)}.whc".
+ *  Reports are appended by one thread; a range of records is read through files independently of it
+ */
+
+#ifndef _CAPTURE_LOG_H_
+#define _CAPTURE_LOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ *  Longest prefix of files including directory
+ */
+#define CAPTURE_LOG_PREFIX_MAX	(240)
+/**
+ *  Size of segment files (header included) by default, and limits of it
+ */
+#define CAPTURE_LOG_SEGMENT_SIZE_DEFAULT	(64 * 1024 * 1024)
+#define CAPTURE_LOG_SEGMENT_SIZE_MIN	(64 * 1024)
+#define CAPTURE_LOG_SEGMENT_SIZE_MAX	(1024 * 1024 * 1024)
+/**
+ *  Segments kept by default, the oldest ones beyond it are deleted
+ */
+#define CAPTURE_LOG_SEGMENTS_DEFAULT	(16)
+/**
+ *  Longest report to be appended
+ */
+#define CAPTURE_LOG_REPORT_MAX	(4096)
+
+/**
+ *  Type of a log being written is pointer to struct
+ */
+struct _capture_log;
+typedef struct _capture_log *capture_log_t;
+
+/**
+ *  State of a log, taken by any thread while it is written
+ */
+struct capture_log_info {
+	uint32_t first_segment; /// index of the oldest segment kept
+	uint32_t last_segment; /// index of the segment being written
+	uint32_t records; /// reports appended
+	uint32_t lost; /// reports not appended since a segment could not be created
+	uint64_t started_us; /// monotonic time when the log was created
+	uint64_t wall_clock_offset_us; /// add it to monotonic time to get microseconds since 1970-01-01 UTC
+};
+
+/**
+ *  Start the helper thread of the module
+ *  It returns 1 on success; 0 on fail
+ */
+int capture_log_initialize(void);
+
+/**
+ *  Stop the helper thread, logs must be destroyed before it
+ */
+void capture_log_finalize(void);
+
+/**
+ *  Create a log and its first segment, files of the prefix left by a previous log are overwritten
+ *  segment_size and max_segments of 0 mean their defaults
+ *  It returns 0 on fail (also when the module is not initialized)
+ */
+capture_log_t capture_log_create(const char *prefix, size_t segment_size, uint32_t max_segments);
+
+/**
+ *  Append a report read at timestamp_us (monotonic), it is truncated to CAPTURE_LOG_REPORT_MAX
+ *  No system call is made: a full segment is replaced with the one created ahead, and the helper thread is woken up
+ *  It returns 1 on success; 0 when the report is lost (the next segment is not ready, e.g. disk is full)
+ */
+int capture_log_append(capture_log_t c, uint64_t timestamp_us, const uint8_t *report, size_t len);
+
+/**
+ *  Take state of a log
+ */
+void capture_log_get_info(capture_log_t c, struct capture_log_info *info);
+
+/**
+ *  Get prefix of files of a log
+ */
+const char *capture_log_get_prefix(const capture_log_t c);
+
+/**
+ *  Close the segment being written (truncated to records in it) and release the log, files are left
+ *  It waits only for a segment being created or closed by the helper thread for the log
+ */
+void capture_log_destroy(capture_log_t c);
+
+/**
+ *  Delete files of segments [first_segment, last_segment] of prefix, e.g. of a log destroyed
+ *  A reader still reading one keeps it on POSIX; it is left on Windows
+ */
+void capture_log_delete(const char *prefix, uint32_t first_segment, uint32_t last_segment);
+
+/**
+ *  Type of a reader of records in a time range is pointer to struct
+ */
+struct _capture_log_range;
+typedef struct _capture_log_range *capture_log_range_t;
+
+/**
+ *  Start to read records of segments [first_segment, last_segment] of prefix
+ *  whose timestamps are in [from_us, to_us], records appended to a segment after it starts to be read are not read
+ *  It returns 0 on fail
+ */
+capture_log_range_t capture_log_open_range(const char *prefix, uint32_t first_segment, uint32_t last_segment,
+	uint64_t from_us, uint64_t to_us);
+
+/**
+ *  Read next records of the range in place, as many as fit in max_len bytes (at least one record)
+ *  Records are laid out as in segment files, so they are copied out as they are
+ *  It returns 0 at the end of range; otherwise pointer valid until next call, with its length in *len
+ */
+const uint8_t *capture_log_read_range(capture_log_range_t r, size_t max_len, size_t *len);
+
+/**
+ *  Release a reader
+ */
+void capture_log_close_range(capture_log_range_t r);
+
+#endif //#ifndef _CAPTURE_LOG_H_
@@ -0,0 +1,386 @@
+/**
+ *  HID Descriptor module
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hid_desc.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+#endif
+
+#ifdef _DEBUG
+#include <stdio.h>
+#define HID_DESC_TRACE(msg)	\
+	printf("%s (% 4d): %s\r\n", __FUNCTION__, __LINE__, msg)
+#else //_DEBUG
+#define HID_DESC_TRACE(msg)
+#endif //_DEBUG
+
+/**
+ *  Depth of Push items, and usages kept for a main item
+ */
+#define HID_DESC_STACK_DEPTH	(8)
+#define HID_DESC_MAX_USAGES		(256)
+/**
+ *  Fields are not taken more than this, against a malicious descriptor
+ */
+#define HID_DESC_MAX_FIELDS		(4096)
+
+/**
+ *  Types and tags of short items
+ */
+#define ITEM_TYPE_MAIN		(0)
+#define ITEM_TYPE_GLOBAL	(1)
+#define ITEM_TYPE_LOCAL		(2)
+#define ITEM_LONG			(0xFE)
+
+#define MAIN_INPUT			(0x8)
+#define MAIN_OUTPUT			(0x9)
+#define MAIN_COLLECTION		(0xA)
+#define MAIN_FEATURE		(0xB)
+#define MAIN_END_COLLECTION	(0xC)
+
+#define GLOBAL_USAGE_PAGE	(0x0)
+#define GLOBAL_LOGICAL_MIN	(0x1)
+#define GLOBAL_LOGICAL_MAX	(0x2)
+#define GLOBAL_REPORT_SIZE	(0x7)
+#define GLOBAL_REPORT_ID	(0x8)
+#define GLOBAL_REPORT_COUNT	(0x9)
+#define GLOBAL_PUSH			(0xA)
+#define GLOBAL_POP			(0xB)
+
+#define LOCAL_USAGE			(0x0)
+#define LOCAL_USAGE_MIN		(0x1)
+#define LOCAL_USAGE_MAX		(0x2)
+
+/**
+ *  Bits of data of Input item
+ */
+#define INPUT_CONSTANT		(1 << 0)
+#define INPUT_VARIABLE		(1 << 1)
+#define INPUT_RELATIVE		(1 << 2)
+
+struct _hid_desc {
+	struct hid_desc_field *fields;
+	int num_fields;
+	int uses_report_id; /// boolean
+	uint16_t first[256]; /// index of the first field by report ID
+	uint16_t count[256]; /// number of fields by report ID
+};
+
+struct globals {
+	uint16_t usage_page;
+	uint8_t report_id;
+	int32_t logical_min;
+	int32_t logical_max;
+	uint32_t report_size;
+	uint32_t report_count;
+};
+
+struct locals {
+	uint32_t usages[HID_DESC_MAX_USAGES]; /// usage page in upper 16 bits when it was given by the item
+	int num_usages;
+	uint32_t usage_min;
+	uint32_t usage_max;
+	int has_min; /// boolean
+	int has_max; /// boolean
+};
+
+struct parser {
+	struct globals g;
+	struct globals stack[HID_DESC_STACK_DEPTH];
+	int depth;
+	struct locals l;
+	uint32_t bit_offsets[256]; /// next bit of input report by report ID, excluding byte of report ID
+	struct hid_desc_field *fields;
+	int num_fields;
+	int capacity;
+	int uses_report_id; /// boolean
+};
+
+/**
+ *  Usage of 1 or 2 bytes is on the usage page current at the main item, so it is resolved there
+ */
+static uint32_t resolve_usage(const struct parser *p, uint32_t usage) {
+	return (usage >> 16)? usage: ((uint32_t) p->g.usage_page << 16) | usage;
+}
+
+static uint32_t get_usage(const struct parser *p, uint32_t index) {
+	const struct locals *l = &p->l;
+	if (l->has_min && l->has_max) {
+		uint32_t usage = l->usage_min + index;
+		return resolve_usage(p, usage > l->usage_max? l->usage_max: usage);
+	}
+	if (l->num_usages == 0) return resolve_usage(p, 0);
+	return resolve_usage(p, l->usages[index < (uint32_t) l->num_usages? index: (uint32_t) l->num_usages - 1]);
+}
+
+static int append_field(struct parser *p, const struct hid_desc_field *f) {
+	if (p->num_fields == p->capacity) {
+		int capacity = p->capacity? p->capacity * 2: 32;
+		struct hid_desc_field *fields;
+		if (capacity > HID_DESC_MAX_FIELDS) return 0;
+		fields = (struct hid_desc_field *) realloc(p->fields, capacity * sizeof(struct hid_desc_field));
+		if (!fields) return 0;
+		p->fields = fields;
+		p->capacity = capacity;
+	}
+	p->fields[p->num_fields++] = *f;
+	return 1;
+}
+
+static int add_input(struct parser *p, uint32_t data) {
+	const struct globals *g = &p->g;
+	uint32_t *offset = &p->bit_offsets[g->report_id];
+	uint32_t i;
+
+	if (g->report_size > 0 && g->report_count > 0 && !(data & INPUT_CONSTANT)) {
+		struct hid_desc_field f;
+		uint32_t usage;
+		f.report_id = g->report_id;
+		f.bit_size = (uint8_t) (g->report_size > 32? 32: g->report_size); // upper bits of a longer field are not read
+		f.flags = 0;
+		if (!(data & INPUT_VARIABLE)) f.flags |= HID_DESC_FIELD_ARRAY;
+		if (data & INPUT_RELATIVE) f.flags |= HID_DESC_FIELD_RELATIVE;
+		if (g->logical_min < 0) f.flags |= HID_DESC_FIELD_SIGNED;
+		f.logical_min = g->logical_min;
+		f.logical_max = g->logical_max;
+
+		for (i = 0; i < g->report_count; i++) {
+			usage = get_usage(p, (data & INPUT_VARIABLE)? i: 0);
+			f.usage_page = (uint16_t) (usage >> 16);
+			f.usage = (uint16_t) usage;
+			f.bit_offset = *offset + i * g->report_size;
+			if (!append_field(p, &f)) return 0;
+		}
+	}
+	*offset += g->report_size * g->report_count;
+	return 1;
+}
+
+/**
+ *  Sort fields by report ID keeping their order in a report, and index them
+ */
+static int build(hid_desc_t d, struct parser *p) {
+	uint16_t next[256];
+	int i, n = 0;
+
+	memset(d->count, 0, sizeof(d->count));
+	for (i = 0; i < p->num_fields; i++) d->count[p->fields[i].report_id]++;
+	for (i = 0; i < 256; i++) {
+		d->first[i] = next[i] = (uint16_t) n;
+		n += d->count[i];
+	}
+
+	d->fields = (struct hid_desc_field *) malloc((n? n: 1) * sizeof(struct hid_desc_field));
+	if (!d->fields) return 0;
+	for (i = 0; i < p->num_fields; i++) {
+		struct hid_desc_field *f = &d->fields[next[p->fields[i].report_id]++];
+		*f = p->fields[i];
+		if (p->uses_report_id) f->bit_offset += 8;
+	}
+	d->num_fields = n;
+	d->uses_report_id = p->uses_report_id;
+	return 1;
+}
+
+int hid_desc_fetch(const char *path, uint8_t *buf, size_t size) {
+#ifdef __linux__
+	struct hidraw_report_descriptor rd;
+	int fd, desc_size = 0;
+
+	if (strncmp(path, "/dev/hidraw", 11) != 0) return -1;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		HID_DESC_TRACE("failed to open hidraw");
+		return -1;
+	}
+	if (ioctl(fd, HIDIOCGRDESCSIZE, &desc_size) < 0 || desc_size <= 0 || desc_size > HID_MAX_DESCRIPTOR_SIZE) {
+		HID_DESC_TRACE("failed to get size of descriptor");
+		close(fd);
+		return -1;
+	}
+	memset(&rd, 0, sizeof(rd));
+	rd.size = (uint32_t) desc_size;
+	if (ioctl(fd, HIDIOCGRDESC, &rd) < 0) {
+		HID_DESC_TRACE("failed to get descriptor");
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	if ((size_t) desc_size > size) return -1;
+	memcpy(buf, rd.value, desc_size);
+	return desc_size;
+#else
+	// HID API of Windows gives preparsed data only, not the descriptor itself
+	(void) path;
+	(void) buf;
+	(void) size;
+	return -1;
+#endif
+}
+
+hid_desc_t hid_desc_parse(const uint8_t *desc, size_t size) {
+	struct parser *p;
+	hid_desc_t d = 0;
+	size_t pos = 0;
+
+	p = (struct parser *) calloc(1, sizeof(struct parser));
+	if (!p) return 0;
+
+	while (pos < size) {
+		uint8_t prefix = desc[pos++];
+		uint32_t data = 0, len, type, tag;
+		int32_t value;
+
+		if (prefix == ITEM_LONG) {
+			// long items are reserved, skip it (bDataSize, bLongItemTag, data)
+			if (pos + 2 > size) goto FINISH;
+			pos += 2 + desc[pos];
+			continue;
+		}
+		len = prefix & 0x3;
+		if (len == 3) len = 4;
+		type = (prefix >> 2) & 0x3;
+		tag = prefix >> 4;
+		if (pos + len > size) goto FINISH;
+		if (len >= 1) data = desc[pos];
+		if (len >= 2) data |= (uint32_t) desc[pos + 1] << 8;
+		if (len == 4) data |= ((uint32_t) desc[pos + 2] << 16) | ((uint32_t) desc[pos + 3] << 24);
+		pos += len;
+		// sign-extended value for logical range
+		if (len == 1) value = (int8_t) data;
+		else if (len == 2) value = (int16_t) data;
+		else value = (int32_t) data;
+
+		if (type == ITEM_TYPE_MAIN) {
+			if (tag == MAIN_INPUT && !add_input(p, data)) goto FINISH;
+			memset(&p->l, 0, sizeof(p->l)); // locals are for the main item
+		} else if (type == ITEM_TYPE_GLOBAL) {
+			switch (tag) {
+			case GLOBAL_USAGE_PAGE:
+				p->g.usage_page = (uint16_t) data;
+				break;
+			case GLOBAL_LOGICAL_MIN:
+				p->g.logical_min = value;
+				break;
+			case GLOBAL_LOGICAL_MAX:
+				// an unsigned maximum is often given in a short item, e.g. 0xFF for 0 to 255
+				p->g.logical_max = (value < p->g.logical_min && p->g.logical_min >= 0)? (int32_t) data: value;
+				break;
+			case GLOBAL_REPORT_SIZE:
+				p->g.report_size = data;
+				break;
+			case GLOBAL_REPORT_ID:
+				if (data == 0 || data > 255) goto FINISH;
+				p->g.report_id = (uint8_t) data;
+				p->uses_report_id = 1;
+				break;
+			case GLOBAL_REPORT_COUNT:
+				p->g.report_count = data;
+				break;
+			case GLOBAL_PUSH:
+				if (p->depth == HID_DESC_STACK_DEPTH) goto FINISH;
+				p->stack[p->depth++] = p->g;
+				break;
+			case GLOBAL_POP:
+				if (p->depth == 0) goto FINISH;
+				p->g = p->stack[--p->depth];
+				break;
+			}
+			if (p->g.report_size * (uint64_t) p->g.report_count > 0xFFFF * 8) goto FINISH;
+		} else if (type == ITEM_TYPE_LOCAL) {
+			if (len != 4) data &= 0xFFFF; // extended usage has its page in upper bits
+			switch (tag) {
+			case LOCAL_USAGE:
+				if (p->l.num_usages < HID_DESC_MAX_USAGES) p->l.usages[p->l.num_usages++] = data;
+				break;
+			case LOCAL_USAGE_MIN:
+				p->l.usage_min = data;
+				p->l.has_min = 1;
+				break;
+			case LOCAL_USAGE_MAX:
+				p->l.usage_max = data;
+				p->l.has_max = 1;
+				break;
+			}
+		}
+	}
+
+	d = (hid_desc_t) malloc(sizeof(struct _hid_desc));
+	if (d && !build(d, p)) {
+		free(d);
+		d = 0;
+	}
+
+FINISH:
+	if (!d) HID_DESC_TRACE("malformed descriptor");
+	free(p->fields);
+	free(p);
+	return d;
+}
+
+void hid_desc_destroy(hid_desc_t d) {
+	free(d->fields);
+	free(d);
+}
+
+int hid_desc_uses_report_id(const hid_desc_t d) {
+	return d->uses_report_id;
+}
+
+int hid_desc_get_numof_fields(const hid_desc_t d) {
+	return d->num_fields;
+}
+
+const struct hid_desc_field *hid_desc_get_field(const hid_desc_t d, int index) {
+	return d->fields + index;
+}
+
+int hid_desc_find_report(const hid_desc_t d, uint8_t report_id, int *first) {
+	*first = d->first[report_id];
+	return d->count[report_id];
+}
+
+int hid_desc_extract(const struct hid_desc_field *f, const uint8_t *report, size_t len, int32_t *value) {
+	size_t pos = f->bit_offset >> 3;
+	uint32_t shift = f->bit_offset & 7;
+	size_t n = (shift + f->bit_size + 7) >> 3; // 5 bytes at most
+	uint64_t raw = 0;
+	uint32_t mask, v;
+	size_t i;
+
+	if (pos + n > len) return 0;
+	for (i = 0; i < n; i++) raw |= (uint64_t) report[pos + i] << (i * 8);
+	mask = (f->bit_size >= 32)? 0xFFFFFFFF: ((uint32_t) 1 << f->bit_size) - 1;
+	v = (uint32_t) (raw >> shift) & mask;
+	if ((f->flags & HID_DESC_FIELD_SIGNED) && f->bit_size < 32 && (v >> (f->bit_size - 1))) v |= ~mask;
+	*value = (int32_t) v;
+	return 1;
+}
+
+int hid_desc_insert(const struct hid_desc_field *f, uint8_t *report, size_t len, int32_t value) {
+	size_t pos = f->bit_offset >> 3;
+	uint32_t shift = f->bit_offset & 7;
+	size_t n = (shift + f->bit_size + 7) >> 3;
+	uint64_t raw = 0, mask;
+	size_t i;
+
+	if (pos + n > len) return 0;
+	if (f->logical_min < f->logical_max) {
+		if (value < f->logical_min) value = f->logical_min;
+		if (value > f->logical_max) value = f->logical_max;
+	}
+	for (i = 0; i < n; i++) raw |= (uint64_t) report[pos + i] << (i * 8);
+	mask = (f->bit_size >= 32)? 0xFFFFFFFF: ((uint32_t) 1 << f->bit_size) - 1;
+	raw = (raw & ~(mask << shift)) | (((uint64_t) (uint32_t) value & mask) << shift);
+	for (i = 0; i < n; i++) report[pos + i] = (uint8_t) (raw >> (i * 8));
+	return 1;
+}
@@ -0,0 +1,85 @@
+/**
+ *  HID Descriptor module
+ *  Parse a report descriptor into fields of input reports (bit offset, size, logical range and usage),
+ *  so that values of fields are extracted from reports without interpreting the descriptor again
+ */
+
+#ifndef _HID_DESC_H_
+#define _HID_DESC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ *  Longest report descriptor (HID_MAX_DESCRIPTOR_SIZE of Linux)
+ */
+#define HID_DESC_MAX_SIZE	(4096)
+
+#define HID_DESC_FIELD_ARRAY	(1 << 0) /// value is an index of usages (array item), not a variable
+#define HID_DESC_FIELD_RELATIVE	(1 << 1) /// value is relative to the previous one (e.g. mouse movement)
+#define HID_DESC_FIELD_SIGNED	(1 << 2) /// logical minimum is negative, so value is sign-extended
+
+/**
+ *  Field of input report
+ */
+struct hid_desc_field {
+	uint8_t report_id; /// 0 when the descriptor does not use report IDs
+	uint8_t bit_size; /// 1 to 32
+	uint16_t flags;
+	uint16_t usage_page;
+	uint16_t usage; /// minimum of usages for array item
+	uint32_t bit_offset; /// from the head of report, including byte of report ID
+	int32_t logical_min;
+	int32_t logical_max;
+};
+
+/**
+ *  Type of parsed descriptor is pointer to struct
+ */
+struct _hid_desc;
+typedef struct _hid_desc *hid_desc_t;
+
+/**
+ *  Read report descriptor of a HID IF by its device path
+ *  It returns the size of descriptor; -1 when it is not available (only hidraw of Linux is supported)
+ */
+int hid_desc_fetch(const char *path, uint8_t *buf, size_t size);
+
+/**
+ *  Parse a report descriptor
+ *  It returns 0 when the descriptor is malformed
+ */
+hid_desc_t hid_desc_parse(const uint8_t *desc, size_t size);
+
+void hid_desc_destroy(hid_desc_t d);
+
+/**
+ *  Returns 1 when input reports begin with report ID
+ */
+int hid_desc_uses_report_id(const hid_desc_t d);
+
+/**
+ *  Fields are ordered by report ID, and by position in a report
+ */
+int hid_desc_get_numof_fields(const hid_desc_t d);
+const struct hid_desc_field *hid_desc_get_field(const hid_desc_t d, int index);
+
+/**
+ *  Find fields of a report ID
+ *  It returns the number of fields, and index of the first one into first
+ */
+int hid_desc_find_report(const hid_desc_t d, uint8_t report_id, int *first);
+
+/**
+ *  Extract value of a field from input report
+ *  It returns 1 on success; 0 when the report is too short
+ */
+int hid_desc_extract(const struct hid_desc_field *f, const uint8_t *report, size_t len, int32_t *value);
+
+/**
+ *  Put value into a field of input report, clamped to the logical range of the field
+ *  It returns 1 on success; 0 when the report is too short
+ */
+int hid_desc_insert(const struct hid_desc_field *f, uint8_t *report, size_t len, int32_t value);
+
+#endif //#ifndef _HID_DESC_H_
@@ -0,0 +1,313 @@
+/**
+ *  HID Index module
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <hidapi.h>
+
+#include "atom.h"
+#include "hr_clock.h"
+#include "hid_index.h"
+
+#ifdef _DEBUG
+#include <stdio.h>
+#define HID_INDEX_TRACE(msg)	\
+	printf("%s (% 4d): %s\r\n", __FUNCTION__, __LINE__, msg)
+#else //_DEBUG
+#define HID_INDEX_TRACE(msg)
+#endif //_DEBUG
+
+/**
+ *  Index is rebuilt when it gets older than this period
+ */
+#define HID_INDEX_TTL_US			(5 * 1000 * 1000)
+/**
+ *  On a miss, index is rebuilt only when it is older than this period
+ *  (a newly plugged HID is found soon, but invalid paths do not trigger enumeration every time)
+ */
+#define HID_INDEX_MISS_REFRESH_US	(500 * 1000)
+
+struct hid_index_entry {
+	struct hid_index_key key;
+	char *path; /// NULL on empty entry
+};
+
+struct hid_index_table {
+	struct hid_index_entry *entries;
+	size_t mask;
+	uint64_t built_us; /// monotonic time when enumeration of the table started
+};
+
+static struct hid_index_table *index_table = 0; /// used by the thread looking up
+static atom_t index_stale = 1; /// boolean
+
+/// Tables are built by enumeration on refresher thread and adopted by the next lookup
+static pthread_t refresher;
+static int refresher_started = 0; /// boolean
+static pthread_mutex_t mutex;
+static pthread_cond_t cond_requested;
+static int refresh_requested = 0; /// boolean, under mutex
+static int requested_stop = 0; /// boolean, under mutex
+static struct hid_index_table *fresh_table = 0; /// under mutex
+static atom_t fresh_ready = 0; /// boolean, fresh_table is set (checked by lookup without mutex)
+static atom_t refreshing = 0; /// boolean, a refresh asked by lookup is pending or running
+
+void hid_index_make_key(struct hid_index_key *key, const struct hid_device_info *info) {
+	key->interface_number = (uint16_t)(info->interface_number & 0xffff);
+	key->vendor_id = info->vendor_id;
+	key->product_id = info->product_id;
+	key->usage_page = info->usage_page;
+	key->usage = info->usage;
+}
+
+static int parse_hex4(const char *p, uint16_t *val) {
+	int i;
+	uint16_t v = 0;
+	for (i = 0; i < 4; i++) {
+		char c = p[i];
+		v <<= 4;
+		if (c >= '0' && c <= '9') v |= c - '0';
+		else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+		else return 0;
+	}
+	*val = v;
+	return 1;
+}
+
+int hid_index_parse_virtual_path(const char *path, size_t len, struct hid_index_key *key) {
+	/* "/hid/%04x/%04x/%04x/%04x/%04x/" */
+	if (len < 30 || memcmp(path, "/hid/", 5) != 0) return 0;
+	if (path[9] != '/' || path[14] != '/' || path[19] != '/' || path[24] != '/' || path[29] != '/') return 0;
+	return	parse_hex4(path + 5, &key->interface_number) &&
+			parse_hex4(path + 10, &key->vendor_id) &&
+			parse_hex4(path + 15, &key->product_id) &&
+			parse_hex4(path + 20, &key->usage_page) &&
+			parse_hex4(path + 25, &key->usage);
+}
+
+static size_t hash_key(const struct hid_index_key *key) {
+	uint32_t h = 2166136261u; // FNV-1a over the 5 words
+	h = (h ^ key->interface_number) * 16777619u;
+	h = (h ^ key->vendor_id) * 16777619u;
+	h = (h ^ key->product_id) * 16777619u;
+	h = (h ^ key->usage_page) * 16777619u;
+	h = (h ^ key->usage) * 16777619u;
+	return (size_t)(h ^ (h >> 16));
+}
+
+static int equals_key(const struct hid_index_key *a, const struct hid_index_key *b) {
+	return	a->interface_number == b->interface_number && a->vendor_id == b->vendor_id &&
+			a->product_id == b->product_id && a->usage_page == b->usage_page && a->usage == b->usage;
+}
+
+static void release_table(struct hid_index_table *t) {
+	if (t) {
+		size_t i;
+		if (t->entries) {
+			for (i = 0; i <= t->mask; i++) {
+				if (t->entries[i].path) free(t->entries[i].path);
+			}
+			free(t->entries);
+		}
+		free(t);
+	}
+}
+
+/**
+ *  Build a table of devices enumerated, it returns 0 on fail
+ */
+static struct hid_index_table *build_table(const struct hid_device_info *root, uint64_t built_us) {
+	struct hid_index_table *t = (struct hid_index_table *)malloc(sizeof(struct hid_index_table));
+	const struct hid_device_info *info;
+	size_t num = 0, size = 8;
+
+	for (info = root; info; info = info->next) num++;
+	while (size < num * 2) size <<= 1; // load factor <= 0.5
+
+	if (t) t->entries = (struct hid_index_entry *)calloc(size, sizeof(struct hid_index_entry));
+	if (!t || !t->entries) {
+		HID_INDEX_TRACE("failed to allocate memory");
+		free(t);
+		return 0;
+	}
+	t->mask = size - 1;
+	t->built_us = built_us;
+	for (info = root; info; info = info->next) {
+		struct hid_index_key key;
+		size_t i;
+		hid_index_make_key(&key, info);
+		for (i = hash_key(&key) & t->mask; t->entries[i].path; i = (i + 1) & t->mask) {
+			if (equals_key(&t->entries[i].key, &key)) break; // first enumerated one wins
+		}
+		if (!t->entries[i].path) {
+			size_t len = strlen(info->path) + 1;
+			t->entries[i].path = (char *)malloc(len);
+			if (t->entries[i].path) {
+				memcpy(t->entries[i].path, info->path, len);
+				t->entries[i].key = key;
+			}
+		}
+	}
+	return t;
+}
+
+/**
+ *  Replace the table looked up, unless it is newer than t
+ */
+static void adopt_table(struct hid_index_table *t) {
+	if (index_table && index_table->built_us > t->built_us) {
+		release_table(t);
+		return;
+	}
+	release_table(index_table);
+	index_table = t;
+}
+
+static void *proc_refreshing(void *param) {
+	(void) param;
+
+	pthread_mutex_lock(&mutex);
+	for (;;) {
+		struct hid_device_info *enumerated;
+		struct hid_index_table *t;
+		uint64_t started_us;
+
+		while (!requested_stop && !refresh_requested) pthread_cond_wait(&cond_requested, &mutex);
+		if (requested_stop) break;
+		refresh_requested = 0;
+		pthread_mutex_unlock(&mutex);
+
+		// clear stale flag first, so an invalidation during enumeration is not lost
+		atom_exchange(&index_stale, 0);
+		started_us = hr_clock_get_us();
+		enumerated = hid_enumerate(0, 0);
+		t = build_table(enumerated, started_us);
+		if (enumerated) hid_free_enumeration(enumerated);
+		if (!t) atom_store_rel(&index_stale, 1);
+
+		pthread_mutex_lock(&mutex);
+		if (t) {
+			release_table(fresh_table); // not adopted yet, t is newer
+			fresh_table = t;
+			atom_store_rel(&fresh_ready, 1);
+		}
+		atom_store_rel(&refreshing, 0);
+	}
+	pthread_mutex_unlock(&mutex);
+	return 0;
+}
+
+/**
+ *  Let refresher thread enumerate devices, a request made while one is pending is merged into it
+ */
+static void request_refresh(void) {
+	pthread_mutex_lock(&mutex);
+	refresh_requested = 1;
+	pthread_cond_signal(&cond_requested);
+	pthread_mutex_unlock(&mutex);
+}
+
+/**
+ *  Request a refresh by lookup, unless one is pending or running
+ */
+static void request_refresh_once(void) {
+	if (atom_exchange(&refreshing, 1) == 0) request_refresh();
+}
+
+void hid_index_initialize(void) {
+	index_stale = 1;
+	hid_init(); // not thread-safe, so HID API is initialized before refresher thread calls it
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&cond_requested, NULL);
+	refresh_requested = 1; // the index is ready soon after start
+	requested_stop = 0;
+	refresher_started = (pthread_create(&refresher, 0, proc_refreshing, 0) == 0);
+	if (!refresher_started) HID_INDEX_TRACE("failed to start refresher thread");
+}
+
+void hid_index_refresh(const struct hid_device_info *root) {
+	struct hid_device_info *enumerated = 0;
+	struct hid_index_table *t;
+	uint64_t started_us = hr_clock_get_us();
+
+	// clear stale flag first, so an invalidation during enumeration is not lost
+	atom_exchange(&index_stale, 0);
+	if (!root) root = enumerated = hid_enumerate(0, 0);
+	t = build_table(root, started_us);
+	if (t) adopt_table(t);
+	else atom_store_rel(&index_stale, 1);
+
+	if (enumerated) hid_free_enumeration(enumerated);
+}
+
+static const char *find(const struct hid_index_key *key) {
+	size_t i;
+	if (!index_table) return 0;
+	for (i = hash_key(key) & index_table->mask; index_table->entries[i].path; i = (i + 1) & index_table->mask) {
+		if (equals_key(&index_table->entries[i].key, key)) return index_table->entries[i].path;
+	}
+	return 0;
+}
+
+const char *hid_index_lookup(const struct hid_index_key *key) {
+	const char *path;
+	uint64_t age_us;
+
+	if (atom_load_acq(&fresh_ready)) {
+		struct hid_index_table *t;
+		pthread_mutex_lock(&mutex);
+		t = fresh_table;
+		fresh_table = 0;
+		atom_store_rel(&fresh_ready, 0);
+		pthread_mutex_unlock(&mutex);
+		if (t) adopt_table(t);
+	}
+
+	if (!refresher_started) {
+		// enumerated here as a fallback, the thread looking up waits for it
+		if (!index_table || atom_load_acq(&index_stale) ||
+			hr_clock_get_us() - index_table->built_us > HID_INDEX_TTL_US) hid_index_refresh(0);
+		return find(key);
+	}
+
+	age_us = index_table? hr_clock_get_us() - index_table->built_us: 0;
+	if (atom_load_acq(&index_stale) || age_us > HID_INDEX_TTL_US) {
+		HID_INDEX_TRACE("index is rebuilt in background");
+		request_refresh_once();
+	}
+
+	path = find(key);
+	if (!path && age_us > HID_INDEX_MISS_REFRESH_US) {
+		HID_INDEX_TRACE("index is rebuilt in background on miss");
+		request_refresh_once();
+	}
+	return path;
+}
+
+void hid_index_invalidate(void) {
+	atom_store_rel(&index_stale, 1);
+	if (refresher_started) request_refresh(); // e.g. on hotplug, the index is rebuilt before it is looked up
+}
+
+void hid_index_finalize(void) {
+	if (refresher_started) {
+		pthread_mutex_lock(&mutex);
+		requested_stop = 1;
+		pthread_cond_signal(&cond_requested);
+		pthread_mutex_unlock(&mutex);
+		pthread_join(refresher, NULL);
+		refresher_started = 0;
+	}
+	pthread_cond_destroy(&cond_requested);
+	pthread_mutex_destroy(&mutex);
+	release_table(fresh_table);
+	fresh_table = 0;
+	fresh_ready = 0;
+	refreshing = 0;
+	release_table(index_table);
+	index_table = 0;
+	index_stale = 1;
+}
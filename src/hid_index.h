@@ -0,0 +1,70 @@
+/**
+ *  HID Index module
+ *  Cache of enumerated HID IFs to resolve a virtual-path into a device path
+ *  by a hash lookup instead of enumerating all devices on every request.
+ *  Devices are enumerated on a thread of the module, so a lookup never waits for enumeration;
+ *  the table built is adopted by the next lookup
+ */
+
+#ifndef _HID_INDEX_H_
+#define _HID_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct hid_device_info;
+
+/**
+ *  Identifier of HID IF given by virtual-path
+ *  (IF number, Vendor ID, Product ID, Usage Page, Usage)
+ */
+struct hid_index_key {
+	uint16_t interface_number;
+	uint16_t vendor_id;
+	uint16_t product_id;
+	uint16_t usage_page;
+	uint16_t usage;
+};
+
+/**
+ *  Make a key from device information
+ */
+void hid_index_make_key(struct hid_index_key *key, const struct hid_device_info *info);
+
+/**
+ *  Parse a virtual-path like "/hid/0001/0123/abcd/0001/0002/" into a key
+ *  It returns 1 on success; 0 when the path is malformed
+ */
+int hid_index_parse_virtual_path(const char *path, size_t len, struct hid_index_key *key);
+
+/**
+ *  Initialize the index and start its thread, which builds it at once
+ */
+void hid_index_initialize(void);
+
+/**
+ *  Find device path of HID IF
+ *  A stale or old index (or a miss on it) lets it be rebuilt in background, and the current one is looked up meanwhile
+ *  Returned string is valid until next lookup or refresh
+ *  It returns 0 when no HID IF is matched
+ */
+const char *hid_index_lookup(const struct hid_index_key *key);
+
+/**
+ *  Rebuild the index from an enumeration of all devices at once, on the thread looking up
+ *  When root is NULL, devices are enumerated by the module itself
+ */
+void hid_index_refresh(const struct hid_device_info *root);
+
+/**
+ *  Mark the index stale (e.g. on hotplug), it is rebuilt in background
+ *  It is safe to be called from any thread
+ */
+void hid_index_invalidate(void);
+
+/**
+ *  Stop the thread and release the index
+ */
+void hid_index_finalize(void);
+
+#endif //#ifndef _HID_INDEX_H_
@@ -0,0 +1,126 @@
+/**
+ *  HID Overlapped module
+ */
+
+#ifdef _WIN32
+
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include <hidsdi.h>
+#include <hidpi.h>
+
+#include "hid_overlapped.h"
+
+#ifdef _DEBUG
+#include <stdio.h>
+#define HID_OVERLAPPED_TRACE(msg)	\
+	printf("%s (% 4d): %s\r\n", __FUNCTION__, __LINE__, msg)
+#else //_DEBUG
+#define HID_OVERLAPPED_TRACE(msg)
+#endif //_DEBUG
+
+struct _hid_overlapped {
+	HANDLE handle;
+	OVERLAPPED ol;
+	uint8_t *buf; /// report read, with report ID in the first byte
+	DWORD size; /// InputReportByteLength of HID IF
+	int pending; /// boolean, a ReadFile is issued and not taken yet
+};
+
+/**
+ *  Issue a ReadFile, its completion signals the event
+ */
+static int start_read(hid_overlapped_t h) {
+	ResetEvent(h->ol.hEvent);
+	if (!ReadFile(h->handle, h->buf, h->size, NULL, &h->ol) && GetLastError() != ERROR_IO_PENDING) {
+		HID_OVERLAPPED_TRACE("failed to read HID");
+		return 0;
+	}
+	h->pending = 1;
+	return 1;
+}
+
+hid_overlapped_t hid_overlapped_open(const char *path) {
+	hid_overlapped_t h = (hid_overlapped_t) calloc(1, sizeof(struct _hid_overlapped));
+	PHIDP_PREPARSED_DATA pp = 0;
+	HIDP_CAPS caps;
+
+	if (!h) return 0;
+	h->handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, 0);
+	if (h->handle == INVALID_HANDLE_VALUE) {
+		HID_OVERLAPPED_TRACE("failed to open HID");
+		free(h);
+		return 0;
+	}
+	if (!HidD_GetPreparsedData(h->handle, &pp) || HidP_GetCaps(pp, &caps) != HIDP_STATUS_SUCCESS ||
+		caps.InputReportByteLength == 0) {
+		HID_OVERLAPPED_TRACE("HID has no input report");
+		goto ERROR;
+	}
+	h->size = caps.InputReportByteLength;
+	h->buf = (uint8_t *) malloc(h->size);
+	h->ol.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (!h->buf || !h->ol.hEvent || !start_read(h)) goto ERROR;
+	HidD_FreePreparsedData(pp);
+	return h;
+
+ERROR:
+	if (pp) HidD_FreePreparsedData(pp);
+	if (h->ol.hEvent) CloseHandle(h->ol.hEvent);
+	CloseHandle(h->handle);
+	free(h->buf);
+	free(h);
+	return 0;
+}
+
+void *hid_overlapped_get_event(const hid_overlapped_t h) {
+	return h->ol.hEvent;
+}
+
+int hid_overlapped_read(hid_overlapped_t h, uint8_t *data, size_t length) {
+	const uint8_t *report = h->buf;
+	DWORD n = 0;
+
+	if (!h->pending && !start_read(h)) {
+		ResetEvent(h->ol.hEvent); // not to be waited on again until retried
+		return -1;
+	}
+	if (!GetOverlappedResult(h->handle, &h->ol, &n, FALSE)) {
+		if (GetLastError() == ERROR_IO_INCOMPLETE) return 0;
+		HID_OVERLAPPED_TRACE("failed to read HID");
+		h->pending = 0;
+		ResetEvent(h->ol.hEvent);
+		return -1;
+	}
+	h->pending = 0;
+
+	if (n > 0 && report[0] == 0) {
+		// HID without report IDs
+		report++;
+		n--;
+	}
+	if (n > length) n = (DWORD) length;
+	memcpy(data, report, n);
+	start_read(h); // failure is told by the next call
+	return (int) n;
+}
+
+void hid_overlapped_reset_event(hid_overlapped_t h) {
+	ResetEvent(h->ol.hEvent);
+}
+
+void hid_overlapped_close(hid_overlapped_t h) {
+	if (h->pending) {
+		DWORD n;
+		CancelIoEx(h->handle, &h->ol); // ReadFile may have been issued by another thread
+		GetOverlappedResult(h->handle, &h->ol, &n, TRUE); // buffer is not written after it
+	}
+	CloseHandle(h->ol.hEvent);
+	CloseHandle(h->handle);
+	free(h->buf);
+	free(h);
+}
+
+#endif //_WIN32
@@ -0,0 +1,48 @@
+/**
+ *  HID Overlapped module
+ *  Windows only: input reports of a HID IF are read by overlapped ReadFile on a handle of its own,
+ *  so a worker waits for the events of many HID IFs at once instead of polling them in turn.
+ *  Output and feature reports are still sent through HID API
+ */
+
+#ifndef _HID_OVERLAPPED_H_
+#define _HID_OVERLAPPED_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ *  Type of a HID IF being read is pointer to struct
+ */
+struct _hid_overlapped;
+typedef struct _hid_overlapped *hid_overlapped_t;
+
+/**
+ *  Open a HID IF by device path and start reading it
+ *  It returns 0 when it could not be opened (e.g. not a device path of Windows)
+ */
+hid_overlapped_t hid_overlapped_open(const char *path);
+
+/**
+ *  Get the manual-reset event (HANDLE) signaled while a report is ready to be read
+ */
+void *hid_overlapped_get_event(const hid_overlapped_t h);
+
+/**
+ *  Take a report read without blocking, and start reading the next one
+ *  Report ID of 0 is stripped as hid_read does, and a report longer than length is truncated
+ *  It returns length of the report; 0 when none is ready; -1 on error (e.g. unplugged)
+ */
+int hid_overlapped_read(hid_overlapped_t h, uint8_t *data, size_t length);
+
+/**
+ *  Reset the event while a report ready is left unread, to wait for something else meanwhile
+ */
+void hid_overlapped_reset_event(hid_overlapped_t h);
+
+/**
+ *  Cancel reading and close the handle, it may be called on any thread
+ */
+void hid_overlapped_close(hid_overlapped_t h);
+
+#endif //#ifndef _HID_OVERLAPPED_H_
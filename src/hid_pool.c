@@ -0,0 +1,194 @@
+/**
+ *  HID Pool module
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "atom.h"
+#include "bdl_list.h"
+#include "hr_clock.h"
+#include "hid_pool.h"
+
+#ifdef _DEBUG
+#include <stdio.h>
+#define HID_POOL_TRACE(msg)	\
+	printf("%s (% 4d): %s\r\n", __FUNCTION__, __LINE__, msg)
+#else //_DEBUG
+#define HID_POOL_TRACE(msg)
+#endif //_DEBUG
+
+/**
+ *  Handle which is not used for this period is closed
+ */
+#define HID_POOL_IDLE_TIMEOUT_US	(10 * 1000 * 1000)
+
+struct _hid_pool_entry {
+	struct hid_index_key key;
+	char path[HID_POOL_PATH_MAX]; /// device path found when the entry was made
+	atom_ptr_t device; /// hid_device opened by hid_pool_open on any thread, 0 until then
+	int refs; /// number of users
+	void *reader; /// object reading input reports
+	hid_desc_t desc; /// parsed report descriptor, or 0 when it is not fetched or not available
+	int desc_fetched; /// boolean, desc is set by its user
+	int broken; /// boolean, not to be reused
+	uint64_t last_used_us;
+	bdl_list_node_t node;
+};
+
+static bdl_list_t hid_pool_list = 0;
+
+void hid_pool_initialize(void) {
+	hid_pool_list = bdl_list_create();
+}
+
+static hid_pool_entry_t search_entry(const struct hid_index_key *key) {
+	bdl_list_node_t node = bdl_list_get_head(hid_pool_list);
+	while (node) {
+		hid_pool_entry_t e = (hid_pool_entry_t)bdl_list_extract_content(node);
+		if (!e->broken && memcmp(&e->key, key, sizeof(struct hid_index_key)) == 0) return e;
+		node = bdl_list_get_next(hid_pool_list, node);
+	}
+	return 0;
+}
+
+static void close_entry(void *content) {
+	hid_pool_entry_t e = (hid_pool_entry_t)content;
+	if (e->device) hid_close((hid_device *) e->device);
+	if (e->desc) hid_desc_destroy(e->desc);
+	free(e);
+}
+
+static void remove_entry(hid_pool_entry_t e) {
+	bdl_list_delete_node(hid_pool_list, e->node);
+	close_entry(e);
+}
+
+hid_pool_entry_t hid_pool_acquire(const struct hid_index_key *key) {
+	hid_pool_entry_t e = search_entry(key);
+	if (!e) {
+		const char *path = hid_index_lookup(key);
+		if (!path || strlen(path) >= HID_POOL_PATH_MAX) {
+			HID_POOL_TRACE("HID is not found");
+			return 0;
+		}
+
+		e = (hid_pool_entry_t)malloc(sizeof(struct _hid_pool_entry));
+		if (e) {
+			e->key = *key;
+			strcpy(e->path, path);
+			e->device = 0;
+			e->refs = 0;
+			e->reader = 0;
+			e->desc = 0;
+			e->desc_fetched = 0;
+			e->broken = 0;
+			e->node = bdl_list_append_node(hid_pool_list, e);
+			if (!e->node) {
+				free(e);
+				e = 0;
+			}
+		}
+		if (!e) {
+			HID_POOL_TRACE("failed to allocate memory");
+			return 0;
+		}
+	}
+
+	e->refs++;
+	e->last_used_us = hr_clock_get_us();
+	return e;
+}
+
+void hid_pool_release(hid_pool_entry_t e) {
+	e->refs--;
+	e->last_used_us = hr_clock_get_us();
+	if (e->refs == 0 && e->broken) remove_entry(e);
+}
+
+void hid_pool_discard(hid_pool_entry_t e) {
+	if (e->reader) return; // another entry would be opened and read by a second reader
+	e->broken = 1;
+}
+
+hid_device *hid_pool_open(hid_pool_entry_t e) {
+	hid_device *dev = (hid_device *) atom_ptr_load_acq(&e->device);
+	if (dev) return dev;
+
+	dev = hid_open_path(e->path);
+	if (!dev) {
+		HID_POOL_TRACE("HID could not be opened");
+		hid_index_invalidate(); // device may have been unplugged
+		return 0;
+	}
+	if (!atom_ptr_cas(&e->device, 0, dev)) {
+		// opened by another thread meanwhile
+		hid_close(dev);
+		dev = (hid_device *) atom_ptr_load_acq(&e->device);
+	}
+	return dev;
+}
+
+hid_device *hid_pool_get_device(const hid_pool_entry_t e) {
+	return (hid_device *) atom_ptr_load_acq(&e->device);
+}
+
+const char *hid_pool_get_path(const hid_pool_entry_t e) {
+	return e->path;
+}
+
+void hid_pool_set_reader(hid_pool_entry_t e, void *reader) {
+	e->reader = reader;
+}
+
+void *hid_pool_get_reader(const hid_pool_entry_t e) {
+	return e->reader;
+}
+
+void hid_pool_retain(hid_pool_entry_t e) {
+	e->refs++;
+	e->last_used_us = hr_clock_get_us();
+}
+
+int hid_pool_is_descriptor_fetched(const hid_pool_entry_t e) {
+	return e->desc_fetched;
+}
+
+void hid_pool_set_descriptor(hid_pool_entry_t e, hid_desc_t desc) {
+	if (e->desc_fetched) {
+		if (desc) hid_desc_destroy(desc); // fetched twice, e.g. by REST while a subscriber waited for it
+		return;
+	}
+	e->desc = desc;
+	e->desc_fetched = 1;
+}
+
+hid_desc_t hid_pool_get_descriptor(const hid_pool_entry_t e) {
+	return e->desc;
+}
+
+const struct hid_index_key *hid_pool_get_key(const hid_pool_entry_t e) {
+	return &e->key;
+}
+
+int hid_pool_get_numof_handles(void) {
+	return hid_pool_list? bdl_list_get_size(hid_pool_list): 0;
+}
+
+void hid_pool_evict_idle(void) {
+	uint64_t now_us = hr_clock_get_us();
+	bdl_list_node_t node = bdl_list_get_head(hid_pool_list);
+	while (node) {
+		hid_pool_entry_t e = (hid_pool_entry_t)bdl_list_extract_content(node);
+		node = bdl_list_get_next(hid_pool_list, node);
+		if (e->refs == 0 && now_us - e->last_used_us > HID_POOL_IDLE_TIMEOUT_US) {
+			HID_POOL_TRACE("idle handle is closed");
+			remove_entry(e);
+		}
+	}
+}
+
+void hid_pool_finalize(void) {
+	bdl_list_destroy(hid_pool_list, close_entry);
+	hid_pool_list = 0;
+}
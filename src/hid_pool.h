@@ -0,0 +1,123 @@
+/**
+ *  HID Pool module
+ *  Open HID handles are kept by virtual-path and reused across requests and connections
+ *  An entry is made without opening the HID, and its handle is opened by hid_pool_open on first use,
+ *  so mongoose thread never waits for a HID being opened unless it opens one itself.
+ *  All functions must be called from mongoose thread, but hid_pool_open, hid_pool_get_device and hid_pool_get_path
+ */
+
+#ifndef _HID_POOL_H_
+#define _HID_POOL_H_
+
+#include <hidapi.h>
+#include "hid_index.h"
+#include "hid_desc.h"
+
+/**
+ *  Type of pooled handle is pointer to struct
+ */
+struct _hid_pool_entry;
+typedef struct _hid_pool_entry *hid_pool_entry_t;
+
+/**
+ *  Initialize the pool
+ */
+void hid_pool_initialize(void);
+
+/**
+ *  Longest device path kept by an entry
+ */
+#define HID_POOL_PATH_MAX	(256)
+
+/**
+ *  Get an entry of HID IF, it is made (without opening the HID) only when the pool does not hold it yet
+ *  It returns 0 when the HID IF is not found
+ */
+hid_pool_entry_t hid_pool_acquire(const struct hid_index_key *key);
+
+/**
+ *  Open the handle of an entry unless it is open, it may be called on any thread holding a reference of the entry
+ *  It blocks while the HID is opened, so it is called by threads serving requests rather than mongoose thread
+ *  It returns the handle; 0 when the HID could not be opened (it is retried by the next call)
+ */
+hid_device *hid_pool_open(hid_pool_entry_t e);
+
+/**
+ *  Give back a handle got by hid_pool_acquire
+ *  The handle stays open until it is idle for a while
+ */
+void hid_pool_release(hid_pool_entry_t e);
+
+/**
+ *  Mark a handle broken (e.g. HID was unplugged), it is closed when all users release it
+ *  A handle being read is left as it is, its reader discards it when it stops after errors
+ */
+void hid_pool_discard(hid_pool_entry_t e);
+
+/**
+ *  Get HID device of a handle
+ *  It returns 0 when it is not opened yet
+ */
+hid_device *hid_pool_get_device(const hid_pool_entry_t e);
+
+/**
+ *  Get device path of a handle, found when the entry was made
+ */
+const char *hid_pool_get_path(const hid_pool_entry_t e);
+
+/**
+ *  Get key (virtual-path) of a handle
+ */
+const struct hid_index_key *hid_pool_get_key(const hid_pool_entry_t e);
+
+/**
+ *  Add a reference to a handle held already, released by hid_pool_release
+ */
+void hid_pool_retain(hid_pool_entry_t e);
+
+/**
+ *  Tell whether report descriptor of a handle has been fetched (even when it was not available)
+ *  The descriptor is not read by the pool, but fetched by its user off mongoose thread when it is needed first
+ */
+int hid_pool_is_descriptor_fetched(const hid_pool_entry_t e);
+
+/**
+ *  Keep report descriptor fetched (0 when it is not available), it is destroyed with the handle
+ *  desc is destroyed instead when one has been kept already
+ */
+void hid_pool_set_descriptor(hid_pool_entry_t e, hid_desc_t desc);
+
+/**
+ *  Get parsed report descriptor of a handle
+ *  It returns 0 when it is not fetched yet, or not available on the platform or malformed
+ */
+hid_desc_t hid_pool_get_descriptor(const hid_pool_entry_t e);
+
+/**
+ *  Get number of handles held (some of them may not be opened yet)
+ */
+int hid_pool_get_numof_handles(void);
+
+/**
+ *  Attach an object reading input reports from a handle (0 to detach)
+ *  Only one reader is allowed for a handle, since reading concurrently is not safe
+ */
+void hid_pool_set_reader(hid_pool_entry_t e, void *reader);
+
+/**
+ *  Get an object reading input reports from a handle
+ *  It returns 0 when nobody reads
+ */
+void *hid_pool_get_reader(const hid_pool_entry_t e);
+
+/**
+ *  Close handles which have not been used for a while
+ */
+void hid_pool_evict_idle(void);
+
+/**
+ *  Close all handles and release the pool
+ */
+void hid_pool_finalize(void);
+
+#endif //#ifndef _HID_POOL_H_
@@ -0,0 +1,282 @@
+/**
+ *  HID Request module
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "hr_clock.h"
+#include "hid_request.h"
+
+#ifdef _DEBUG
+#include <stdio.h>
+#define HID_REQUEST_TRACE(msg)	\
+	printf("%s (% 4d): %s\r\n", __FUNCTION__, __LINE__, msg)
+#else //_DEBUG
+#define HID_REQUEST_TRACE(msg)
+#endif //_DEBUG
+
+/**
+ *  Threads started by default, it bounds number of HIDs served at once
+ */
+#define HID_REQUEST_DEFAULT_THREADS	(4)
+/**
+ *  Threads are not started more than this (output threads included)
+ */
+#define HID_REQUEST_MAX_THREADS	(32)
+/**
+ *  Threads started in addition to others, which run output reports only
+ *  so requests waiting an input report never hold every thread outputs can use
+ */
+#define HID_REQUEST_OUTPUT_THREADS	(2)
+
+/// Lists below are FIFO linked by next, and changed under mutex
+struct request_list {
+	struct hid_request *head;
+	struct hid_request *tail;
+};
+
+static pthread_t threads[HID_REQUEST_MAX_THREADS];
+static void *running[HID_REQUEST_MAX_THREADS]; /// handle used by each thread now, 0 when idle or private
+static int num_threads = 0; /// output threads included
+static int num_shared = 0; /// threads running any kind, indexed before output threads
+static int num_inputs = 0; /// HID_REQUEST_GET_INPUT being run, at most num_shared - 1 of them unless num_shared is 1
+static pthread_mutex_t mutex;
+static pthread_cond_t cond_changed; /// threads wait for requests, or for a handle being used to be free
+static struct request_list pending = { 0, 0 };
+static struct request_list completed = { 0, 0 };
+static int num_submitted = 0; /// requests not taken back yet
+static int requested_stop = 0; /// boolean
+static void (*on_completed)(void) = 0;
+static hid_device *(*open_handle)(void *handle) = 0;
+
+static void append_request(struct request_list *l, struct hid_request *r) {
+	r->next = 0;
+	if (l->tail) l->tail->next = r;
+	else l->head = r;
+	l->tail = r;
+}
+
+static void free_requests(struct request_list *l) {
+	while (l->head) {
+		struct hid_request *r = l->head;
+		l->head = r->next;
+		if (r->desc) hid_desc_destroy(r->desc);
+		free(r);
+	}
+	l->tail = 0;
+}
+
+/**
+ *  Tell whether a thread may run a kind of request: output threads run output reports only,
+ *  and one shared thread is always left to requests other than input reports
+ */
+static int can_run(int index, int kind) {
+	if (index >= num_shared) return kind == HID_REQUEST_SET_OUTPUT;
+	if (kind == HID_REQUEST_GET_INPUT) return num_inputs == 0 || num_inputs < num_shared - 1;
+	return 1;
+}
+
+/**
+ *  Take the oldest pending request the thread may run whose handle is not used by another thread, called under mutex
+ *  A request is not taken before an older one of its handle, so requests to a handle keep their order
+ */
+static struct hid_request *take_runnable(int index) {
+	struct hid_request *r, *prev = 0;
+	for (r = pending.head; r; prev = r, r = r->next) {
+		int i, busy = 0;
+		if (r->handle) {
+			struct hid_request *older;
+			for (i = 0; i < num_threads && !busy; i++) busy = (running[i] == r->handle);
+			for (older = pending.head; older != r && !busy; older = older->next) busy = (older->handle == r->handle);
+		}
+		if (!busy && can_run(index, r->kind)) break;
+	}
+	if (r) {
+		if (prev) prev->next = r->next;
+		else pending.head = r->next;
+		if (pending.tail == r) pending.tail = prev;
+	}
+	return r;
+}
+
+/**
+ *  Read and parse report descriptor of the HID IF of path, it opens the device node itself (hidraw of Linux)
+ */
+static void fetch_descriptor(struct hid_request *r) {
+	uint8_t *buf = (uint8_t *)malloc(HID_DESC_MAX_SIZE);
+	int size = buf? hid_desc_fetch(r->path, buf, HID_DESC_MAX_SIZE): -1;
+	if (size > 0) r->desc = hid_desc_parse(buf, size);
+	if (!r->desc) HID_REQUEST_TRACE("report descriptor is not available");
+	r->result = r->desc? size: -1;
+	free(buf);
+}
+
+static void run_request(struct hid_request *r) {
+	hid_device *dev;
+	const wchar_t *err;
+
+	r->error[0] = L'\0';
+	if (r->kind == HID_REQUEST_GET_DESCRIPTOR) {
+		fetch_descriptor(r);
+		return;
+	}
+	dev = r->handle? open_handle(r->handle): hid_open_path(r->path);
+	if (!dev) {
+		HID_REQUEST_TRACE("failed to open HID");
+		r->result = -1;
+		r->gone = 1;
+		return;
+	}
+	switch (r->kind) {
+	case HID_REQUEST_GET_FEATURE:
+		r->result = hid_get_feature_report(dev, r->data, r->length);
+		break;
+	case HID_REQUEST_SET_FEATURE:
+		r->result = hid_send_feature_report(dev, r->data, r->length);
+		break;
+	case HID_REQUEST_GET_INPUT:
+		r->result = hid_read_timeout(dev, r->data, r->length, r->timeout_ms);
+		break;
+	case HID_REQUEST_SET_OUTPUT:
+		r->result = hid_write(dev, r->data, r->length);
+		break;
+	default:
+		r->result = -1;
+		break;
+	}
+	if (r->result <= 0) {
+		err = hid_error(dev);
+		if (err) {
+			wcsncpy(r->error, err, HID_REQUEST_ERROR_MAX - 1);
+			r->error[HID_REQUEST_ERROR_MAX - 1] = L'\0';
+		}
+	}
+	if (!r->handle) hid_close(dev);
+	if (r->result < 0 && r->handle && r->path[0]) {
+		// a report the HID does not support fails as well, so the handle is taken as stale only when the HID is not found again
+		hid_device *probe = hid_open_path(r->path);
+		if (probe) hid_close(probe);
+		else r->gone = 1;
+	}
+}
+
+static void *proc_request(void *param) {
+	int index = (int)(intptr_t)param;
+
+	pthread_mutex_lock(&mutex);
+	for (;;) {
+		struct hid_request *r = 0;
+		while (!requested_stop && (r = take_runnable(index)) == 0) pthread_cond_wait(&cond_changed, &mutex);
+		if (requested_stop) break; // pending requests are freed on finalizing
+		running[index] = r->handle;
+		if (r->kind == HID_REQUEST_GET_INPUT) num_inputs++;
+		pthread_mutex_unlock(&mutex);
+
+		// the request is not touched by others until it is completed
+		run_request(r);
+		r->completed_us = hr_clock_get_us();
+
+		pthread_mutex_lock(&mutex);
+		running[index] = 0;
+		if (r->kind == HID_REQUEST_GET_INPUT) num_inputs--;
+		append_request(&completed, r);
+		pthread_cond_broadcast(&cond_changed); // requests waiting the handle may run now
+		if (on_completed) {
+			pthread_mutex_unlock(&mutex);
+			on_completed();
+			pthread_mutex_lock(&mutex);
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	return 0;
+}
+
+int hid_request_initialize(int n, void (*callback)(void), hid_device *(*open)(void *handle)) {
+	if (n <= 0) n = HID_REQUEST_DEFAULT_THREADS;
+	if (n > HID_REQUEST_MAX_THREADS - HID_REQUEST_OUTPUT_THREADS) n = HID_REQUEST_MAX_THREADS - HID_REQUEST_OUTPUT_THREADS;
+
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&cond_changed, NULL);
+	on_completed = callback;
+	open_handle = open;
+	requested_stop = 0;
+	num_submitted = 0;
+	num_inputs = 0;
+	memset(running, 0, sizeof(running));
+	num_shared = n; // set before threads look at it
+	for (num_threads = 0; num_threads < n + HID_REQUEST_OUTPUT_THREADS; num_threads++) {
+		if (pthread_create(&threads[num_threads], 0, proc_request, (void *)(intptr_t) num_threads) != 0) {
+			HID_REQUEST_TRACE("failed to start thread");
+			break;
+		}
+	}
+	if (num_threads < num_shared) {
+		// no thread is left to requests other than outputs, so none is served
+		pthread_mutex_lock(&mutex);
+		requested_stop = 1;
+		pthread_cond_broadcast(&cond_changed);
+		pthread_mutex_unlock(&mutex);
+		for (n = 0; n < num_threads; n++) pthread_join(threads[n], NULL);
+		requested_stop = 0;
+		num_threads = 0;
+	}
+	return num_threads;
+}
+
+int hid_request_submit(struct hid_request *r) {
+	if (num_threads == 0) return 0;
+
+	pthread_mutex_lock(&mutex);
+	if (num_submitted >= HID_REQUEST_QUEUE_MAX) {
+		pthread_mutex_unlock(&mutex);
+		return 0;
+	}
+	r->result = -1;
+	r->error[0] = L'\0';
+	r->gone = 0;
+	r->desc = 0;
+	r->submitted_us = hr_clock_get_us();
+	r->completed_us = 0;
+	append_request(&pending, r);
+	num_submitted++;
+	pthread_cond_broadcast(&cond_changed); // an idle thread may not be the one able to run it
+	pthread_mutex_unlock(&mutex);
+	return 1;
+}
+
+struct hid_request *hid_request_poll(void) {
+	struct hid_request *r;
+	pthread_mutex_lock(&mutex);
+	r = completed.head;
+	if (r) {
+		completed.head = r->next;
+		if (!completed.head) completed.tail = 0;
+		r->next = 0;
+		num_submitted--;
+	}
+	pthread_mutex_unlock(&mutex);
+	return r;
+}
+
+void hid_request_finalize(void) {
+	int i;
+
+	pthread_mutex_lock(&mutex);
+	requested_stop = 1;
+	pthread_cond_broadcast(&cond_changed);
+	pthread_mutex_unlock(&mutex);
+	for (i = 0; i < num_threads; i++) pthread_join(threads[i], NULL);
+
+	free_requests(&pending);
+	free_requests(&completed);
+	num_submitted = 0;
+	num_threads = 0;
+	num_shared = 0;
+	num_inputs = 0;
+	on_completed = 0;
+	open_handle = 0;
+	pthread_cond_destroy(&cond_changed);
+	pthread_mutex_destroy(&mutex);
+}
@@ -0,0 +1,93 @@
+/**
+ *  HID Request module
+ *  Feature/ Input/ Output reports requested by REST are got or set on threads of the module,
+ *  so a HID slow to answer (e.g. waiting an input report) never stalls the thread submitting them (mongoose thread).
+ *  A HID is opened by the thread running its request as well, so the submitter never waits for it.
+ *  Requests to one HID handle are run one by one in order of submission; ones to different handles run at once.
+ *  Output reports have threads of their own besides, and requests waiting input reports never take every shared thread,
+ *  so neither outputs nor other requests wait for input reports of quiet HIDs.
+ *  It serves as the lock of a handle: feature and output reports set through the module never overlap on it.
+ *  Requests are submitted and taken back by one thread
+ */
+
+#ifndef _HID_REQUEST_H_
+#define _HID_REQUEST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <wchar.h>
+
+#include <hidapi.h>
+#include "hid_desc.h"
+
+/**
+ *  Longest report to be got or set
+ */
+#define HID_REQUEST_REPORT_MAX	(256)
+/**
+ *  Longest device path of a HID IF opened by a request
+ */
+#define HID_REQUEST_PATH_MAX	(256)
+/**
+ *  Longest message of hid_error kept for a failed request
+ */
+#define HID_REQUEST_ERROR_MAX	(128)
+/**
+ *  Requests submitted but not taken back yet at most
+ */
+#define HID_REQUEST_QUEUE_MAX	(64)
+
+/**
+ *  Kinds of request
+ */
+#define HID_REQUEST_GET_FEATURE	(0)
+#define HID_REQUEST_SET_FEATURE	(1)
+#define HID_REQUEST_GET_INPUT	(2) /// waits an input report up to timeout_ms
+#define HID_REQUEST_SET_OUTPUT	(3)
+#define HID_REQUEST_GET_DESCRIPTOR	(4) /// reads and parses report descriptor of path, no handle is opened
+
+/**
+ *  A request, allocated by the submitter and owned by the module until it is taken back
+ */
+struct hid_request {
+	int kind;
+	void *handle; /// shared handle to be used, opened by open_handle given to hid_request_initialize; or 0 to open path for the request only (closed after it)
+	char path[HID_REQUEST_PATH_MAX]; /// device path opened when handle is 0, and probed when a request on handle fails
+	int timeout_ms; /// for HID_REQUEST_GET_INPUT
+	uint8_t data[HID_REQUEST_REPORT_MAX]; /// report to be set, or report got
+	size_t length; /// length of report to be set, or size of report to be got
+	int result; /// returned by HID API, -1 on error (also when path could not be opened)
+	wchar_t error[HID_REQUEST_ERROR_MAX]; /// hid_error of a failed request, empty when it tells nothing
+	int gone; /// boolean, the request failed and path could not be opened (again), so the HID is taken as unplugged
+	hid_desc_t desc; /// parsed by HID_REQUEST_GET_DESCRIPTOR (0 when not available), owned by the submitter once taken back
+	void *ctx; /// given by the submitter, e.g. to find whom to reply
+	uint64_t submitted_us; /// monotonic time when submitted
+	uint64_t completed_us; /// monotonic time when HID API returned
+	struct hid_request *next; /// used by the module
+};
+
+/**
+ *  Start num_threads threads (0: default) and threads for output reports, on_completed is called on them whenever a request completes
+ *  open_handle is called on them to get HID device of a shared handle (opening it on first use), it returns 0 on fail
+ *  It returns the number of threads started, 0 when not all of num_threads could be started
+ */
+int hid_request_initialize(int num_threads, void (*on_completed)(void), hid_device *(*open_handle)(void *handle));
+
+/**
+ *  Queue a request to be run
+ *  It returns 1 on success; 0 when HID_REQUEST_QUEUE_MAX requests are not taken back yet
+ */
+int hid_request_submit(struct hid_request *r);
+
+/**
+ *  Take back a completed request, in order of completion
+ *  It returns 0 when none is completed
+ */
+struct hid_request *hid_request_poll(void);
+
+/**
+ *  Stop threads after requests being run, requests not taken back are freed
+ */
+void hid_request_finalize(void);
+
+#endif //#ifndef _HID_REQUEST_H_
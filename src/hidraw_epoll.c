@@ -0,0 +1,300 @@
+/**
+ *  Hidraw Epoll module
+ */
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "atom.h"
+#include "hidraw_epoll.h"
+
+#ifdef _DEBUG
+#include <stdio.h>
+#define HIDRAW_EPOLL_TRACE(msg)	\
+	printf("%s (% 4d): %s\r\n", __FUNCTION__, __LINE__, msg)
+#else //_DEBUG
+#define HIDRAW_EPOLL_TRACE(msg)
+#endif //_DEBUG
+
+/**
+ *  Number of events taken by an epoll_wait
+ */
+#define HIDRAW_EPOLL_MAX_EVENTS		(64)
+/**
+ *  hidraw never returns a report larger than this (HID_MAX_BUFFER_SIZE of kernel)
+ */
+#define HIDRAW_EPOLL_REPORT_SIZE	(4096)
+
+struct _hidraw_epoll_handle {
+	int fd;
+	struct hidraw_epoll_callbacks cb;
+	void *ctx;
+	atom_t paused; /// boolean, fd is left in epoll without events
+	int removed; /// boolean, events already taken for it are ignored
+	struct _hidraw_epoll_handle *next_removed;
+};
+
+static int epoll_fd = -1;
+static int wakeup_fd = -1; /// eventfd to wake the thread up
+static int uevent_fd = -1; /// netlink socket of kernel uevents
+static void (*hotplug_callback)(void) = 0;
+static pthread_t loop_thread;
+static atom_t requested_stop = 0;
+
+/// Handles are dispatched under this lock, so a handle is never removed while its callback runs.
+/// Removed handles are freed by the thread after dispatching events it has taken
+static pthread_mutex_t dispatch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct _hidraw_epoll_handle *removed_handles = 0;
+
+static int modify_events(hidraw_epoll_handle_t h, uint32_t events) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = h;
+	return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, h->fd, &ev);
+}
+
+/**
+ *  Leave reports in the buffer of HID until resumed
+ *  can_read is checked again after pausing, not to miss a resume racing with it
+ */
+static void pause_handle(hidraw_epoll_handle_t h) {
+	modify_events(h, 0);
+	atom_store_rel(&h->paused, 1);
+	if (h->cb.can_read(h->ctx)) hidraw_epoll_resume(h);
+}
+
+static void dispatch(hidraw_epoll_handle_t h) {
+	uint8_t buf[HIDRAW_EPOLL_REPORT_SIZE];
+
+	for (;;) {
+		ssize_t len;
+		if (!h->cb.can_read(h->ctx)) {
+			h->cb.on_drained(h->ctx);
+			pause_handle(h);
+			return;
+		}
+		len = read(h->fd, buf, sizeof(buf)); // hidraw returns one report per read
+		if (len > 0) {
+			h->cb.on_input(h->ctx, buf, (int) len);
+		} else if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			h->cb.on_drained(h->ctx);
+			return;
+		} else if (len == 0 || errno != EINTR) {
+			// hidraw fails with EIO once unplugged; end of file (e.g. of a socket whose peer closed) is taken as the same
+			HIDRAW_EPOLL_TRACE("failed to read hidraw");
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, h->fd, 0); // device was unplugged, do not spin on it
+			h->cb.on_drained(h->ctx);
+			h->cb.on_error(h->ctx);
+			return;
+		}
+	}
+}
+
+/**
+ *  Drain uevents, hotplug is told once if any of them is about hidraw
+ */
+static void read_uevents(void) {
+	char buf[4096];
+	ssize_t len;
+	int hit = 0;
+
+	while ((len = recv(uevent_fd, buf, sizeof(buf) - 1, 0)) > 0) {
+		// "ACTION@DEVPATH\0KEY=VALUE\0KEY=VALUE\0..."
+		const char *p = buf;
+		buf[len] = '\0';
+		while (p < buf + len) {
+			if (strcmp(p, "SUBSYSTEM=hidraw") == 0) hit = 1;
+			p += strlen(p) + 1;
+		}
+	}
+	if (hit && hotplug_callback) hotplug_callback();
+}
+
+static void *proc_loop(void *param) {
+	struct epoll_event events[HIDRAW_EPOLL_MAX_EVENTS];
+	(void) param;
+
+	while (atom_load_acq(&requested_stop) == 0) {
+		int num = epoll_wait(epoll_fd, events, HIDRAW_EPOLL_MAX_EVENTS, -1);
+		int i;
+		if (num < 0) {
+			if (errno == EINTR) continue;
+			HIDRAW_EPOLL_TRACE("epoll_wait failed");
+			break;
+		}
+
+		pthread_mutex_lock(&dispatch_mutex);
+		for (i = 0; i < num; i++) {
+			void *p = events[i].data.ptr;
+			if (p == &wakeup_fd) {
+				uint64_t count;
+				if (read(wakeup_fd, &count, sizeof(count)) < 0) HIDRAW_EPOLL_TRACE("failed to read eventfd");
+			} else if (p == &uevent_fd) {
+				read_uevents();
+			} else {
+				hidraw_epoll_handle_t h = (hidraw_epoll_handle_t) p;
+				if (!h->removed) dispatch(h);
+			}
+		}
+		while (removed_handles) {
+			hidraw_epoll_handle_t h = removed_handles;
+			removed_handles = h->next_removed;
+			free(h);
+		}
+		pthread_mutex_unlock(&dispatch_mutex);
+	}
+
+	return 0;
+}
+
+static void wakeup_loop(void) {
+	uint64_t one = 1;
+	if (write(wakeup_fd, &one, sizeof(one)) < 0) HIDRAW_EPOLL_TRACE("failed to write eventfd");
+}
+
+static int watch_fd(int *fd) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = fd; // address of the variable tells which fd it is
+	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, *fd, &ev);
+}
+
+static int open_uevent_socket(void) {
+	struct sockaddr_nl addr;
+	int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (fd < 0) return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1; // events of kernel
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int hidraw_epoll_initialize(void (*on_hotplug)(void)) {
+	hotplug_callback = on_hotplug;
+	atom_store_rel(&requested_stop, 0);
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epoll_fd < 0 || wakeup_fd < 0 || watch_fd(&wakeup_fd) < 0) {
+		HIDRAW_EPOLL_TRACE("failed to create epoll");
+		goto ERROR;
+	}
+
+	uevent_fd = open_uevent_socket();
+	if (uevent_fd < 0 || watch_fd(&uevent_fd) < 0) {
+		HIDRAW_EPOLL_TRACE("hotplug is not watched"); // not fatal, index expires by itself
+		if (uevent_fd >= 0) close(uevent_fd);
+		uevent_fd = -1;
+	}
+
+	if (pthread_create(&loop_thread, 0, proc_loop, 0) != 0) {
+		HIDRAW_EPOLL_TRACE("failed to create thread");
+		goto ERROR;
+	}
+	return 1;
+
+ERROR:
+	if (uevent_fd >= 0) close(uevent_fd);
+	if (wakeup_fd >= 0) close(wakeup_fd);
+	if (epoll_fd >= 0) close(epoll_fd);
+	uevent_fd = wakeup_fd = epoll_fd = -1;
+	return 0;
+}
+
+hidraw_epoll_handle_t hidraw_epoll_add(const char *path, const struct hidraw_epoll_callbacks *cb, void *ctx) {
+	int fd;
+
+	if (epoll_fd < 0) return 0;
+	fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC); // output reports are written through HID API
+	if (fd < 0) {
+		HIDRAW_EPOLL_TRACE("failed to open hidraw");
+		return 0;
+	}
+	return hidraw_epoll_add_fd(fd, cb, ctx);
+}
+
+hidraw_epoll_handle_t hidraw_epoll_add_fd(int fd, const struct hidraw_epoll_callbacks *cb, void *ctx) {
+	hidraw_epoll_handle_t h;
+	struct epoll_event ev;
+	int flags = fcntl(fd, F_GETFL);
+
+	if (epoll_fd < 0 || flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		close(fd);
+		return 0;
+	}
+	h = (hidraw_epoll_handle_t) malloc(sizeof(struct _hidraw_epoll_handle));
+	if (!h) {
+		close(fd);
+		return 0;
+	}
+
+	h->fd = fd;
+	h->cb = *cb;
+	h->ctx = ctx;
+	h->paused = 0;
+	h->removed = 0;
+	h->next_removed = 0;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = h;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, h->fd, &ev) < 0) {
+		HIDRAW_EPOLL_TRACE("failed to watch hidraw");
+		close(h->fd);
+		free(h);
+		return 0;
+	}
+	return h;
+}
+
+void hidraw_epoll_resume(hidraw_epoll_handle_t h) {
+	if (atom_exchange(&h->paused, 0)) modify_events(h, EPOLLIN);
+}
+
+void hidraw_epoll_remove(hidraw_epoll_handle_t h) {
+	pthread_mutex_lock(&dispatch_mutex);
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, h->fd, 0); // may be deleted already on error
+	close(h->fd);
+	h->removed = 1;
+	h->next_removed = removed_handles;
+	removed_handles = h;
+	pthread_mutex_unlock(&dispatch_mutex);
+	wakeup_loop(); // let it be freed
+}
+
+void hidraw_epoll_finalize(void) {
+	if (epoll_fd < 0) return;
+
+	atom_store_rel(&requested_stop, 1);
+	wakeup_loop();
+	pthread_join(loop_thread, NULL);
+
+	while (removed_handles) {
+		hidraw_epoll_handle_t h = removed_handles;
+		removed_handles = h->next_removed;
+		free(h);
+	}
+	if (uevent_fd >= 0) close(uevent_fd);
+	close(wakeup_fd);
+	close(epoll_fd);
+	uevent_fd = wakeup_fd = epoll_fd = -1;
+}
+
+#endif //__linux__
@@ -0,0 +1,65 @@
+/**
+ *  Hidraw Epoll module
+ *  Linux only: input reports of all HID IFs are read by one thread multiplexing /dev/hidraw* with epoll,
+ *  so no thread per HID IF is needed and nothing wakes up while HIDs are idle.
+ *  Hotplug of hidraw devices is watched through netlink uevents on the same thread.
+ */
+
+#ifndef _HIDRAW_EPOLL_H_
+#define _HIDRAW_EPOLL_H_
+
+#include <stdint.h>
+
+/**
+ *  Type of a HID IF being read is pointer to struct
+ */
+struct _hidraw_epoll_handle;
+typedef struct _hidraw_epoll_handle *hidraw_epoll_handle_t;
+
+/**
+ *  Functions called back on the epoll thread with ctx given by hidraw_epoll_add
+ */
+struct hidraw_epoll_callbacks {
+	int (*can_read)(void *ctx); /// returns 0 to leave reports in the buffer of HID, until hidraw_epoll_resume
+	void (*on_input)(void *ctx, const uint8_t *data, int len); /// a report was read
+	void (*on_drained)(void *ctx); /// no more report is available (or reading was paused) for now
+	void (*on_error)(void *ctx); /// HID IF was gone, no callback follows
+};
+
+/**
+ *  Start the epoll thread
+ *  on_hotplug is called on the thread when a hidraw device is added or removed (may be NULL)
+ *  It returns 1 on success; 0 on fail
+ */
+int hidraw_epoll_initialize(void (*on_hotplug)(void));
+
+/**
+ *  Open a hidraw device (e.g. "/dev/hidraw0") and start reading it
+ *  It returns 0 when the device could not be opened
+ */
+hidraw_epoll_handle_t hidraw_epoll_add(const char *path, const struct hidraw_epoll_callbacks *cb, void *ctx);
+
+/**
+ *  Start reading a file descriptor opened already, each read of it must return one report (e.g. a SOCK_SEQPACKET socket in tests)
+ *  fd is owned by the module (made non-blocking, and closed on fail or removal)
+ *  It returns 0 on fail
+ */
+hidraw_epoll_handle_t hidraw_epoll_add_fd(int fd, const struct hidraw_epoll_callbacks *cb, void *ctx);
+
+/**
+ *  Resume reading paused by can_read, it is safe to be called from any thread at any time
+ */
+void hidraw_epoll_resume(hidraw_epoll_handle_t h);
+
+/**
+ *  Stop reading and close the device
+ *  No callback of the handle is running or called after it returns (it must not be called from a callback)
+ */
+void hidraw_epoll_remove(hidraw_epoll_handle_t h);
+
+/**
+ *  Stop the epoll thread, all handles must be removed beforehand
+ */
+void hidraw_epoll_finalize(void);
+
+#endif //#ifndef _HIDRAW_EPOLL_H_
@@ -0,0 +1,29 @@
+/**
+ *  High Resolution Clock module
+ */
+
+#include "hr_clock.h"
+
+#ifdef _WIN32
+#include <windows.h>
+
+uint64_t hr_clock_get_us(void) {
+	static LARGE_INTEGER freq; // constant after boot, racing initialization writes same value
+	LARGE_INTEGER cnt;
+	if (freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&cnt);
+	// split to avoid overflow of cnt * 1000000
+	return (uint64_t)(cnt.QuadPart / freq.QuadPart) * 1000000 +
+		(uint64_t)(cnt.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+}
+
+#else //_WIN32
+#include <time.h>
+
+uint64_t hr_clock_get_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#endif //_WIN32
@@ -0,0 +1,17 @@
+/**
+ *  High Resolution Clock module
+ *  Monotonic time to measure latency; it is not related to wall-clock time
+ */
+
+#ifndef _HR_CLOCK_H_
+#define _HR_CLOCK_H_
+
+#include <stdint.h>
+
+/**
+ *  Returns current monotonic time in microseconds
+ *  It is safe to be called from any thread
+ */
+uint64_t hr_clock_get_us(void);
+
+#endif //#ifndef _HR_CLOCK_H_
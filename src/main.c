@@ -175,6 +175,7 @@ static void ev_handler(struct mg_connection *nc, int ev, void *ev_data) {
 		print_recv_mbuf(nc);
 		break;
 	case MG_EV_SEND		: /* Data has been written to a socket. int *num_bytes */
+		if (is_websocket(nc)) webhid_handle_sent(nc);
 		break;
 	case MG_EV_TIMER	: /* now >= conn->ev_timer_time. double * */
 		break;
@@ -184,7 +185,10 @@ static void ev_handler(struct mg_connection *nc, int ev, void *ev_data) {
 				webhid_disconnect(nc);
 				printf("[NOTIFY] Connection %08x was closed\n", nc);
 			}
+			printf("[NOTIFY] %u input report(s) dropped so far\n", webhid_get_numof_dropped());
 			printf("[NOTIFY] %d connection(s) is alive\n", webhid_get_numof_connection());
+		} else {
+			webhid_cancel_request(nc);
 		}
 		break;
 	case MG_EV_POLL		: /* Sent to each connection on each mg_mgr_poll() call */
@@ -221,7 +225,7 @@ int main(int argc, char *argv[]) {
 
   mg_mgr_init(&mgr, NULL);
 
-  webhid_initialize();
+  webhid_initialize(&mgr);
 
   /* Process command line options to customize HTTP server */
   for (i = 1; i < argc; i++) {
@@ -231,6 +235,8 @@ int main(int argc, char *argv[]) {
 	  s_http_server_opts.document_root = argv[++i];
 	} else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
 	  s_http_port = argv[++i];
+	} else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+	  webhid_set_capture_directory(argv[++i]);
 	} else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
 	  s_http_server_opts.auth_domain = argv[++i];
 #ifdef MG_ENABLE_JAVASCRIPT
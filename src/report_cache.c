@@ -0,0 +1,65 @@
+/**
+ *  Report Cache module
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "report_cache.h"
+
+struct report_entry {
+	size_t size; /// 0 when no report is stored
+	uint8_t data[1]; /// max_size of the cache
+};
+
+struct _report_cache {
+	size_t max_size;
+	struct report_entry *entries[256]; /// by report ID
+};
+
+report_cache_t report_cache_create(size_t max_size) {
+	report_cache_t c = (report_cache_t) calloc(1, sizeof(struct _report_cache));
+	if (c) c->max_size = max_size;
+	return c;
+}
+
+void report_cache_destroy(report_cache_t c) {
+	int i;
+	for (i = 0; i < 256; i++) free(c->entries[i]);
+	free(c);
+}
+
+const uint8_t *report_cache_get(const report_cache_t c, uint8_t report_id, size_t *size) {
+	const struct report_entry *e = c->entries[report_id];
+	if (!e || e->size == 0) return 0;
+	*size = e->size;
+	return e->data;
+}
+
+int report_cache_is_same(const report_cache_t c, const uint8_t *report, size_t size) {
+	const struct report_entry *e;
+	if (size == 0) return 0;
+	e = c->entries[report[0]];
+	return e && e->size == size && memcmp(e->data, report, size) == 0;
+}
+
+int report_cache_store(report_cache_t c, const uint8_t *report, size_t size) {
+	struct report_entry *e;
+	if (size == 0 || size > c->max_size) return 0;
+	e = c->entries[report[0]];
+	if (!e) {
+		e = (struct report_entry *) malloc(offsetof(struct report_entry, data) + c->max_size);
+		if (!e) return 0;
+		c->entries[report[0]] = e;
+	}
+	memcpy(e->data, report, size);
+	e->size = size;
+	return 1;
+}
+
+void report_cache_clear(report_cache_t c) {
+	int i;
+	for (i = 0; i < 256; i++) {
+		if (c->entries[i]) c->entries[i]->size = 0;
+	}
+}
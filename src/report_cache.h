@@ -0,0 +1,50 @@
+/**
+ *  Report Cache module
+ *  It keeps the last report of each report ID (the first byte of report),
+ *  to find reports unchanged from the previous one and to encode differences from it.
+ *  It is not thread-safe, each user (reading thread or connection) has its own cache
+ */
+
+#ifndef _REPORT_CACHE_H_
+#define _REPORT_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ *  Type of the cache is pointer to struct
+ */
+struct _report_cache;
+typedef struct _report_cache *report_cache_t;
+
+/**
+ *  Create a new cache, reports longer than max_size are not stored
+ *  Memory for a report ID is allocated when a report of it is stored first
+ */
+report_cache_t report_cache_create(size_t max_size);
+
+void report_cache_destroy(report_cache_t c);
+
+/**
+ *  Get the last report stored for a report ID
+ *  It returns 0 when no report of the ID is stored
+ */
+const uint8_t *report_cache_get(const report_cache_t c, uint8_t report_id, size_t *size);
+
+/**
+ *  Returns 1 when a report is identical to the last one of its report ID
+ */
+int report_cache_is_same(const report_cache_t c, const uint8_t *report, size_t size);
+
+/**
+ *  Store a report as the last one of its report ID
+ *  It returns 1 on success; 0 when the report is empty, too long or memory is short
+ */
+int report_cache_store(report_cache_t c, const uint8_t *report, size_t size);
+
+/**
+ *  Forget all reports stored
+ */
+void report_cache_clear(report_cache_t c);
+
+#endif //#ifndef _REPORT_CACHE_H_
@@ -2,17 +2,36 @@
  * Module to connect WebSocket with HIDAPI 
  */
 
+#include <stddef.h>
 #include <pthread.h>
 #include <hidapi.h>
 
 #include "webhid.h"
-#include "vl_queue.h"
+#include "atom.h"
+#include "hid_index.h"
+#include "hid_pool.h"
+#include "hid_desc.h"
+#include "hid_request.h"
+#include "capture_log.h"
+#include "report_cache.h"
+#include "ws_deflate.h"
+#include "hr_clock.h"
+#include "bc_ring.h"
 #include "bdl_list.h"
+#include "worker_pool.h"
+
+#if defined(__linux__) && !defined(WEBHID_DISABLE_HIDRAW_EPOLL)
+/// Input reports are read from /dev/hidraw* by one epoll thread instead of workers
+#define WEBHID_HIDRAW_EPOLL
+#include "hidraw_epoll.h"
+#endif
 
 #ifdef _WIN32
+/// Input reports are read by overlapped ReadFile, so workers wait for events of HID IFs instead of polling them
+#include "hid_overlapped.h"
 #define msleep(x)	Sleep(x)
 #else
-#define msleep(x)	usleep(((x)+500)/1000)
+#define msleep(x)	usleep((x)*1000)
 #endif
 
 #ifdef _DEBUG
@@ -84,45 +103,6 @@ static char * format_hid_info(char *buf, size_t size_buf, size_t count, const st
 }
 
 
-const struct hid_device_info *search_hid_info(const struct hid_device_info *root, struct mg_str *virtual_path)
-{
-	const struct hid_device_info *info = root;
-
-	while(info)
-	{
-		char str_test[32]; 
-		size_t len;
-		make_virtual_path(str_test, sizeof(str_test), info);
-		len = strlen(str_test);
-		if (len > virtual_path->len) {
-			/* generated path is longer than argument which would include extra words */
-			continue; 
-		}
-		else if (memcmp(virtual_path->p, str_test, len) == 0) { 
-			break; /* found! */
-		}
-
-		info = info->next;
-	}
-
-	return info;
-}
-
-static hid_device *open_hid_virtual_path(struct mg_str *virtual_path) {
-	struct hid_device_info * root_info;
-	const struct hid_device_info *info;
-	hid_device *dev;
-
-	root_info = hid_enumerate(0, 0); /* enumerate all devices */
-
-	info = search_hid_info(root_info, virtual_path);
-	dev = info? hid_open_path(info->path): 0;
-
-	hid_free_enumeration(root_info);
-	return dev;
-}
-
-
 void webhid_enumerate(struct mg_connection *nc, struct http_message *hm) {
 	char str_vid[16], str_pid[16];
 	uint16_t vid = 0, pid = 0;
@@ -159,21 +139,284 @@ void webhid_enumerate(struct mg_connection *nc, struct http_message *hm) {
 		info = info->next;
 	}
 	mg_printf_http_chunk(nc, "], \"count\": %d }", count); /* Close JSON Array */
+	if (vid == 0 && pid == 0) hid_index_refresh(root_info); /* all devices are enumerated, reuse them */
 	hid_free_enumeration(root_info);
 	mg_send_http_chunk(nc, "", 0);  /* Send empty chunk, the end of response */
 }
 
+/**
+ *  Send fields of input reports parsed from report descriptor
+ */
+static void send_descriptor_json(struct mg_connection *nc, const hid_desc_t desc)
+{
+	const char *sep = "";
+	int i;
+
+	mg_printf(nc, "%s", "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nTransfer-Encoding: chunked\r\n\r\n");
+	mg_printf_http_chunk(nc, "{\"usesReportId\": %s, \"inputFields\": [", hid_desc_uses_report_id(desc)? "true": "false");
+	for (i = 0; i < hid_desc_get_numof_fields(desc); i++) {
+		const struct hid_desc_field *f = hid_desc_get_field(desc, i);
+		mg_printf_http_chunk(nc, "%s{\"reportId\": %d, \"usagePage\": %d, \"usage\": %d, \"bitOffset\": %u, \"bitSize\": %d, "
+			"\"logicalMinimum\": %d, \"logicalMaximum\": %d, \"array\": %s, \"relative\": %s}",
+			sep, f->report_id, f->usage_page, f->usage, (unsigned) f->bit_offset, f->bit_size,
+			(int) f->logical_min, (int) f->logical_max,
+			(f->flags & HID_DESC_FIELD_ARRAY)? "true": "false", (f->flags & HID_DESC_FIELD_RELATIVE)? "true": "false");
+		sep = ", ";
+	}
+	mg_printf_http_chunk(nc, "] }");
+	mg_send_http_chunk(nc, "", 0);  /* Send empty chunk, the end of response */
+}
+
+/// REST requests of HID reports
+/// Reports are got or set on threads of hid_request module, not to stall mongoose thread while a HID answers;
+/// the response is sent when the wakeup channel tells the request completed.
+/// A connection holds its request running by user_data, so closing it lets the result be discarded.
+/// Output reports of WebSocket connections are set by requests as well, so the threads are bounded.
+/// Feature and output reports of REST and WebSocket share the pooled handle of a HID IF, and hid_request module
+/// runs requests to one handle one by one, so they never call HID API on it at once.
+/// The pooled handle is opened by the first request using it, so mongoose thread never waits for a HID being opened.
+/// Report descriptor is fetched by a request as well when it is asked first (by REST or "format=fields"), and kept by the pool.
+/// Input reports are read on a handle of their own (hidraw node on Linux, overlapped handle on Windows) where available
+
+/**
+ *  Time to wait an input report requested by REST
+ */
+#define WEBHID_REST_INPUT_TIMEOUT_MS	(1000)
+/**
+ *  Output reports waiting to be set to a handle at most
+ */
+#define WEBHID_OUTPUTS_PENDING_MAX	(16)
+
+struct hidsocket_connection;
+
+struct rest_request {
+	struct hid_request request; /// first, so a request taken back from hid_request module is cast into this
+	struct mg_connection *connection; /// 0 when the connection was closed before the request completed
+	struct hidsocket_connection *output_of; /// WebSocket connection sending the output report, 0 for REST or when it was closed
+	uint32_t seq; /// number of the output report on output_of, told by ack
+	int internal; /// boolean, made by the server (e.g. report descriptor for "format=fields"), not counted as REST request
+	hid_pool_entry_t entry; /// handle used by the request, 0 when it opens one of its own
+	bdl_list_node_t node;
+};
+
+static bdl_list_t rest_requests_list = 0; /// requests running (mongoose thread only)
+static uint64_t rest_num_completed = 0;
+static uint64_t rest_num_failed = 0;
+
+/**
+ *  Send an error response with message of the server, and one of HID API when it is given
+ */
+static void send_report_error(struct mg_connection *nc, const char *status, const char *msg_err, const wchar_t *wmsg_hid_err)
+{
+	mg_printf(nc, "HTTP/1.1 %s\r\nTransfer-Encoding: chunked\r\n\r\n", status);
+	if (msg_err) mg_send_http_chunk(nc, msg_err, strlen(msg_err));
+	if (wmsg_hid_err) {
+		size_t size_buf = 2 * wcslen(wmsg_hid_err) + 8;
+		char *buf = (char *)malloc(size_buf);
+		if (buf) {
+			_snprintf_s(buf, size_buf, size_buf/sizeof(char), "\r\n%S\r\n", wmsg_hid_err);
+			mg_send_http_chunk(nc, buf, strlen(buf));
+			free(buf);
+		}
+	}
+	mg_send_http_chunk(nc, "", 0);  /* Send empty chunk, the end of response */
+}
+
+static void forget_request_pvoid(void *req)
+{
+	struct rest_request *r = (struct rest_request *)req;
+	if (r->connection) r->connection->user_data = 0; // the request is freed by hid_request module
+}
+
+/**
+ *  Let output reports of a connection being closed be set without telling their results
+ */
+static void forget_outputs(struct hidsocket_connection *conn)
+{
+	bdl_list_node_t node = bdl_list_get_head(rest_requests_list);
+	while (node) {
+		struct rest_request *req = (struct rest_request *)bdl_list_extract_content(node);
+		if (req->output_of == conn) req->output_of = 0;
+		node = bdl_list_get_next(rest_requests_list, node);
+	}
+}
+
+/**
+ *  Count output reports waiting to be set to a handle, there are HID_REQUEST_QUEUE_MAX requests at most
+ */
+static int count_pending_outputs(hid_pool_entry_t entry)
+{
+	int num = 0;
+	bdl_list_node_t node = bdl_list_get_head(rest_requests_list);
+	while (node) {
+		struct rest_request *req = (struct rest_request *)bdl_list_extract_content(node);
+		if (req->entry == entry && req->request.kind == HID_REQUEST_SET_OUTPUT) num++;
+		node = bdl_list_get_next(rest_requests_list, node);
+	}
+	return num;
+}
+
+/**
+ *  Queue a request to be run with a handle (or 0 to open one of its own), the request takes the reference of entry
+ *  It returns 1 on success; 0 when too many requests (or output reports to the handle) are waiting
+ */
+static int submit_request(struct rest_request *req, hid_pool_entry_t entry)
+{
+	// REST and WebSocket outputs to a handle wait in one queue, in order of submission
+	if (req->request.kind == HID_REQUEST_SET_OUTPUT && entry &&
+		count_pending_outputs(entry) >= WEBHID_OUTPUTS_PENDING_MAX) return 0;
+	req->entry = entry;
+	req->node = bdl_list_append_node(rest_requests_list, req);
+	if (!req->node) return 0;
+	if (!hid_request_submit(&req->request)) {
+		bdl_list_delete_node(rest_requests_list, req->node);
+		return 0;
+	}
+	return 1;
+}
+
+static void complete_output(struct hidsocket_connection *conn, uint32_t seq, const struct hid_request *r);
+static void select_pending_fields(hid_pool_entry_t entry);
+
+/**
+ *  Queue a request fetching report descriptor of a handle, the request takes a reference of entry
+ *  The response is sent to nc when it is given
+ *  It returns the request; 0 when it could not be queued
+ */
+static struct rest_request *submit_descriptor_request(hid_pool_entry_t entry, struct mg_connection *nc)
+{
+	const char *path = hid_pool_get_path(entry);
+	struct rest_request *req;
+
+	if (strlen(path) >= sizeof(req->request.path)) return 0;
+	req = (struct rest_request *) malloc(sizeof(struct rest_request));
+	if (!req) return 0;
+	req->request.kind = HID_REQUEST_GET_DESCRIPTOR;
+	req->request.handle = 0;
+	strcpy(req->request.path, path);
+	req->request.timeout_ms = 0;
+	req->request.length = 0;
+	req->request.ctx = 0;
+	req->connection = nc;
+	req->output_of = 0;
+	req->seq = 0;
+	req->internal = (nc == 0);
+	hid_pool_retain(entry);
+	if (!submit_request(req, entry)) {
+		hid_pool_release(entry);
+		free(req);
+		return 0;
+	}
+	return req;
+}
+
+/**
+ *  Keep report descriptor fetched by a request in the pool, and answer the connection asking it
+ */
+static void complete_descriptor(struct rest_request *req)
+{
+	struct mg_connection *nc = req->connection;
+	hid_desc_t desc;
+
+	hid_pool_set_descriptor(req->entry, req->request.desc);
+	req->request.desc = 0;
+	desc = hid_pool_get_descriptor(req->entry);
+	if (nc) {
+		nc->user_data = 0;
+		if (desc) send_descriptor_json(nc, desc);
+		else send_report_error(nc, "500 Internal Server Error", "HID report descriptor is not available", 0);
+	}
+	select_pending_fields(req->entry);
+}
+
+/**
+ *  Send responses of requests completed, called on mongoose thread woken up by hid_request module
+ */
+static void complete_requests(void)
+{
+	struct hid_request *r;
+	while ((r = hid_request_poll()) != 0) {
+		struct rest_request *req = (struct rest_request *)r;
+		struct mg_connection *nc = req->connection;
+
+		bdl_list_delete_node(rest_requests_list, req->node);
+		if (r->kind == HID_REQUEST_GET_DESCRIPTOR) {
+			if (!req->internal) rest_num_completed++;
+			if (!req->internal && r->result <= 0) rest_num_failed++;
+			complete_descriptor(req);
+			hid_pool_release(req->entry);
+			free(req);
+			continue;
+		}
+		if (req->seq == 0) {
+			// output reports of WebSocket connections are counted by the connections
+			rest_num_completed++;
+			if (r->result <= 0) rest_num_failed++;
+		}
+
+		if (req->output_of) {
+			complete_output(req->output_of, req->seq, r);
+		} else if (nc) {
+			nc->user_data = 0;
+			if (r->result > 0) {
+				if (r->kind == HID_REQUEST_GET_FEATURE || r->kind == HID_REQUEST_GET_INPUT) {
+					/* Send headers */
+					mg_printf(nc, "%s", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
+					mg_send_http_chunk(nc, (char *)r->data, r->result);
+					mg_send_http_chunk(nc, "", 0);  /* Send empty chunk, the end of response */
+				} else {
+					/* Send status */
+					mg_printf(nc, "%s", "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n");
+				}
+			} else if (req->entry && !hid_pool_get_device(req->entry)) {
+				send_report_error(nc, "404 Not Found", "HID could not be opened", 0);
+			} else {
+				const char *msg_err =
+					(r->kind == HID_REQUEST_GET_FEATURE)? "Fail to get HID feature report":
+					(r->kind == HID_REQUEST_SET_FEATURE)? "Fail to set HID feature report":
+					(r->kind == HID_REQUEST_GET_INPUT)? "Fail to read HID input report":
+					"Fail to send HID output report";
+				send_report_error(nc, "500 Internal Server Error", msg_err, r->error[0]? r->error: 0);
+			}
+		}
+
+		if (r->gone) {
+			/* the HID could not be opened again, so it is unplugged (or replaced) rather than refusing the report */
+			hid_index_invalidate();
+			if (req->entry) hid_pool_discard(req->entry); /* a handle being read is torn down by its reader */
+		}
+		if (req->entry) hid_pool_release(req->entry);
+		free(req);
+	}
+}
+
+/**
+ *  Refuse a request pipelined after a HID request still running, by closing the connection
+ *  Responses must be in order of requests, which is not kept while one is running,
+ *  and user_data holding the running one must not be taken by another
+ *  It returns 1 when the request is refused
+ */
+static int refuse_pipelined(struct mg_connection *nc)
+{
+	if (!nc->user_data) return 0;
+	WEBHID_TRACE("a HID request of the connection is running");
+	nc->flags |= MG_F_CLOSE_IMMEDIATELY; // the request running is cancelled on closing
+	return 1;
+}
+
 void webhid_request_report(struct mg_connection *nc, struct http_message *hm) {
-	hid_device *dev;
+	struct hid_index_key key;
+	hid_pool_entry_t entry = 0;
+	struct rest_request *req = 0;
 	int is_set_request, is_get_request;
-	int is_feature, is_input, is_output;
-	uint8_t data[256];
-	int returned_size = 0;
+	int is_feature, is_input, is_output, is_descriptor;
 	const char *msg_err = 0;
-	const wchar_t *wmsg_hid_err = 0;
 
-	dev = open_hid_virtual_path(&hm->uri);
-	if (dev == 0) {
+	if (refuse_pipelined(nc)) return;
+	if (hid_index_parse_virtual_path(hm->uri.p, hm->uri.len, &key)) {
+		entry = hid_pool_acquire(&key); /* the HID is opened by the request, not to wait for it here */
+	}
+	if (entry == 0) {
 		WEBHID_TRACE("No HID was found");
 		msg_err = "HID virtual-path is incorrect";
 		goto HID_FEATURE_ERROR_404;
@@ -186,134 +429,162 @@ void webhid_request_report(struct mg_connection *nc, struct http_message *hm) {
 	is_feature = (memcmp(hm->uri.p+HID_VIRTUAL_PATH_LENGTH, "feature/", 8) == 0 && (is_get_request || is_set_request));
 	is_input = (!is_feature && memcmp(hm->uri.p+HID_VIRTUAL_PATH_LENGTH, "input/", 6) == 0 && is_get_request);
 	is_output = (!is_feature && !is_input && memcmp(hm->uri.p+HID_VIRTUAL_PATH_LENGTH, "output/", 7) == 0 && is_set_request);
+	is_descriptor = (!is_feature && !is_input && !is_output && memcmp(hm->uri.p+HID_VIRTUAL_PATH_LENGTH, "descriptor", 10) == 0 && is_get_request);
+
+	if (is_descriptor) {
+		WEBHID_TRACE("Get Report Descriptor");
+		if (hid_pool_is_descriptor_fetched(entry)) {
+			/* kept by the pool, it does not wait HID */
+			hid_desc_t desc = hid_pool_get_descriptor(entry);
+			if (!desc) {
+				msg_err = "HID report descriptor is not available";
+				goto HID_FEATURE_ERROR_500;
+			}
+			send_descriptor_json(nc, desc);
+		} else {
+			/* read on a thread of hid_request module, the response is sent by complete_requests */
+			req = submit_descriptor_request(entry, nc);
+			if (!req) {
+				send_report_error(nc, "503 Service Unavailable", "Too many HID requests are running", 0);
+			} else {
+				nc->user_data = req;
+			}
+		}
+		hid_pool_release(entry);
+		return;
+	}
+	if (!is_feature && !is_input && !is_output) {
+		msg_err = "HID request type is invalid";
+		goto HID_FEATURE_ERROR_404;
+	}
+
+	req = (struct rest_request *) malloc(sizeof(struct rest_request));
+	if (!req) {
+		msg_err = "Fail to queue HID request";
+		goto HID_FEATURE_ERROR_500;
+	}
+	req->request.handle = entry;
+	strncpy(req->request.path, hid_pool_get_path(entry), sizeof(req->request.path) - 1); /* probed when the request fails */
+	req->request.path[sizeof(req->request.path) - 1] = '\0';
+	req->request.timeout_ms = 0;
+	req->request.ctx = 0;
+	req->output_of = 0;
+	req->seq = 0;
+	req->internal = 0;
 
 	if (is_feature) {
 		/* Read Report ID from the tail of URI */
 		uint8_t rid = (uint8_t) strtol(hm->uri.p+HID_VIRTUAL_PATH_LENGTH+8, NULL, 0); 
 
+		req->request.data[0] = rid;	/** if conflict between data and URI ?? */
+		req->request.length = sizeof(req->request.data);
 		if (is_get_request) { 
 			WEBHID_TRACE("Get Feature Report");
-			data[0] = rid; 
-			returned_size = hid_get_feature_report(dev, (uint8_t *)data, sizeof(data));
-			if (returned_size <= 0) {
-				msg_err = "Fail to get HID feature report";
-				wmsg_hid_err = hid_error(dev);
-				goto HID_FEATURE_ERROR_500;
-			}
-
-			/* Send headers */
-			mg_printf(nc, "%s", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
-			mg_send_http_chunk(nc, (char *)data, returned_size);
-			mg_send_http_chunk(nc, "", 0);  /* Send empty chunk, the end of response */
-
-		} else if (is_set_request) { 
+			req->request.kind = HID_REQUEST_GET_FEATURE;
+		} else { 
 			WEBHID_TRACE("Set Feature Report");
-			data[0] = rid;	/** if conflict between data and URI ?? */
-			if (hm->body.len > 256) {
+			if (hm->body.len > sizeof(req->request.data)) {
 				WEBHID_TRACE("too long feature report");
 				msg_err = "HID feature report is too long to read";
-				wmsg_hid_err = hid_error(dev);
 				goto HID_FEATURE_ERROR_500;
 			}
 			else if (hm->body.len < 1) {
 				WEBHID_TRACE("feature report does not have body");
 				msg_err = "HID feature report has no body but report ID";
-				wmsg_hid_err = hid_error(dev);
-				goto HID_FEATURE_ERROR_500;
-			}
-			memcpy(data+1, hm->body.p+1, hm->body.len-1);
-			/* Set(update) Feature Report*/
-			returned_size = hid_send_feature_report(dev, (const uint8_t *)data, sizeof(data));
-			if (returned_size <= 0) {
-				msg_err = "Fail to set HID feature report";
-				wmsg_hid_err = hid_error(dev);
 				goto HID_FEATURE_ERROR_500;
 			}
-
-			/* Send status */
-			mg_printf(nc, "%s", "HTTP/1.1 200 OK\r\n");
-		}
-		else {
-			msg_err = "Other HTTP method is not supprted than POST, PUT and GET";
-			goto HID_FEATURE_ERROR_404;
+			memset(req->request.data+1, 0, sizeof(req->request.data)-1);
+			memcpy(req->request.data+1, hm->body.p+1, hm->body.len-1);
+			req->request.kind = HID_REQUEST_SET_FEATURE;
 		}
 	}
 	else if (is_input) {
+		/* 
+		 * Read on a handle of its own, since the pooled one may start to be read by a WebSocket connection
+		 * while the request waits an input report
+		 */
+		const char *path = hid_pool_get_path(entry);
 		WEBHID_TRACE("Get Input Report");
-		returned_size = hid_read_timeout(dev, (uint8_t *)data, sizeof(data), 1000);
-		if (returned_size <= 0) {
-			msg_err = "Fail to read HID input report";
-			wmsg_hid_err = hid_error(dev);
-			goto HID_FEATURE_ERROR_500;
+		if (strlen(path) >= sizeof(req->request.path)) {
+			msg_err = "HID virtual-path is incorrect";
+			goto HID_FEATURE_ERROR_404;
 		}
-
-		/* Send headers */
-		mg_printf(nc, "%s", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
-		mg_send_http_chunk(nc, (char *)data, returned_size);
-		mg_send_http_chunk(nc, "", 0);  /* Send empty chunk, the end of response */
+		strcpy(req->request.path, path);
+		req->request.handle = 0;
+		req->request.kind = HID_REQUEST_GET_INPUT;
+		req->request.timeout_ms = WEBHID_REST_INPUT_TIMEOUT_MS;
+		req->request.length = sizeof(req->request.data);
+		hid_pool_release(entry);
+		entry = 0;
 	}
-	else if (is_output) {
+	else {
 		uint8_t rid = (uint8_t) strtol(hm->uri.p+HID_VIRTUAL_PATH_LENGTH+7, NULL, 0);
 		WEBHID_TRACE("Set Output Report");
 
-		data[0] = (rid && rid == hm->body.p[0])? rid: hm->body.p[0];
-		if (hm->body.len > 255) goto HID_FEATURE_ERROR_500;
-		memcpy(data+1, hm->body.p+1, hm->body.len-1);
-		/* Set(update) Feature Report*/
-		returned_size = hid_write(dev, (const uint8_t *)data, hm->body.len);
-		if (returned_size <= 0) {
-			msg_err = "Fail to send HID output report";
-			wmsg_hid_err = hid_error(dev);
+		if (hm->body.len < 1 || hm->body.len > 255) {
+			msg_err = "HID output report is empty or too long";
 			goto HID_FEATURE_ERROR_500;
 		}
-		/* Send status */
-		mg_printf(nc, "%s", "HTTP/1.1 200 OK\r\n");
-	}
-	else {
-		msg_err = "HID request type is invalid";
-		goto HID_FEATURE_ERROR_404;
+		req->request.data[0] = (rid && rid == hm->body.p[0])? rid: hm->body.p[0];
+		memcpy(req->request.data+1, hm->body.p+1, hm->body.len-1);
+		req->request.kind = HID_REQUEST_SET_OUTPUT;
+		req->request.length = hm->body.len;
 	}
 
-	if (dev) hid_close(dev);
+	req->connection = nc;
+	if (!submit_request(req, entry)) {
+		WEBHID_TRACE("too many HID requests are running");
+		free(req);
+		send_report_error(nc, "503 Service Unavailable", "Too many HID requests are running", 0);
+		if (entry) hid_pool_release(entry);
+		return;
+	}
+	nc->user_data = req; /* the response is sent by complete_requests */
 	return;
 
 HID_FEATURE_ERROR_404:
-	//mg_printf(nc, "%s", "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
-	mg_printf(nc, "%s", "HTTP/1.1 404 Not Found\r\nTransfer-Encoding: chunked\r\n\r\n");
-	if (msg_err) mg_send_http_chunk(nc, msg_err, strlen(msg_err));
-	mg_send_http_chunk(nc, "", 0);  /* Send empty chunk, the end of response */
-	if (dev) hid_close(dev);
+	send_report_error(nc, "404 Not Found", msg_err, 0);
+	free(req);
+	if (entry) hid_pool_release(entry);
 	return;
 
 HID_FEATURE_ERROR_500:
-	//mg_printf(nc, "%s", "HTTP/1.1 500 Internal Server Error\r\n");
-	mg_printf(nc, "%s", "HTTP/1.1 500 Internal Server Error\r\nTransfer-Encoding: chunked\r\n\r\n");
-	if (msg_err) mg_send_http_chunk(nc, msg_err, strlen(msg_err));
-	if (wmsg_hid_err) {
-		size_t size_buf = 2 * wcslen(wmsg_hid_err);
-		char *buf = (char *)malloc(size_buf);
-		_snprintf_s(buf, size_buf, size_buf/sizeof(char), "\r\n%S\r\n", wmsg_hid_err);
-		mg_send_http_chunk(nc, buf, strlen(buf));
-		free(buf);
-	}
-	mg_send_http_chunk(nc, "", 0);  /* Send empty chunk, the end of response */
-	if (dev) hid_close(dev);
+	send_report_error(nc, "500 Internal Server Error", msg_err, 0);
+	free(req);
+	if (entry) hid_pool_release(entry);
 	return;
 
 }
 
+void webhid_cancel_request(struct mg_connection *nc) {
+	struct rest_request *req = (struct rest_request *) nc->user_data;
+	if (req) {
+		req->connection = 0; /* it keeps running, and is freed on completion */
+		nc->user_data = 0;
+	}
+}
+
 int webhid_handle_request(struct mg_connection *nc, struct http_message *hm)
 {
+	if (refuse_pipelined(nc)) return 1; // not to be served as static content either
 	if (memcmp(hm->uri.p, "/hid/", 5) == 0) {
 		WEBHID_TRACE("Requested URI includes '/hid/'");
 		if (uri_is_virtual_path(hm->uri.p)) {
 			WEBHID_TRACE("Requested URI is matched to HID virtual-path");
-			webhid_request_report(nc, hm);
+			if (hm->uri.len >= HID_VIRTUAL_PATH_LENGTH + 7 && memcmp(hm->uri.p+HID_VIRTUAL_PATH_LENGTH, "capture", 7) == 0) {
+				webhid_capture(nc, hm); /* files are read without HID */
+			} else {
+				webhid_request_report(nc, hm);
+			}
 		}
 		else if(memcmp(hm->uri.p+4, "/enumerate", 9) == 0) {
 			WEBHID_TRACE("Requested URI means HID enumeration");
 			webhid_enumerate(nc, hm);
 		}
+		else if(mg_vcmp(&hm->uri, "/hid/stats") == 0) {
+			WEBHID_TRACE("Requested URI means statistics");
+			webhid_stats(nc, hm);
+		}
 		else {
 			WEBHID_TRACE("URI was invalid to request HID");
 			mg_printf(nc, "%s", "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
@@ -327,167 +598,1652 @@ int webhid_handle_request(struct mg_connection *nc, struct http_message *hm)
 /// WebSocket APIs
 //////////////////////////////////////////////////////////////////////////
 
-/// Connection between WebSocket connection and HID IF handle
-/// It manages thread to read input reports and FIFO to hold them
+/// HID IF shared by WebSocket connections
+/// A worker of the pool (one per core) reads input reports of the HID IF with others,
+/// and broadcasts them through a lock-free ring.
+/// Every connection subscribing the HID IF has its own cursor on the ring,
+/// so all of them see every report while the HID IF is read only once
 
-struct hidsocket_connection {
-	struct mg_connection *connection;
-	hid_device *device;
+/**
+ *  Number of input reports the ring can hold (power of 2)
+ */
+#define HIDSOCKET_INPUT_RING_SLOTS	(256)
+/**
+ *  Maximum size of an input report
+ */
+#define HIDSOCKET_INPUT_SLOT_SIZE	(256)
+/**
+ *  Each report in the ring is preceded by monotonic time when hid_read returned it
+ */
+#define HIDSOCKET_RECORD_HEADER_SIZE	(sizeof(uint64_t))
+/**
+ *  Reports read at most in a service of HID IF, not to keep other HID IFs of the worker waiting
+ */
+#define HIDSOCKET_READ_BURST	(32)
+/**
+ *  Upper bound of the interval checking a HID IF blocked by a full queue again, doubled from 1 ms while it stays blocked
+ *  The worker is woken as soon as the queue is drained, so checking again is only a fallback
+ */
+#define HIDSOCKET_BLOCKED_RETRY_MAX_MS	(50)
+/**
+ *  Upper limit of latency budget to coalesce input reports in push mode
+ */
+#define HIDSOCKET_PUSH_LATENCY_MAX_MS	(1000)
+/**
+ *  WebSocket header reserved in send buffer ahead of input reports (2 bytes and 16 bits length)
+ */
+#define HIDSOCKET_FRAME_HEADER_MAX	(4)
+/**
+ *  Payload of an input frame is limited to this so that its length fits in 16 bits,
+ *  reports beyond it are sent in the next frame
+ */
+#define HIDSOCKET_FRAME_PAYLOAD_MAX	(65535)
+/**
+ *  Input reports are held in the ring instead of send buffer while this size of data is not sent yet,
+ *  so a slow client is handled by its overflow policy instead of growing send buffer without bound
+ */
+#define HIDSOCKET_SEND_BACKLOG_MAX	(64 * 1024)
+
+/**
+ *  Frames with payload smaller than this are sent uncompressed by default even if permessage-deflate is accepted,
+ *  since compressing them saves few bytes at the cost of latency
+ */
+#define HIDSOCKET_DEFLATE_THRESHOLD	(256)
+/**
+ *  Largest message from client decompressed, far more than output reports and options need
+ */
+#define HIDSOCKET_INFLATE_MAX	(4096)
+
+/// Overflow policies applied when more reports than queue size are pending for a connection
+/// Reports lapped by the ring (HIDSOCKET_INPUT_RING_SLOTS) are lost by any policy but "block"
+#define HIDSOCKET_OVERFLOW_DROP_OLDEST	(0) /// "overflow=drop-oldest" (default)
+#define HIDSOCKET_OVERFLOW_DROP_NEWEST	(1) /// "overflow=drop-newest": reports arriving on full queue are dropped
+#define HIDSOCKET_OVERFLOW_BLOCK		(2) /// "overflow=block": HID IF is not read until the connection reads
+#define HIDSOCKET_OVERFLOW_KEEP_LATEST	(3) /// "overflow=keep-latest": only the latest report of each report ID is kept
+
+/// Formats of binary frame carrying input reports
+/// "format=legacy" (default): each report is preceded by uint32_t length, a bare zero length for no report
+/// "format=batch": versioned batch header followed by reports with sequence number and timestamp
+/// "format=fields": batch header followed by values of fields decoded by report descriptor of the HID IF
+/// "format=delta": batch header followed by reports encoded as differences from the previous ones
+#define HIDSOCKET_FORMAT_LEGACY	(0)
+#define HIDSOCKET_FORMAT_BATCH	(1)
+#define HIDSOCKET_FORMAT_FIELDS	(2)
+#define HIDSOCKET_FORMAT_DELTA	(3)
+
+/// Aggregation of reports of a report ID into one while frames are limited by "hz="
+/// "aggregate=latest" (default): the latest report is sent
+/// "aggregate=sum": the latest report is sent with relative fields (e.g. movement of mouse) summed over reports aggregated
+/// "aggregate=envelope": minimum and maximum of each field over reports aggregated are sent (fields format only)
+#define HIDSOCKET_AGGREGATE_LATEST	(0)
+#define HIDSOCKET_AGGREGATE_SUM		(1)
+#define HIDSOCKET_AGGREGATE_ENVELOPE	(2)
+/**
+ *  Upper limit of "hz="
+ */
+#define HIDSOCKET_RATE_MAX_HZ	(1000)
+
+/// Batch frame (all fields are little-endian)
+/// sequence is counted per HID IF, timestamps are monotonic clock of server in microseconds
+#define HIDSOCKET_BATCH_VERSION	(1)
+struct hidsocket_batch_header {
+	uint8_t version; /// HIDSOCKET_BATCH_VERSION
+	uint8_t header_size; /// sizeof(struct hidsocket_batch_header), to skip fields added in future
+	uint16_t count; /// number of reports following
+	uint32_t dropped; /// reports lost since previous frame
+	uint64_t sent_us; /// when the frame was made
+};
+struct hidsocket_batch_report {
+	uint32_t sequence;
+	uint32_t length; /// of the report following
+	uint64_t timestamp_us; /// when hid_read returned the report
+};
+/// Report of fields frame, followed by int32_t values of fields selected in order of report descriptor
+/// A value is 0 when the report is too short for its field, reports without fields selected are not sent
+/// "aggregate=envelope" sends a pair of reports carrying minimum and maximum values instead of one
+#define HIDSOCKET_FIELDS_VALUE	(0)
+#define HIDSOCKET_FIELDS_MIN	(1)
+#define HIDSOCKET_FIELDS_MAX	(2)
+struct hidsocket_fields_report {
+	uint32_t sequence;
 	uint8_t report_id;
-	vl_queue_t queue_input;
-	pthread_t th;
-	pthread_mutex_t mtx;
-	int requested_disconnect; /// boolean
+	uint8_t kind; /// HIDSOCKET_FIELDS_*
+	uint16_t count; /// number of values following
+	uint64_t timestamp_us;
 };
 
-static bdl_list_t hidsocket_connections_list = 0;
+/// Report of delta frame, followed by length bytes of data
+/// A key report carries the report itself. A delta report carries runs of [uint8 skip][uint8 count][count bytes]
+/// against the previous report sent with the same report ID (the first byte): skip bytes are unchanged,
+/// and count bytes following are XORed with the previous ones. Bytes after the last run are unchanged
+#define HIDSOCKET_DELTA_KEY	(0)
+#define HIDSOCKET_DELTA_XOR	(1)
+struct hidsocket_delta_report {
+	uint32_t sequence;
+	uint8_t report_id;
+	uint8_t kind; /// HIDSOCKET_DELTA_*
+	uint16_t length; /// of data following
+	uint64_t timestamp_us;
+};
 
-void webhid_initialize(void) {
-	WEBHID_TRACE("webhid_initialize() called");
-	hidsocket_connections_list = bdl_list_create();
-}
+/**
+ *  Every this number of reports of a report ID is sent as a key report in delta format by default
+ */
+#define HIDSOCKET_DELTA_KEYFRAME_DEFAULT	(64)
+/**
+ *  Usages given by "usages=" at most
+ */
+#define HIDSOCKET_USAGES_MAX	(32)
 
-int webhid_get_numof_connection(void) {
-	return bdl_list_get_size(hidsocket_connections_list);
-}
+/// Set of report IDs (the first byte of report) as a bit mask of 256 bits
+#define HIDSOCKET_REPORT_ID_WORDS	(256 / 32)
+#define HIDSOCKET_HAS_REPORT_ID(mask, id)	(((mask)[(id) >> 5] >> ((id) & 31)) & 1)
+/**
+ *  Length of list of report IDs parsed at most, e.g. "1,3,8-10"
+ */
+#define HIDSOCKET_REPORT_IDS_MAX_LENGTH	(256)
+
+/// Options given by query string of handshake request (or first text frame)
+/// e.g. "/hid/0001/0123/abcd/0001/0002/?mode=push&latency=2&batch=16&format=batch"
+struct hidsocket_options {
+	int push; /// boolean, "mode=push": server sends input reports without being polled
+	int wait; /// boolean, "mode=wait": a poll finding no report is answered when one arrives instead of by an empty frame
+	int latency_ms; /// "latency=": reports are coalesced into one frame for this period at most
+	int batch; /// "batch=": frame is sent at once when this number of reports are coalesced
+	int format; /// "format=": HIDSOCKET_FORMAT_*
+	uint32_t queue_size; /// "queue=": reports held for the connection at most (1 to HIDSOCKET_INPUT_RING_SLOTS)
+	int overflow; /// "overflow=": HIDSOCKET_OVERFLOW_*
+	uint32_t usages[HIDSOCKET_USAGES_MAX]; /// "usages=0001:0030,0009": fields sent in fields format, usage page in upper 16 bits
+	int num_usages; /// 0 for all fields; usage of 0 matches all usages of the page
+	int changes_only; /// boolean, "changes=only": reports identical to the previous one of the same report ID are not sent
+	int keyframe; /// "keyframe=": every this number of reports of a report ID is sent whole in delta format
+	int deflate_threshold; /// "deflate=": frames smaller than this are sent uncompressed, -1 ("off") not to accept permessage-deflate
+	uint32_t report_ids[HIDSOCKET_REPORT_ID_WORDS]; /// "reports=1,3,8-10" (or tail of URI): report IDs sent, all of them by default
+	int hz; /// "hz=": frames are pushed at this rate at most, and reports between them are aggregated; 0 for no limit
+	int aggregate; /// "aggregate=": HIDSOCKET_AGGREGATE_*
+	int ack; /// boolean, "ack=on": result of each output report written is told by a text frame
+};
 
-static bdl_list_node_t search_connection_node(struct mg_connection *nc) {
-	bdl_list_node_t node = bdl_list_get_head(hidsocket_connections_list);
+/// Fields of input reports sent to a connection in fields format, indexed by report ID
+struct hidsocket_field_selection {
+	uint16_t first[256];
+	uint16_t count[256];
+	const struct hid_desc_field **fields; /// owned by report descriptor held by the pool
+	int uses_report_id; /// boolean
+	int32_t *values; /// 2 per field while aggregating: sum (or minimum) and maximum over reports aggregated
+	uint32_t aggregated[HIDSOCKET_REPORT_ID_WORDS]; /// report IDs whose values are accumulated
+};
+
+/// Reports sent to a connection, for "changes=only" and delta format
+struct hidsocket_history {
+	report_cache_t sent; /// the last report sent of each report ID
+	uint16_t since_key[256]; /// delta reports sent since the last key report, by report ID
+};
+
+/// Counters of a HID IF, written only by its reading thread and read by mongoose thread without lock
+/// (a value read on 32-bit build may be torn, which is tolerated for monitoring)
+struct hidsocket_device_stats {
+	uint64_t reports_read;
+	uint64_t bytes_read;
+	uint64_t read_errors; /// failed hid_read calls
+	uint64_t loop_iterations;
+	uint64_t blocked_loops; /// iterations waiting for a subscriber with block policy
+	uint64_t reports_unchanged; /// reports not stored since every subscriber asks changes only
+	uint64_t reports_unsubscribed; /// reports not stored since no subscriber asks their report ID
+};
+
+/// Counters of a connection, used only on mongoose thread
+struct hidsocket_connection_stats {
+	uint64_t reports_sent;
+	uint64_t bytes_sent;
+	uint64_t frames_sent;
+	uint64_t queue_depth; /// reports pending now, filled on taking a snapshot
+	uint64_t queue_high_water; /// most reports pending at once
+	uint64_t dropped;
+	uint64_t unchanged; /// reports not sent by "changes=only"
+	uint64_t aggregated; /// reports folded into later ones by "hz="
+	uint64_t deflate_saved; /// bytes of frames saved by permessage-deflate
+	uint64_t output_writes;
+	uint64_t output_errors; /// failed hid_write calls, and reports not queued
+};
+
+struct hidsocket_device {
+	hid_pool_entry_t entry;
+	hid_device *device; /// pooled handle read by the worker when neither hidraw nor overlapped handle is, opened by the worker
+	bc_ring_t ring_input;
+	worker_pool_task_t task; /// reading on a worker
+	int stopping; /// boolean, task is being removed, the device is finished when its worker leaves it
+	atom_t stopped; /// boolean, set by the worker having left the device
+#ifdef _WIN32
+	hid_overlapped_t overlapped; /// handle of its own read by the worker, or 0 to read the pooled one by HID API
+#endif
+	int num_batched; /// reports pushed but not notified yet (reading side only)
+	uint64_t deadline_us; /// when batched reports must be notified (reading side only)
+	int blocked_retry_ms; /// interval checking again while blocked, 0 when not blocked (reading side only)
+	atom_t paused; /// boolean, set by the worker leaving reports unread while blocked, cleared by mongoose thread waking it
+#ifdef WEBHID_HIDRAW_EPOLL
+	hidraw_epoll_handle_t raw; /// read on epoll thread instead of a worker when it is set
+#endif
+	atom_t input_pending; /// boolean, set by reading thread and cleared by mongoose thread
+	atom_t latency_ms; /// latency budget to coalesce reports, the tightest one among subscribers
+	atom_t batch; /// number of reports to be coalesced at most, the smallest one among subscribers
+	atom_t blocked; /// boolean, a subscriber with block policy exists
+	atom_t input_limit; /// reading stops when head of ring reaches it while blocked
+	atom_t changes_only; /// boolean, every subscriber asks changes only, so unchanged reports are not stored
+	atom_t input_cache_reset; /// boolean, set by mongoose thread to let reading thread forget reports of input_cache
+	report_cache_t input_cache; /// the last report read of each report ID (reading side only)
+	atom_t report_ids[HIDSOCKET_REPORT_ID_WORDS]; /// report IDs asked by any subscriber, others are not stored
+	bdl_list_t subscribers; /// connections reading this HID IF
+	int fetching_descriptor; /// boolean, report descriptor is being fetched for subscribers of "format=fields"
+	atom_ptr_t capture; /// capture_log_t recording every report read, the HID IF is read even without subscribers while it is set
+	atom_t capture_epoch; /// odd while reading thread appends a report, so a log replaced is destroyed after it (see stop_capture)
+	bdl_list_node_t node;
+	uint8_t pad[ATOM_CACHE_LINE_SIZE]; /// stats below are written frequently by reading thread
+	struct hidsocket_device_stats stats;
+};
+
+struct hidsocket_connection {
+	uint32_t id; /// serial number to label connection in stats
+	struct mg_connection *connection;
+	struct hidsocket_device *device;
+	uint32_t cursor; /// sequence number of the next report to be sent
+	uint32_t num_dropped; /// reports lost by the overflow policy or lapped by the ring
+	uint32_t num_dropped_sent; /// num_dropped already told to client
+	int waiting_input; /// boolean, client polled with "mode=wait" while no report was held
+	uint32_t num_outputs; /// output reports received, to number acks
+	uint64_t next_frame_us; /// frame is not pushed before this while "hz=" is given
+	int deferred; /// boolean, reports are pushed by timer of wakeup connection when the next frame is allowed
+	struct hidsocket_options options;
+	struct hidsocket_field_selection *selection; /// for fields format
+	struct hidsocket_history *history; /// for "changes=only" and delta format
+	ws_deflate_t deflate; /// compression context kept across frames while permessage-deflate is accepted
+	struct hidsocket_connection_stats stats;
+	bdl_list_node_t node; /// to be removed from list without searching
+	bdl_list_node_t node_subscriber; /// in subscribers of the device
+};
+
+static bdl_list_t hidsocket_connections_list = 0;
+static bdl_list_t hidsocket_devices_list = 0;
+static bdl_list_t hidsocket_captures_list = 0; /// captures of HID IFs, including stopped ones
+static uint32_t hidsocket_num_dropped = 0; /// reports dropped over all connections, including closed ones
+static uint32_t hidsocket_last_id = 0;
+
+/// Wakeup channel
+/// Reading threads wake mongoose thread up through a socket pair when they push input reports,
+/// so reports are forwarded at once instead of on the next poll of mongoose
+/// (mg_broadcast is not used since it waits for mongoose thread, which may be joining the reader)
+
+static sock_t wakeup_socks[2] = { INVALID_SOCKET, INVALID_SOCKET };
+static struct mg_connection *wakeup_connection = 0; /// its timer also pushes frames deferred by "hz="
+static double wakeup_housekeeping_time = 0;
+static uint8_t *hidsocket_deflate_buf = 0; /// frame compressed before being put back into send buffer (mongoose thread only)
+static size_t hidsocket_deflate_buf_size = 0;
+static atom_t wakeup_armed = 0; /// boolean, a byte is on the way to mongoose thread
+static atom_t rest_completed = 0; /// boolean, set when a REST request completes
+static atom_t devices_stopped = 0; /// boolean, set when a worker leaves a device being stopped
+
+static int send_input_frame(struct hidsocket_connection *conn, int send_empty);
+static int push_input(struct hidsocket_connection *conn);
+static void finish_stopped_devices(void);
+static void restart_devices(void);
+static void release_retired_captures(const struct hidsocket_device *hd);
 
+/**
+ *  Push reports of connections whose frames were deferred by "hz=",
+ *  ones whose next frame is not allowed yet are deferred again
+ */
+static void push_deferred(void) {
+	bdl_list_node_t node = bdl_list_get_head(hidsocket_connections_list);
 	while (node) {
-		struct hidsocket_connection *hs_conn = 
+		struct hidsocket_connection *conn =
 			(struct hidsocket_connection *)bdl_list_extract_content(node);
-		if (hs_conn->connection == nc){
-			return node;
-		}
 		node = bdl_list_get_next(hidsocket_connections_list, node);
+		if (conn->deferred) {
+			conn->deferred = 0;
+			push_input(conn);
+		}
 	}
+}
 
-	return 0;
+static void wakeup_send(void) {
+	if (atom_exchange(&wakeup_armed, 1) == 0) send(wakeup_socks[1], "", 1, 0);
 }
 
-static struct hidsocket_connection * search_connection(struct mg_connection *nc) {
-	bdl_list_node_t node = search_connection_node(nc);
-	return (struct hidsocket_connection *) (node? bdl_list_extract_content(node): 0);
+static void wakeup_event_loop(struct hidsocket_device *hd) {
+	if (atom_exchange(&hd->input_pending, 1) == 0) wakeup_send();
+}
+
+/**
+ *  Called on a thread of hid_request module to get the pooled handle of a request, it is opened there on first use
+ */
+static hid_device *open_pooled_handle(void *handle) {
+	return hid_pool_open((hid_pool_entry_t) handle);
 }
 
-static void *proc_reading_hid (void *param) {
-	struct hidsocket_connection *conn = (struct hidsocket_connection *)param;
+/**
+ *  Called on a thread of hid_request module, responses are completed by mongoose thread woken up as for input reports
+ */
+static void on_request_completed(void) {
+	if (atom_exchange(&rest_completed, 1) == 0) wakeup_send();
+}
 
-	while(conn->requested_disconnect == 0) {
-		if (pthread_mutex_trylock(&conn->mtx) == 0) { // != EBUSY
-			uint8_t data[256];
-			int len = hid_read_timeout(conn->device, data+sizeof(uint32_t), sizeof(data)-sizeof(uint32_t), 0);
-			if (len > 0 && (conn->report_id == 0 || conn->report_id == data[0]))
-			{
-				*(uint32_t *)data = len;
-				vl_queue_push(conn->queue_input, data, len+sizeof(uint32_t));
-			}
-			pthread_mutex_unlock(&conn->mtx);
-			msleep(1);// 1ms sleep
+/**
+ *  Interval of housekeeping (e.g. closing idle HID handles) on the wakeup connection's timer
+ */
+#define WEBHID_HOUSEKEEPING_INTERVAL_SEC	(1.0)
+
+static void wakeup_handler(struct mg_connection *nc, int ev, void *ev_data) {
+	bdl_list_node_t node;
+	(void) ev_data;
+
+	if (ev == MG_EV_TIMER) {
+		double now = mg_time();
+		if (now >= wakeup_housekeeping_time) {
+			hid_pool_evict_idle();
+			worker_pool_rebalance();
+			restart_devices();
+			release_retired_captures(0);
+			wakeup_housekeeping_time = now + WEBHID_HOUSEKEEPING_INTERVAL_SEC;
 		}
+		nc->ev_timer_time = wakeup_housekeeping_time;
+		push_deferred(); // may bring the timer forward
+		return;
 	}
+	if (ev != MG_EV_RECV) return;
 
-	return 0;
+	mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+	atom_exchange(&wakeup_armed, 0);
+	if (atom_exchange(&rest_completed, 0)) complete_requests();
+	if (atom_exchange(&devices_stopped, 0)) finish_stopped_devices();
+
+	node = bdl_list_get_head(hidsocket_devices_list);
+	while (node) {
+		struct hidsocket_device *hd =
+			(struct hidsocket_device *)bdl_list_extract_content(node);
+		if (atom_exchange(&hd->input_pending, 0)) {
+			bdl_list_node_t sub = bdl_list_get_head(hd->subscribers);
+			while (sub) {
+				struct hidsocket_connection *conn =
+					(struct hidsocket_connection *)bdl_list_extract_content(sub);
+				if (conn->options.push) {
+					push_input(conn);
+				} else if (conn->waiting_input) {
+					if (send_input_frame(conn, 0) > 0) conn->waiting_input = 0;
+				}
+				sub = bdl_list_get_next(hd->subscribers, sub);
+			}
+		}
+		node = bdl_list_get_next(hidsocket_devices_list, node);
+	}
 }
 
-static void destroy_connection(struct hidsocket_connection* conn)
-{
-	pthread_mutex_lock(&conn->mtx);
-	conn->requested_disconnect = 1;
-	pthread_join(conn->th, NULL);
-	pthread_mutex_destroy(&conn->mtx);
+void webhid_initialize(struct mg_mgr *mgr) {
+	WEBHID_TRACE("webhid_initialize() called");
+	hidsocket_connections_list = bdl_list_create();
+	hidsocket_devices_list = bdl_list_create();
+	hidsocket_captures_list = bdl_list_create();
+	hid_index_initialize();
+	hid_pool_initialize();
+	if (worker_pool_initialize(0) == 0) {
+		WEBHID_TRACE("failed to start workers");
+	}
+	rest_requests_list = bdl_list_create();
+	if (hid_request_initialize(0, on_request_completed, open_pooled_handle) == 0) {
+		WEBHID_TRACE("failed to start threads for REST requests");
+	}
+	if (!capture_log_initialize()) {
+		WEBHID_TRACE("failed to start helper of capture, captures cannot be started");
+	}
+#ifdef WEBHID_HIDRAW_EPOLL
+	if (!hidraw_epoll_initialize(hid_index_invalidate)) {
+		WEBHID_TRACE("failed to start epoll, HID IFs are read by workers");
+	}
+#endif
 
-	if (conn->device) hid_close(conn->device);
-	vl_queue_destroy(conn->queue_input);
+	if (mg_socketpair(wakeup_socks, SOCK_STREAM)) {
+		struct mg_connection *wc = mg_add_sock(mgr, wakeup_socks[0], wakeup_handler);
+		wakeup_housekeeping_time = mg_time() + WEBHID_HOUSEKEEPING_INTERVAL_SEC;
+		if (wc) wc->ev_timer_time = wakeup_housekeeping_time;
+		wakeup_connection = wc;
+	} else {
+		WEBHID_TRACE("failed to create socket pair for wakeup");
+	}
+}
 
-	free(conn);
+int webhid_get_numof_connection(void) {
+	return hidsocket_connections_list? bdl_list_get_size(hidsocket_connections_list): 0;
 }
 
-static void destroy_connectin_pvoid(void *conn)
-{
-	destroy_connection((struct hidsocket_connection*)conn);
+uint32_t webhid_get_numof_dropped(void) {
+	return hidsocket_num_dropped;
 }
 
-static struct hidsocket_connection* init_connection(struct mg_connection *nc, hid_device *dev, uint8_t rid) {
-	struct hidsocket_connection* conn = (struct hidsocket_connection*) malloc(sizeof(struct hidsocket_connection));
-	if (conn) {
-		conn->connection = nc;
-		conn->device = dev;
-		conn->report_id = rid;
-		conn->queue_input = vl_queue_create();
-		if (!conn->queue_input) WEBHID_TRACE("failed to create queue");
-		conn->requested_disconnect = 0;
+/**
+ *  Connection is held by user_data of mongoose connection, so it is found without searching the list
+ */
+static struct hidsocket_connection * search_connection(struct mg_connection *nc) {
+	return (struct hidsocket_connection *) nc->user_data;
+}
+
+/**
+ *  Parse a list of report IDs and ranges (e.g. "1,3,8-10") of len characters into mask
+ *  An empty list, or one including report ID 0 (which means HID without report IDs) selects all of them
+ */
+static void parse_report_ids(const char *p, size_t len, uint32_t *mask) {
+	char list[HIDSOCKET_REPORT_IDS_MAX_LENGTH];
+	char *q = list;
+	int all = 1;
+
+	if (len >= sizeof(list)) len = sizeof(list) - 1;
+	memcpy(list, p, len);
+	list[len] = '\0';
+	memset(mask, 0, HIDSOCKET_REPORT_ID_WORDS * sizeof(uint32_t));
+	while (*q) {
+		char *end;
+		long first = strtol(q, &end, 0), last;
+		if (end == q) break; // not a number
+		last = (*end == '-')? strtol(end + 1, &end, 0): first;
+		if (first == 0) {
+			all = 1;
+			break;
+		}
+		if (first < 0 || first > 255 || last < first) break; // malformed
+		if (last > 255) last = 255;
+		all = 0;
+		for (; first <= last; first++) mask[first >> 5] |= 1u << (first & 31);
+		if (*end != ',') break;
+		q = end + 1;
+	}
+	if (all) memset(mask, 0xFF, HIDSOCKET_REPORT_ID_WORDS * sizeof(uint32_t));
+}
+
+/**
+ *  Parse options formatted as query string, missing ones are left as they are
+ *  It returns 1 when any option is found; 0 on not
+ */
+static int parse_options(const struct mg_str *params, struct hidsocket_options *opt) {
+	char str[16];
+	char list[HIDSOCKET_USAGES_MAX * 10];
+	int found = 0;
+
+	if (mg_get_http_var(params, "mode", str, sizeof(str)) > 0) {
+		opt->push = (strcmp(str, "push") == 0);
+		opt->wait = (strcmp(str, "wait") == 0);
+		found = 1;
+	}
+	if (mg_get_http_var(params, "latency", str, sizeof(str)) > 0) {
+		opt->latency_ms = (int) strtol(str, NULL, 0);
+		if (opt->latency_ms < 0) opt->latency_ms = 0;
+		if (opt->latency_ms > HIDSOCKET_PUSH_LATENCY_MAX_MS) opt->latency_ms = HIDSOCKET_PUSH_LATENCY_MAX_MS;
+		found = 1;
+	}
+	if (mg_get_http_var(params, "format", str, sizeof(str)) > 0) {
+		if (strcmp(str, "batch") == 0) opt->format = HIDSOCKET_FORMAT_BATCH;
+		else if (strcmp(str, "fields") == 0) opt->format = HIDSOCKET_FORMAT_FIELDS;
+		else if (strcmp(str, "delta") == 0) opt->format = HIDSOCKET_FORMAT_DELTA;
+		else opt->format = HIDSOCKET_FORMAT_LEGACY;
+		found = 1;
+	}
+	if (mg_get_http_var(params, "usages", list, sizeof(list)) > 0) {
+		char *p = list;
+		opt->num_usages = 0;
+		while (*p && opt->num_usages < HIDSOCKET_USAGES_MAX) {
+			uint32_t page = (uint32_t) strtoul(p, &p, 16);
+			uint32_t usage = (*p == ':')? (uint32_t) strtoul(p + 1, &p, 16): 0;
+			opt->usages[opt->num_usages++] = ((page & 0xFFFF) << 16) | (usage & 0xFFFF);
+			while (*p && *p != ',') p++;
+			if (*p == ',') p++;
+		}
+		found = 1;
+	}
+	if (mg_get_http_var(params, "batch", str, sizeof(str)) > 0) {
+		opt->batch = (int) strtol(str, NULL, 0);
+		if (opt->batch < 0) opt->batch = 0;
+		if (opt->batch > HIDSOCKET_INPUT_RING_SLOTS) opt->batch = HIDSOCKET_INPUT_RING_SLOTS;
+		found = 1;
+	}
+	if (mg_get_http_var(params, "queue", str, sizeof(str)) > 0) {
+		long size = strtol(str, NULL, 0);
+		if (size < 1) size = 1;
+		if (size > HIDSOCKET_INPUT_RING_SLOTS) size = HIDSOCKET_INPUT_RING_SLOTS;
+		opt->queue_size = (uint32_t) size;
+		found = 1;
+	}
+	if (mg_get_http_var(params, "changes", str, sizeof(str)) > 0) {
+		opt->changes_only = (strcmp(str, "only") == 0);
+		found = 1;
+	}
+	if (mg_get_http_var(params, "keyframe", str, sizeof(str)) > 0) {
+		opt->keyframe = (int) strtol(str, NULL, 0);
+		if (opt->keyframe < 1) opt->keyframe = 1;
+		if (opt->keyframe > 0xFFFF) opt->keyframe = 0xFFFF;
+		found = 1;
+	}
+	if (mg_get_http_var(params, "deflate", str, sizeof(str)) > 0) {
+		opt->deflate_threshold = (strcmp(str, "off") == 0)? -1: (int) strtol(str, NULL, 0);
+		if (opt->deflate_threshold < -1) opt->deflate_threshold = 0;
+		found = 1;
+	}
+	if (mg_get_http_var(params, "reports", list, sizeof(list)) > 0) {
+		parse_report_ids(list, strlen(list), opt->report_ids);
+		found = 1;
+	}
+	if (mg_get_http_var(params, "hz", str, sizeof(str)) > 0) {
+		opt->hz = (int) strtol(str, NULL, 0);
+		if (opt->hz < 0) opt->hz = 0;
+		if (opt->hz > HIDSOCKET_RATE_MAX_HZ) opt->hz = HIDSOCKET_RATE_MAX_HZ;
+		found = 1;
+	}
+	if (mg_get_http_var(params, "aggregate", str, sizeof(str)) > 0) {
+		if (strcmp(str, "sum") == 0) opt->aggregate = HIDSOCKET_AGGREGATE_SUM;
+		else if (strcmp(str, "envelope") == 0) opt->aggregate = HIDSOCKET_AGGREGATE_ENVELOPE;
+		else opt->aggregate = HIDSOCKET_AGGREGATE_LATEST;
+		found = 1;
+	}
+	if (mg_get_http_var(params, "ack", str, sizeof(str)) > 0) {
+		opt->ack = (strcmp(str, "on") == 0);
+		found = 1;
+	}
+	if (mg_get_http_var(params, "overflow", str, sizeof(str)) > 0) {
+		if (strcmp(str, "drop-newest") == 0) opt->overflow = HIDSOCKET_OVERFLOW_DROP_NEWEST;
+		else if (strcmp(str, "block") == 0) opt->overflow = HIDSOCKET_OVERFLOW_BLOCK;
+		else if (strcmp(str, "keep-latest") == 0) opt->overflow = HIDSOCKET_OVERFLOW_KEEP_LATEST;
+		else opt->overflow = HIDSOCKET_OVERFLOW_DROP_OLDEST;
+		found = 1;
+	}
+
+	return found;
+}
+
+static int is_usage_selected(const struct hidsocket_options *opt, const struct hid_desc_field *f) {
+	int i;
+	if (opt->num_usages == 0) return 1;
+	for (i = 0; i < opt->num_usages; i++) {
+		uint32_t usage = opt->usages[i];
+		if ((usage >> 16) == f->usage_page && ((usage & 0xFFFF) == 0 || (usage & 0xFFFF) == f->usage)) return 1;
+	}
+	return 0;
+}
+
+/**
+ *  Fields are selected for fields format, and to sum relative fields of reports aggregated
+ */
+static int needs_selection(const struct hidsocket_options *opt) {
+	return opt->format == HIDSOCKET_FORMAT_FIELDS || (opt->hz > 0 && opt->aggregate == HIDSOCKET_AGGREGATE_SUM);
+}
+
+/**
+ *  Fetch report descriptor of the HID IF for subscribers waiting for it, fields are selected when it is kept by the pool
+ *  It returns 1 when it is being fetched; 0 when it could not be requested
+ */
+static int fetch_fields(struct hidsocket_device *hd) {
+	if (hd->fetching_descriptor) return 1;
+	if (!submit_descriptor_request(hd->entry, 0)) return 0;
+	hd->fetching_descriptor = 1;
+	return 1;
+}
+
+/**
+ *  Choose fields sent in fields format (or summed by "aggregate=sum") by usages of the connection
+ *  Report descriptor of the HID IF is fetched off mongoose thread when it is needed first,
+ *  the selection is left 0 meanwhile and made by select_pending_fields
+ *  It returns 1 on success (or while the descriptor is fetched); 0 when the descriptor is not available
+ */
+static int select_fields(struct hidsocket_connection *conn) {
+	hid_desc_t desc = hid_pool_get_descriptor(conn->device->entry);
+	struct hidsocket_field_selection *sel;
+	int i, num = 0;
+
+	if (!hid_pool_is_descriptor_fetched(conn->device->entry)) return fetch_fields(conn->device);
+	if (!desc) return 0;
+	sel = conn->selection;
+	if (!sel) {
+		sel = (struct hidsocket_field_selection *) malloc(sizeof(struct hidsocket_field_selection));
+		if (!sel) return 0;
+		sel->fields = 0;
+		sel->values = 0;
+	}
+	free(sel->fields);
+	free(sel->values);
+	sel->fields = (const struct hid_desc_field **) malloc((hid_desc_get_numof_fields(desc) + 1) * sizeof(struct hid_desc_field *));
+	sel->values = (int32_t *) malloc((hid_desc_get_numof_fields(desc) + 1) * 2 * sizeof(int32_t));
+	if (!sel->fields || !sel->values) {
+		free(sel->fields);
+		free(sel->values);
+		free(sel);
+		conn->selection = 0;
+		return 0;
+	}
+
+	memset(sel->count, 0, sizeof(sel->count));
+	memset(sel->aggregated, 0, sizeof(sel->aggregated));
+	for (i = 0; i < hid_desc_get_numof_fields(desc); i++) {
+		const struct hid_desc_field *f = hid_desc_get_field(desc, i); // ordered by report ID
+		if (!is_usage_selected(&conn->options, f)) continue;
+		if (sel->count[f->report_id] == 0) sel->first[f->report_id] = (uint16_t) num;
+		sel->count[f->report_id]++;
+		sel->fields[num++] = f;
+	}
+	sel->uses_report_id = hid_desc_uses_report_id(desc);
+	conn->selection = sel;
+	return 1;
+}
+
+static void free_selection(struct hidsocket_connection *conn) {
+	if (conn->selection) {
+		free(conn->selection->fields);
+		free(conn->selection->values);
+		free(conn->selection);
+		conn->selection = 0;
+	}
+}
+
+/**
+ *  Select fields of subscribers which waited for report descriptor of a HID IF,
+ *  ones it is not available for are closed, as their handshake would have been refused
+ */
+static void select_pending_fields(hid_pool_entry_t entry) {
+	struct hidsocket_device *hd = (struct hidsocket_device *) hid_pool_get_reader(entry);
+	bdl_list_node_t node;
+
+	if (!hd) return;
+	hd->fetching_descriptor = 0;
+	for (node = bdl_list_get_head(hd->subscribers); node; node = bdl_list_get_next(hd->subscribers, node)) {
+		struct hidsocket_connection *conn = (struct hidsocket_connection *)bdl_list_extract_content(node);
+		if (!needs_selection(&conn->options) || conn->selection) continue;
+		if (!select_fields(conn)) {
+			WEBHID_TRACE("report descriptor is not available");
+			mg_send_websocket_frame(conn->connection, WEBSOCKET_OP_CLOSE, "\x03\xf3", 2); // 1011: internal error
+			conn->connection->flags |= MG_F_SEND_AND_CLOSE;
+		}
+	}
+}
+
+static void free_history(struct hidsocket_connection *conn) {
+	if (conn->history) {
+		report_cache_destroy(conn->history->sent);
+		free(conn->history);
+		conn->history = 0;
+	}
+}
+
+/**
+ *  Keep reports sent to a connection when its options need them
+ *  Reports kept are forgotten whenever options change, so the next ones are sent whole
+ *  It returns 1 on success; 0 when memory is short
+ */
+static int update_history(struct hidsocket_connection *conn) {
+	struct hidsocket_history *history = conn->history;
+
+	if (!conn->options.changes_only && conn->options.format != HIDSOCKET_FORMAT_DELTA) {
+		free_history(conn);
+		return 1;
+	}
+	if (history) {
+		report_cache_clear(history->sent);
+	} else {
+		history = (struct hidsocket_history *) malloc(sizeof(struct hidsocket_history));
+		if (!history) return 0;
+		history->sent = report_cache_create(HIDSOCKET_INPUT_SLOT_SIZE);
+		if (!history->sent) {
+			free(history);
+			return 0;
+		}
+		conn->history = history;
+	}
+	memset(history->since_key, 0, sizeof(history->since_key));
+	return 1;
+}
+
+/**
+ *  A subscriber with block policy has a full queue, reports must be left in the buffer of HID
+ */
+static int is_input_blocked(struct hidsocket_device *hd) {
+	return atom_load_acq(&hd->blocked) &&
+		(int32_t)(atom_load_acq(&hd->input_limit) - bc_ring_get_head(hd->ring_input)) <= 0;
+}
+
+/**
+ *  Stamp a report read after the header of record and put it into the ring
+ *  While capturing, every report is appended to the capture log before being filtered for subscribers
+ *  A report of report ID no subscriber asks is dropped before being copied into the ring,
+ *  and a report unchanged from the previous one of its report ID is not stored while every subscriber asks changes only,
+ *  so quiet HIDs neither fill the ring nor wake mongoose thread up
+ *  It returns 1 when the report is stored; 0 on not
+ */
+static int store_input(struct hidsocket_device *hd, uint8_t *record, int len) {
+	const uint8_t *report = record + HIDSOCKET_RECORD_HEADER_SIZE;
+	uint64_t timestamp_us = 0;
+
+	hd->stats.reports_read++;
+	hd->stats.bytes_read += len;
+	if (atom_ptr_load_acq(&hd->capture)) {
+		// the epoch is made odd before the log is loaded again, so mongoose thread replacing it sees the append
+		uint32_t epoch = atom_fetch_add(&hd->capture_epoch, 1);
+		capture_log_t log = (capture_log_t) atom_ptr_load_acq(&hd->capture);
+		timestamp_us = hr_clock_get_us();
+		if (log) capture_log_append(log, timestamp_us, report, len);
+		atom_store_rel(&hd->capture_epoch, epoch + 2);
+	}
+	if (!((atom_load_acq(&hd->report_ids[report[0] >> 5]) >> (report[0] & 31)) & 1)) {
+		hd->stats.reports_unsubscribed++;
+		return 0;
+	}
+	if (atom_load_acq(&hd->input_cache_reset) && atom_exchange(&hd->input_cache_reset, 0)) report_cache_clear(hd->input_cache);
+	if (atom_load_acq(&hd->changes_only)) {
+		if (report_cache_is_same(hd->input_cache, report, len)) {
+			hd->stats.reports_unchanged++;
+			return 0;
+		}
+		report_cache_store(hd->input_cache, report, len);
+	}
+
+	if (!timestamp_us) timestamp_us = hr_clock_get_us();
+	memcpy(record, &timestamp_us, sizeof(timestamp_us));
+	bc_ring_push(hd->ring_input, record, HIDSOCKET_RECORD_HEADER_SIZE + len);
+	return 1;
+}
+
+static void notify_batched(struct hidsocket_device *hd) {
+	if (hd->num_batched) {
+		hd->num_batched = 0;
+		wakeup_event_loop(hd);
+	}
+}
+
+/**
+ *  Read a report on a worker, without blocking when the HID IF is read by overlapped ReadFile
+ */
+static int read_device(struct hidsocket_device *hd, uint8_t *data, size_t length, int timeout_ms) {
+#ifdef _WIN32
+	if (hd->overlapped) return hid_overlapped_read(hd->overlapped, data, length);
+#endif
+	if (!hd->device) hd->device = hid_pool_open(hd->entry); // on the worker, not to stall mongoose thread
+	if (!hd->device) return -1;
+	return hid_read_timeout(hd->device, data, length, timeout_ms);
+}
+
+/**
+ *  Service of HID IF on a worker: read reports available and notify them within latency budget
+ *  It blocks up to timeout_ms while no report arrives (no CPU is used while HID is idle),
+ *  or tells by *due_ms when reports coalesced must be notified, and returns the number of reports read as the load of HID IF
+ */
+static int service_device(void *ctx, int timeout_ms, int *due_ms) {
+	struct hidsocket_device *hd = (struct hidsocket_device *)ctx;
+	uint8_t data[HIDSOCKET_RECORD_HEADER_SIZE + HIDSOCKET_INPUT_SLOT_SIZE];
+	int latency_ms = (int) atom_load_acq(&hd->latency_ms);
+	int batch = (int) atom_load_acq(&hd->batch);
+	int num_read = 0;
+
+	hd->stats.loop_iterations++;
+	while (num_read < HIDSOCKET_READ_BURST) {
+		int timeout = num_read? 0: timeout_ms;
+		int len;
+		if (is_input_blocked(hd)) {
+			// a subscriber with block policy has a full queue, reports are left in the buffer of HID
+			hd->stats.blocked_loops++;
+			notify_batched(hd);
+			// a report left unread does not wake the worker, so update_flow_control does when the queue is drained
+			atom_exchange(&hd->paused, 1);
+			if (!is_input_blocked(hd)) continue; // drained before being paused
+			hd->blocked_retry_ms = hd->blocked_retry_ms? hd->blocked_retry_ms * 2: 1;
+			if (hd->blocked_retry_ms > HIDSOCKET_BLOCKED_RETRY_MAX_MS) hd->blocked_retry_ms = HIDSOCKET_BLOCKED_RETRY_MAX_MS;
+			*due_ms = hd->blocked_retry_ms;
+#ifdef _WIN32
+			if (hd->overlapped) hid_overlapped_reset_event(hd->overlapped);
+#endif
+			break;
+		}
+		hd->blocked_retry_ms = 0;
+		if (hd->num_batched && timeout) {
+			// wait only for the rest of latency budget
+			uint64_t now_us = hr_clock_get_us();
+			int rest = now_us < hd->deadline_us? (int)((hd->deadline_us - now_us + 999) / 1000): 0;
+			if (rest < timeout) timeout = rest;
+		}
+		len = read_device(hd, data + HIDSOCKET_RECORD_HEADER_SIZE, HIDSOCKET_INPUT_SLOT_SIZE, timeout);
+		if (len > 0) {
+			num_read++;
+			if (!store_input(hd, data, len)) continue;
+			if (latency_ms > 0) {
+				// coalesce reports within latency budget
+				if (hd->num_batched++ == 0) hd->deadline_us = hr_clock_get_us() + latency_ms * 1000;
+				if (batch > 0 && hd->num_batched >= batch) notify_batched(hd);
+			} else {
+				hd->num_batched++;
+			}
+		} else {
+			if (len < 0) {
+				WEBHID_TRACE("failed to read HID");
+				hd->stats.read_errors++;
+				if (timeout) msleep(timeout); // device may be unplugged, do not spin
+			}
+			break;
+		}
+	}
+
+	if (hd->num_batched) {
+		uint64_t now_us = hr_clock_get_us();
+		if (latency_ms <= 0 || now_us >= hd->deadline_us) notify_batched(hd);
+		else *due_ms = (int)((hd->deadline_us - now_us + 999) / 1000);
+	}
+	return num_read;
+}
+
+/**
+ *  Called on the worker which left a device being stopped, it is finished by mongoose thread
+ */
+static void on_device_removed(void *ctx) {
+	struct hidsocket_device *hd = (struct hidsocket_device *)ctx;
+	atom_store_rel(&hd->stopped, 1);
+	if (atom_exchange(&devices_stopped, 1) == 0) wakeup_send();
+}
+
+#ifdef WEBHID_HIDRAW_EPOLL
+/// Callbacks on epoll thread
+/// Reports available at once are notified together when the HID IF is drained,
+/// so they are coalesced without timers and the latency budget is never exceeded
+
+static int hidraw_can_read(void *ctx) {
+	struct hidsocket_device *hd = (struct hidsocket_device *)ctx;
+	if (!is_input_blocked(hd)) return 1;
+	hd->stats.blocked_loops++;
+	return 0;
+}
+
+static void hidraw_on_input(void *ctx, const uint8_t *data, int len) {
+	struct hidsocket_device *hd = (struct hidsocket_device *)ctx;
+	uint8_t record[HIDSOCKET_RECORD_HEADER_SIZE + HIDSOCKET_INPUT_SLOT_SIZE];
+	if (len > HIDSOCKET_INPUT_SLOT_SIZE) len = HIDSOCKET_INPUT_SLOT_SIZE; // as hid_read truncates
+	memcpy(record + HIDSOCKET_RECORD_HEADER_SIZE, data, len);
+	if (store_input(hd, record, len)) hd->num_batched++;
+}
+
+static void hidraw_on_drained(void *ctx) {
+	struct hidsocket_device *hd = (struct hidsocket_device *)ctx;
+	hd->stats.loop_iterations++;
+	notify_batched(hd);
+}
+
+static void hidraw_on_error(void *ctx) {
+	struct hidsocket_device *hd = (struct hidsocket_device *)ctx;
+	WEBHID_TRACE("failed to read hidraw");
+	hd->stats.read_errors++;
+	hid_index_invalidate(); // device may be unplugged
+}
+
+static const struct hidraw_epoll_callbacks hidraw_callbacks = {
+	hidraw_can_read, hidraw_on_input, hidraw_on_drained, hidraw_on_error
+};
+#endif //WEBHID_HIDRAW_EPOLL
+
+/**
+ *  Coalesce reports within the tightest budget among subscribers,
+ *  a polling subscriber needs every report to be notified at once,
+ *  and a rate limited one needs no notification more often than its frames
+ *  Unchanged reports are dropped by reading thread only when every subscriber asks changes only,
+ *  and reports of IDs no subscriber asks are always dropped
+ */
+static void update_coalescing(struct hidsocket_device *hd) {
+	int latency_ms = -1, batch = 0, changes_only = 1;
+	uint32_t report_ids[HIDSOCKET_REPORT_ID_WORDS];
+	int i;
+	bdl_list_node_t sub = bdl_list_get_head(hd->subscribers);
+	memset(report_ids, 0, sizeof(report_ids));
+	while (sub) {
+		const struct hidsocket_connection *conn =
+			(const struct hidsocket_connection *)bdl_list_extract_content(sub);
+		int lat = conn->options.push? conn->options.latency_ms: 0;
+		if (conn->options.push && conn->options.hz > 0 && 1000 / conn->options.hz > lat) lat = 1000 / conn->options.hz;
+		if (latency_ms < 0 || lat < latency_ms) latency_ms = lat;
+		if (conn->options.batch > 0 && (batch == 0 || conn->options.batch < batch)) batch = conn->options.batch;
+		if (!conn->options.changes_only) changes_only = 0;
+		for (i = 0; i < HIDSOCKET_REPORT_ID_WORDS; i++) report_ids[i] |= conn->options.report_ids[i];
+		sub = bdl_list_get_next(hd->subscribers, sub);
+	}
+	atom_store_rel(&hd->latency_ms, latency_ms > 0? latency_ms: 0);
+	atom_store_rel(&hd->batch, batch);
+	// a new subscriber has none of reports read so far, let the next ones be stored anyway
+	atom_store_rel(&hd->input_cache_reset, 1);
+	atom_store_rel(&hd->changes_only, changes_only);
+	for (i = 0; i < HIDSOCKET_REPORT_ID_WORDS; i++) atom_store_rel(&hd->report_ids[i], report_ids[i]);
+}
+
+/**
+ *  Let reading thread stop before it overwrites reports not read by a subscriber with block policy
+ *  It is called whenever such a subscriber moves its cursor or subscribers change
+ */
+static void update_flow_control(struct hidsocket_device *hd) {
+	uint32_t head = bc_ring_get_head(hd->ring_input);
+	uint32_t room = HIDSOCKET_INPUT_RING_SLOTS;
+	int blocked = 0;
+	bdl_list_node_t sub = bdl_list_get_head(hd->subscribers);
+	while (sub) {
+		const struct hidsocket_connection *conn =
+			(const struct hidsocket_connection *)bdl_list_extract_content(sub);
+		if (conn->options.overflow == HIDSOCKET_OVERFLOW_BLOCK) {
+			int32_t r = (int32_t)(conn->cursor + conn->options.queue_size - head);
+			if (r < 0) r = 0; // queue size was reduced
+			if ((uint32_t) r < room) room = (uint32_t) r;
+			blocked = 1;
+		}
+		sub = bdl_list_get_next(hd->subscribers, sub);
+	}
+	atom_store_rel(&hd->input_limit, head + room);
+	atom_store_rel(&hd->blocked, blocked);
+	if (!blocked || room > 0) {
+#ifdef WEBHID_HIDRAW_EPOLL
+		if (hd->raw) hidraw_epoll_resume(hd->raw);
+#endif
+		if (hd->task && atom_load_acq(&hd->paused) && atom_exchange(&hd->paused, 0)) worker_pool_wake(hd->task);
+	}
+}
+
+static int start_reading(struct hidsocket_device *hd);
+
+/**
+ *  Release a device whose reading thread has left it
+ *  A device subscribed (or captured) again while it was being stopped starts to be read again instead
+ */
+static void finish_device(struct hidsocket_device *hd) {
+	release_retired_captures(hd); // its reading thread has left
+	hd->stopping = 0;
+	atom_store_rel(&hd->stopped, 0);
+#ifdef _WIN32
+	if (hd->overlapped) {
+		hid_overlapped_close(hd->overlapped);
+		hd->overlapped = 0;
+	}
+#endif
+	if (bdl_list_get_size(hd->subscribers) > 0 || hd->capture) {
+		if (!start_reading(hd)) WEBHID_TRACE("failed to restart reading"); // retried by housekeeping
+		return;
+	}
 
-		if (pthread_create(&conn->th, 0, proc_reading_hid, conn) == 0) {
-			pthread_mutex_init(&conn->mtx, NULL);
+	bdl_list_delete_node(hidsocket_devices_list, hd->node);
+	hid_pool_set_reader(hd->entry, 0);
+	if (hd->stats.read_errors) hid_pool_discard(hd->entry); // handle may be stale, the next user opens another one
+	hid_pool_release(hd->entry);
+	bc_ring_destroy(hd->ring_input);
+	report_cache_destroy(hd->input_cache);
+	bdl_list_destroy(hd->subscribers, free); // no subscriber is left
+
+	free(hd);
+}
+
+/**
+ *  Stop reading a HID IF, mongoose thread never waits for its reading thread
+ *  A device read on a worker is left in the list until the worker leaves it (see finish_stopped_devices)
+ */
+static void stop_device(struct hidsocket_device *hd) {
+	if (hd->stopping) return; // finish_device looks at subscribers again
+#ifdef WEBHID_HIDRAW_EPOLL
+	if (hd->raw) {
+		hidraw_epoll_remove(hd->raw); // waits only for a callback running
+		hd->raw = 0;
+		finish_device(hd);
+		return;
+	}
+#endif
+	if (!hd->task) {
+		finish_device(hd); // reading could not be restarted
+		return;
+	}
+	hd->stopping = 1;
+	worker_pool_remove(hd->task, on_device_removed);
+	hd->task = 0;
+}
+
+static void finish_stopped_devices(void) {
+	bdl_list_node_t node = bdl_list_get_head(hidsocket_devices_list);
+	while (node) {
+		struct hidsocket_device *hd =
+			(struct hidsocket_device *)bdl_list_extract_content(node);
+		node = bdl_list_get_next(hidsocket_devices_list, node);
+		if (atom_load_acq(&hd->stopped)) finish_device(hd);
+	}
+}
+
+/**
+ *  Retry reading devices subscribed whose reading could not be restarted
+ */
+static void restart_devices(void) {
+	bdl_list_node_t node = bdl_list_get_head(hidsocket_devices_list);
+	while (node) {
+		struct hidsocket_device *hd =
+			(struct hidsocket_device *)bdl_list_extract_content(node);
+		int reading = hd->task || hd->stopping;
+#ifdef WEBHID_HIDRAW_EPOLL
+		if (hd->raw) reading = 1;
+#endif
+		if (!reading && !start_reading(hd)) WEBHID_TRACE("failed to restart reading");
+		node = bdl_list_get_next(hidsocket_devices_list, node);
+	}
+}
+
+/**
+ *  Start reading a HID IF on a worker shared with other HID IFs
+ *  On Linux, the HID IF is read on epoll thread instead when its hidraw node can be opened
+ *  It returns 1 on success; 0 on fail
+ */
+static int start_reading(struct hidsocket_device *hd) {
+#ifdef WEBHID_HIDRAW_EPOLL
+	const char *path = hid_pool_get_path(hd->entry);
+	hd->raw = (strncmp(path, "/dev/hidraw", 11) == 0)? hidraw_epoll_add(path, &hidraw_callbacks, hd): 0;
+	if (hd->raw) return 1;
+#endif
+#ifdef _WIN32
+	{
+		// falls back on the pooled handle when it cannot be opened (e.g. HIDs simulated by benchmark)
+		hd->overlapped = hid_overlapped_open(hid_pool_get_path(hd->entry));
+		hd->task = worker_pool_add(service_device, hd, hd->overlapped? hid_overlapped_get_event(hd->overlapped): 0);
+		if (!hd->task && hd->overlapped) {
+			hid_overlapped_close(hd->overlapped);
+			hd->overlapped = 0;
+		}
+	}
+#else
+	hd->task = worker_pool_add(service_device, hd, 0);
+#endif
+	return hd->task != 0;
+}
+
+/**
+ *  Start reading a HID IF, the device takes the reference of entry on success
+ */
+static struct hidsocket_device *start_device(hid_pool_entry_t entry) {
+	struct hidsocket_device *hd = (struct hidsocket_device *) malloc(sizeof(struct hidsocket_device));
+	if (hd) {
+		hd->entry = entry;
+		hd->device = 0;
+		hd->task = 0;
+		hd->stopping = 0;
+		hd->stopped = 0;
+#ifdef WEBHID_HIDRAW_EPOLL
+		hd->raw = 0;
+#endif
+#ifdef _WIN32
+		hd->overlapped = 0;
+#endif
+		hd->num_batched = 0;
+		hd->deadline_us = 0;
+		hd->blocked_retry_ms = 0;
+		hd->paused = 0;
+		hd->input_pending = 0;
+		hd->latency_ms = 0;
+		hd->batch = 0;
+		hd->blocked = 0;
+		hd->input_limit = 0;
+		hd->changes_only = 0;
+		hd->input_cache_reset = 0;
+		memset((void *) hd->report_ids, 0, sizeof(hd->report_ids)); // set by update_coalescing on subscribing
+		hd->node = 0;
+		memset(&hd->stats, 0, sizeof(hd->stats));
+		hd->ring_input = bc_ring_create(HIDSOCKET_INPUT_RING_SLOTS, HIDSOCKET_RECORD_HEADER_SIZE + HIDSOCKET_INPUT_SLOT_SIZE);
+		hd->input_cache = report_cache_create(HIDSOCKET_INPUT_SLOT_SIZE);
+		hd->subscribers = bdl_list_create();
+		hd->fetching_descriptor = 0;
+		hd->capture = 0;
+		hd->capture_epoch = 0;
+		if (hd->ring_input && hd->input_cache && hd->subscribers) hd->node = bdl_list_append_node(hidsocket_devices_list, hd);
+		if (!hd->node) {
+			WEBHID_TRACE("failed to create device");
+			if (hd->ring_input) bc_ring_destroy(hd->ring_input);
+			if (hd->input_cache) report_cache_destroy(hd->input_cache);
+			if (hd->subscribers) bdl_list_destroy(hd->subscribers, free);
+			free(hd);
+			hd = 0;
+		}
+		else if (!start_reading(hd)) {
+			WEBHID_TRACE("failed to start reading");
+			// ERROR!
+			bdl_list_delete_node(hidsocket_devices_list, hd->node);
+			bc_ring_destroy(hd->ring_input);
+			report_cache_destroy(hd->input_cache);
+			bdl_list_destroy(hd->subscribers, free);
+			free(hd);
+			hd = 0;
+		}
+		else {
+			hid_pool_set_reader(entry, hd);
+		}
+	}
+	return hd;
+}
+
+/**
+ *  Get the device reading a HID IF, its reading is started when nobody reads it yet
+ *  It returns 0 on fail
+ */
+static struct hidsocket_device *get_device(const struct hid_index_key *key) {
+	hid_pool_entry_t entry = hid_pool_acquire(key);
+	struct hidsocket_device *hd;
+
+	if (!entry) return 0;
+	hd = (struct hidsocket_device *) hid_pool_get_reader(entry);
+	if (hd) {
+		hid_pool_release(entry); // the device already holds a reference
+	} else {
+		hd = start_device(entry);
+		if (!hd) hid_pool_release(entry);
+	}
+	return hd;
+}
+
+/**
+ *  Stop reading a HID IF when neither a connection subscribes it nor a capture records it
+ */
+static void put_device(struct hidsocket_device *hd) {
+	if (bdl_list_get_size(hd->subscribers) == 0 && !hd->capture) stop_device(hd);
+}
+
+/**
+ *  Let a connection subscribe the HID IF, its reading is started by the first subscriber
+ *  It returns 1 on success; 0 on fail
+ */
+static int subscribe_device(struct hidsocket_connection *conn, const struct hid_index_key *key) {
+	struct hidsocket_device *hd = get_device(key);
+
+	if (!hd) return 0;
+	conn->node_subscriber = bdl_list_append_node(hd->subscribers, conn);
+	if (!conn->node_subscriber) {
+		put_device(hd);
+		return 0;
+	}
+	conn->device = hd;
+	conn->cursor = bc_ring_get_head(hd->ring_input); // only reports read from now on are sent
+	update_coalescing(hd);
+	update_flow_control(hd);
+	return 1;
+}
+
+static void unsubscribe_device(struct hidsocket_connection *conn) {
+	struct hidsocket_device *hd = conn->device;
+	bdl_list_delete_node(hd->subscribers, conn->node_subscriber);
+	conn->device = 0;
+	if (bdl_list_get_size(hd->subscribers) == 0 && !hd->capture) {
+		stop_device(hd); // the last subscriber left
+	} else {
+		update_coalescing(hd);
+		update_flow_control(hd);
+	}
+}
+
+static void destroy_connection(struct hidsocket_connection* conn)
+{
+	if (conn->connection->user_data == conn) conn->connection->user_data = 0;
+	if (conn->num_outputs) forget_outputs(conn);
+	if (conn->device) unsubscribe_device(conn);
+	free_selection(conn);
+	free_history(conn);
+	if (conn->deflate) ws_deflate_destroy(conn->deflate);
+	free(conn);
+}
+
+static void destroy_connectin_pvoid(void *conn)
+{
+	destroy_connection((struct hidsocket_connection*)conn);
+}
+
+int webhid_connect(struct mg_connection *nc, struct http_message *hm) 
+{
+	struct hid_index_key key;
+	struct hidsocket_connection* conn;
+	if (search_connection(nc)) {
+		// already exists
+		WEBHID_TRACE("connection already exists");
+		return 0;
+	}
+	if (!hid_index_parse_virtual_path(hm->uri.p, hm->uri.len, &key)) {
+		WEBHID_TRACE("virtual path is malformed");
+		return 0;
+	}
+
+	conn = (struct hidsocket_connection*) malloc(sizeof(struct hidsocket_connection));
+	if (conn) {
+		conn->id = ++hidsocket_last_id;
+		conn->connection = nc;
+		conn->device = 0;
+		conn->num_dropped = 0;
+		conn->num_dropped_sent = 0;
+		conn->waiting_input = 0;
+		conn->num_outputs = 0;
+		conn->next_frame_us = 0;
+		conn->deferred = 0;
+		conn->options.push = 0;
+		conn->options.wait = 0;
+		conn->options.latency_ms = 0;
+		conn->options.batch = 0;
+		conn->options.format = HIDSOCKET_FORMAT_LEGACY;
+		conn->options.queue_size = HIDSOCKET_INPUT_RING_SLOTS;
+		conn->options.overflow = HIDSOCKET_OVERFLOW_DROP_OLDEST;
+		conn->options.num_usages = 0;
+		conn->options.changes_only = 0;
+		conn->options.keyframe = HIDSOCKET_DELTA_KEYFRAME_DEFAULT;
+		conn->options.deflate_threshold = HIDSOCKET_DEFLATE_THRESHOLD;
+		conn->options.hz = 0;
+		conn->options.aggregate = HIDSOCKET_AGGREGATE_LATEST;
+		conn->options.ack = 0;
+		// report IDs follow virtual path, e.g. "/hid/0001/0123/abcd/0001/0002/1,3,8-10"
+		parse_report_ids(hm->uri.p+HID_VIRTUAL_PATH_LENGTH, hm->uri.len-HID_VIRTUAL_PATH_LENGTH, conn->options.report_ids);
+		conn->selection = 0;
+		conn->history = 0;
+		conn->deflate = 0;
+		memset(&conn->stats, 0, sizeof(conn->stats));
+		parse_options(&hm->query_string, &conn->options);
+
+		if (!subscribe_device(conn, &key)) {
+			WEBHID_TRACE("virtual path could not be opened");
+			free(conn);
+			return 0;
+		}
+		if (needs_selection(&conn->options) && !select_fields(conn)) {
+			WEBHID_TRACE("report descriptor is not available");
+			destroy_connection(conn);
+			return 0;
+		}
+		if (!update_history(conn)) {
+			WEBHID_TRACE("failed to allocate memory");
+			destroy_connection(conn);
+			return 0;
+		}
+		conn->node = bdl_list_append_node(hidsocket_connections_list, conn);
+		if (conn->node) {
+			// succeeded registeration
+			nc->user_data = conn;
+			return 1;
+		} else {
+			// fail
+			WEBHID_TRACE("list node was not created");
+			destroy_connection(conn);
+		}
+	}
+	return 0;
+}
+
+int webhid_exists(struct mg_connection *nc)
+{
+	return (search_connection(nc) != 0);
+}
+
+void webhid_disconnect(struct mg_connection *nc)
+{
+	struct hidsocket_connection *conn = search_connection(nc);
+	WEBHID_TRACE("webhid_disconnect() called");
+	if (conn) {
+		if (!bdl_list_delete_node(hidsocket_connections_list, conn->node)) WEBHID_TRACE("node was invalid");
+		destroy_connection(conn);
+	} else {
+		WEBHID_TRACE("connection is not found");
+		///TODO: handle error..
+	}
+}
+
+/**
+ *  Mark only the latest report of each report ID in [cursor, head) to be kept
+ */
+static void mark_latest(bc_ring_t ring, uint32_t cursor, uint32_t head, uint8_t *keep)
+{
+	uint32_t seen[256 / 32];
+	uint32_t seq = head;
+	memset(seen, 0, sizeof(seen));
+	while (seq != cursor) {
+		size_t size;
+		const uint8_t *record = bc_ring_peek(ring, --seq, &size);
+		keep[seq - cursor] = 1;
+		if (record) {
+			uint8_t id = record[HIDSOCKET_RECORD_HEADER_SIZE];
+			if (seen[id >> 5] & (1u << (id & 31))) keep[seq - cursor] = 0;
+			seen[id >> 5] |= 1u << (id & 31);
+		}
+	}
+}
+
+/**
+ *  Aggregate reports in [cursor, end) of a connection limited by "hz="
+ *  Only the latest report of each report ID is marked to be kept, and values of fields selected are accumulated
+ *  over all reports of the ID: sum of relative fields by "aggregate=sum", minimum and maximum by "aggregate=envelope"
+ */
+static void aggregate_input(struct hidsocket_connection *conn, uint32_t cursor, uint32_t end, uint8_t *keep)
+{
+	bc_ring_t ring = conn->device->ring_input;
+	struct hidsocket_field_selection *sel = conn->selection;
+	int aggregate = conn->options.aggregate;
+	uint8_t copy[HIDSOCKET_RECORD_HEADER_SIZE + HIDSOCKET_INPUT_SLOT_SIZE];
+	const uint8_t *report = copy + HIDSOCKET_RECORD_HEADER_SIZE;
+	uint32_t seq;
+
+	mark_latest(ring, cursor, end, keep);
+	if (!sel) return;
+	memset(sel->aggregated, 0, sizeof(sel->aggregated));
+	if (aggregate == HIDSOCKET_AGGREGATE_LATEST) return;
+	if (aggregate == HIDSOCKET_AGGREGATE_ENVELOPE && conn->options.format != HIDSOCKET_FORMAT_FIELDS) return;
+
+	for (seq = cursor; seq != end; seq++) {
+		size_t size;
+		const uint8_t *record = bc_ring_peek(ring, seq, &size);
+		uint8_t rid;
+		int started, i;
+		if (!record || !HIDSOCKET_HAS_REPORT_ID(conn->options.report_ids, record[HIDSOCKET_RECORD_HEADER_SIZE])) continue;
+		memcpy(copy, record, size);
+		if (!bc_ring_is_valid(ring, seq)) continue; // overwritten while copying
+		size -= HIDSOCKET_RECORD_HEADER_SIZE;
+		rid = sel->uses_report_id? report[0]: 0;
+		started = HIDSOCKET_HAS_REPORT_ID(sel->aggregated, rid);
+		for (i = 0; i < sel->count[rid]; i++) {
+			const struct hid_desc_field *f = sel->fields[sel->first[rid] + i];
+			int32_t *acc = &sel->values[2 * (sel->first[rid] + i)];
+			int32_t value = 0;
+			hid_desc_extract(f, report, size, &value);
+			if (!started) {
+				acc[0] = acc[1] = value;
+			} else if (aggregate == HIDSOCKET_AGGREGATE_SUM) {
+				if (f->flags & HID_DESC_FIELD_RELATIVE) acc[0] += value; // others are taken from the latest report
+			} else {
+				if (value < acc[0]) acc[0] = value;
+				if (value > acc[1]) acc[1] = value;
+			}
+		}
+		sel->aggregated[rid >> 5] |= 1u << (rid & 31);
+	}
+}
+
+/**
+ *  Put relative fields summed by aggregate_input into a report kept
+ */
+static void put_sums(const struct hidsocket_field_selection *sel, uint8_t *report, size_t size)
+{
+	uint8_t rid = sel->uses_report_id? report[0]: 0;
+	int i;
+	if (!HIDSOCKET_HAS_REPORT_ID(sel->aggregated, rid)) return;
+	for (i = 0; i < sel->count[rid]; i++) {
+		const struct hid_desc_field *f = sel->fields[sel->first[rid] + i];
+		if (f->flags & HID_DESC_FIELD_RELATIVE) hid_desc_insert(f, report, size, sel->values[2 * (sel->first[rid] + i)]);
+	}
+}
+
+/**
+ *  Encode a report in delta format against the previous one sent with its report ID
+ *  It returns length of the delta written into out (HIDSOCKET_INPUT_SLOT_SIZE bytes at least),
+ *  or -1 when the report should be sent whole as a key report
+ */
+static int encode_delta(const struct hidsocket_history *history, int keyframe, const uint8_t *report, size_t size, uint8_t *out)
+{
+	const uint8_t *prev;
+	size_t prev_size, pos = 0;
+	int len = 0;
+
+	if (size == 0 || history->since_key[report[0]] + 1 >= keyframe) return -1;
+	prev = report_cache_get(history->sent, report[0], &prev_size);
+	if (!prev || prev_size != size) return -1;
+
+	while (pos < size) {
+		size_t skip = 0, count = 0, i;
+		while (pos + skip < size && skip < 255 && prev[pos + skip] == report[pos + skip]) skip++;
+		if (pos + skip == size) break; // rest is unchanged
+		pos += skip;
+		while (pos + count < size && count < 255 && prev[pos + count] != report[pos + count]) count++;
+		if (len + 2 + count >= size) return -1; // not shorter than the report
+		out[len++] = (uint8_t) skip;
+		out[len++] = (uint8_t) count;
+		for (i = 0; i < count; i++) out[len++] = prev[pos + i] ^ report[pos + i];
+		pos += count;
+	}
+	return len;
+}
+
+/**
+ *  Reports at the cursor are appended to out in the format as far as limit (0: no limit)
+ *  Pending reports more than queue size are dropped by overflow policy of the connection
+ *  When out is NULL, length of them is measured without moving the cursor
+ *  It returns number of reports
+ */
+static int read_input(struct hidsocket_connection *conn, int format, struct mbuf *out, size_t limit)
+{
+	bc_ring_t ring = conn->device->ring_input;
+	uint32_t head = bc_ring_get_head(ring);
+	uint32_t cursor = conn->cursor;
+	uint32_t end = head; // reports after it are dropped by drop-newest policy
+	uint32_t seq;
+	uint32_t dropped, dropped_newest = 0;
+	uint8_t keep[HIDSOCKET_INPUT_RING_SLOTS];
+	int keep_latest = 0;
+	int aggregating = (conn->options.hz > 0);
+	int summing = aggregating && conn->options.aggregate == HIDSOCKET_AGGREGATE_SUM && conn->selection;
+	size_t size_prefix = (format == HIDSOCKET_FORMAT_BATCH)? sizeof(struct hidsocket_batch_report): sizeof(uint32_t);
+	const struct hidsocket_field_selection *sel = conn->selection;
+	struct hidsocket_history *history = conn->history;
+	uint8_t copy[HIDSOCKET_RECORD_HEADER_SIZE + HIDSOCKET_INPUT_SLOT_SIZE];
+	uint8_t delta[HIDSOCKET_INPUT_SLOT_SIZE];
+	size_t total = 0;
+	int num = 0;
+
+	if (out && head - cursor > conn->stats.queue_high_water) {
+		conn->stats.queue_high_water = (head - cursor <= HIDSOCKET_INPUT_RING_SLOTS)? head - cursor: HIDSOCKET_INPUT_RING_SLOTS;
+	}
+	dropped = bc_ring_catch_up(ring, &cursor, head);
+	if (head - cursor > conn->options.queue_size) {
+		uint32_t excess = head - cursor - conn->options.queue_size;
+		switch (conn->options.overflow) {
+		case HIDSOCKET_OVERFLOW_DROP_NEWEST:
+			end = cursor + conn->options.queue_size;
+			dropped_newest = excess;
+			break;
+		case HIDSOCKET_OVERFLOW_KEEP_LATEST:
+			mark_latest(ring, cursor, head, keep);
+			keep_latest = 1;
+			break;
+		case HIDSOCKET_OVERFLOW_BLOCK: // overflows only when queue size is reduced
+		case HIDSOCKET_OVERFLOW_DROP_OLDEST:
+		default:
+			cursor += excess;
+			dropped += excess;
+			break;
+		}
+	}
+	if (aggregating) aggregate_input(conn, cursor, end, keep); // reports of each report ID are folded into the latest one
+
+	for (seq = cursor; seq != end; seq++) {
+		size_t size, size_out;
+		const uint8_t *record = bc_ring_peek(ring, seq, &size);
+		const uint8_t *report;
+		uint8_t rid = 0;
+		int delta_len = -1;
+		int envelope = 0;
+		if (!record) {
+			dropped++; // overwritten while reading
+			continue;
+		}
+		if (!HIDSOCKET_HAS_REPORT_ID(conn->options.report_ids, record[HIDSOCKET_RECORD_HEADER_SIZE])) continue; // before any copy
+		if ((keep_latest || aggregating) && !keep[seq - cursor]) {
+			if (aggregating) {
+				if (out) conn->stats.aggregated++; // values of it are in the latest report of the same ID
+			} else {
+				dropped++; // a later report of the same ID is pending
+			}
+			continue;
+		}
+		if (history || summing) {
+			// report is compared with ones sent before (or summed fields are put into it),
+			// so it is taken out not to be overwritten meanwhile
+			memcpy(copy, record, size);
+			if (!bc_ring_is_valid(ring, seq)) {
+				dropped++;
+				continue;
+			}
+			if (summing && format != HIDSOCKET_FORMAT_FIELDS) put_sums(sel, copy + HIDSOCKET_RECORD_HEADER_SIZE, size - HIDSOCKET_RECORD_HEADER_SIZE);
+			record = copy;
 		}
-		else {
-			WEBHID_TRACE("failed to create thread");
-			// ERROR!
-			destroy_connection(conn);
-			conn = 0;
+		report = record + HIDSOCKET_RECORD_HEADER_SIZE;
+		size -= HIDSOCKET_RECORD_HEADER_SIZE;
+		if (conn->options.changes_only && report_cache_is_same(history->sent, report, size)) {
+			if (out) conn->stats.unchanged++;
+			continue;
 		}
-	}
-	return conn;
-}
-
-int webhid_connect(struct mg_connection *nc, struct http_message *hm) 
-{
-	hid_device *dev = open_hid_virtual_path(&hm->uri);
-	if (dev)
-	{
-		if (search_connection_node(nc)) {
-			// already exists
-			hid_close(dev);
-		} else { // no connection registered in list was found
-			uint8_t rid = (uint8_t) strtol(hm->uri.p+HID_VIRTUAL_PATH_LENGTH, NULL, 0); 
-			struct hidsocket_connection* conn = init_connection(nc, dev, rid);
-			bdl_list_node_t node_new =
-				conn? bdl_list_append_node(hidsocket_connections_list, conn): 0;
-			if (node_new) {
-				// succeeded registeration
-				return 1;
+		if (format == HIDSOCKET_FORMAT_FIELDS) {
+			if (!sel) continue; // report descriptor is being fetched
+			if (sel->uses_report_id) rid = report[0];
+			if (sel->count[rid] == 0) continue; // nothing of it is wanted
+			envelope = aggregating && conn->options.aggregate == HIDSOCKET_AGGREGATE_ENVELOPE && HIDSOCKET_HAS_REPORT_ID(sel->aggregated, rid);
+			size_out = (envelope? 2: 1) * (sizeof(struct hidsocket_fields_report) + sel->count[rid] * sizeof(int32_t));
+		} else if (format == HIDSOCKET_FORMAT_DELTA) {
+			delta_len = encode_delta(history, conn->options.keyframe, report, size, delta);
+			size_out = sizeof(struct hidsocket_delta_report) + (delta_len >= 0? (size_t) delta_len: size);
+		} else {
+			size_out = size_prefix + size;
+		}
+		if (limit && total + size_out > limit) break;
+
+		if (out) {
+			size_t mark = out->len;
+			if (format == HIDSOCKET_FORMAT_FIELDS) {
+				struct hidsocket_fields_report prefix;
+				int summed = summing && HIDSOCKET_HAS_REPORT_ID(sel->aggregated, rid);
+				int i;
+				prefix.sequence = seq;
+				prefix.report_id = rid;
+				prefix.count = sel->count[rid];
+				memcpy(&prefix.timestamp_us, record, sizeof(prefix.timestamp_us));
+				for (prefix.kind = envelope? HIDSOCKET_FIELDS_MIN: HIDSOCKET_FIELDS_VALUE;
+					prefix.kind <= (envelope? HIDSOCKET_FIELDS_MAX: HIDSOCKET_FIELDS_VALUE); prefix.kind++) {
+					mbuf_append(out, &prefix, sizeof(prefix));
+					for (i = 0; i < prefix.count; i++) {
+						const struct hid_desc_field *f = sel->fields[sel->first[rid] + i];
+						const int32_t *acc = &sel->values[2 * (sel->first[rid] + i)];
+						int32_t value = 0;
+						if (prefix.kind == HIDSOCKET_FIELDS_MIN) value = acc[0];
+						else if (prefix.kind == HIDSOCKET_FIELDS_MAX) value = acc[1];
+						else if (summed && (f->flags & HID_DESC_FIELD_RELATIVE)) value = acc[0];
+						else hid_desc_extract(f, report, size, &value);
+						mbuf_append(out, &value, sizeof(value));
+					}
+				}
+			} else if (format == HIDSOCKET_FORMAT_DELTA) {
+				struct hidsocket_delta_report prefix;
+				prefix.sequence = seq;
+				prefix.report_id = size? report[0]: 0;
+				prefix.kind = (delta_len >= 0)? HIDSOCKET_DELTA_XOR: HIDSOCKET_DELTA_KEY;
+				prefix.length = (uint16_t) (delta_len >= 0? (size_t) delta_len: size);
+				memcpy(&prefix.timestamp_us, record, sizeof(prefix.timestamp_us));
+				mbuf_append(out, &prefix, sizeof(prefix));
+				mbuf_append(out, delta_len >= 0? delta: report, prefix.length);
+			} else if (format == HIDSOCKET_FORMAT_BATCH) {
+				struct hidsocket_batch_report prefix;
+				prefix.sequence = seq;
+				prefix.length = (uint32_t) size;
+				memcpy(&prefix.timestamp_us, record, sizeof(prefix.timestamp_us));
+				mbuf_append(out, &prefix, sizeof(prefix));
 			} else {
-				// fail
-				WEBHID_TRACE("list node was not created");
+				uint32_t len = (uint32_t) size;
+				mbuf_append(out, &len, sizeof(len));
+			}
+			if (format == HIDSOCKET_FORMAT_LEGACY || format == HIDSOCKET_FORMAT_BATCH) mbuf_append(out, report, size);
+			if (record != copy && !bc_ring_is_valid(ring, seq)) {
+				out->len = mark; // overwritten while copying
+				dropped++;
+				continue;
+			}
+			if (history && report_cache_store(history->sent, report, size) && size) {
+				history->since_key[report[0]] = (delta_len >= 0)? history->since_key[report[0]] + 1: 0;
 			}
 		}
-	} else {
-		WEBHID_TRACE("virtual path could not be opened");
+		total += size_out;
+		num += envelope? 2: 1;
 	}
-	return 0;
+
+	if (out) {
+		if (seq == end) {
+			// every report kept was read, so ones dropped by drop-newest policy are gone as well
+			seq = head;
+			dropped += dropped_newest;
+		}
+		conn->cursor = seq;
+		conn->num_dropped += dropped;
+		conn->stats.dropped += dropped;
+		conn->stats.reports_sent += num;
+		hidsocket_num_dropped += dropped;
+		if (conn->options.overflow == HIDSOCKET_OVERFLOW_BLOCK) update_flow_control(conn->device);
+	}
+
+	return out? num: (int) total;
 }
 
-int webhid_exists(struct mg_connection *nc)
+/**
+ *  Tell result of an output report by a text frame, e.g. {"ack": 1, "result": 8, "latencyUs": 120}
+ *  ack is the number of the report on the connection (from 1), latency is from receiving it to hid_write returning
+ */
+static void send_ack(struct hidsocket_connection *conn, uint32_t seq, int result, uint64_t latency_us)
 {
-	bdl_list_node_t node = search_connection_node(nc);
-	return (node != 0);
+	mg_printf_websocket_frame(conn->connection, WEBSOCKET_OP_TEXT, "{\"ack\": %u, \"result\": %d, \"latencyUs\": %llu}",
+		seq, result, (unsigned long long) latency_us);
 }
 
-void webhid_disconnect(struct mg_connection *nc)
+/**
+ *  Queue an output report to be set by a thread of hid_request module, so a slow HID never blocks mongoose thread
+ *  It returns length of the report queued; -1 when it could not be queued
+ */
+static int write_output(struct hidsocket_connection *conn, const uint8_t *buffer, size_t length)
 {
-	bdl_list_node_t node = search_connection_node(nc);
-	WEBHID_TRACE("webhid_disconnect() called");
-	if (node) {
-		struct hidsocket_connection *conn;
-		conn = (struct hidsocket_connection *)bdl_list_delete_node(hidsocket_connections_list, node);
-		if (conn) destroy_connection(conn);
-		else WEBHID_TRACE("node had no content");
-	} else {
-		WEBHID_TRACE("connection is not found");
-		///TODO: handle error..
-	}
+	uint32_t seq = ++conn->num_outputs;
+	struct rest_request *req = 0;
+	hid_pool_entry_t entry = 0;
+
+	if (length == 0 || length > sizeof(req->request.data)) goto ERROR;
+	req = (struct rest_request *) malloc(sizeof(struct rest_request));
+	if (!req) goto ERROR;
+	// another reference of the handle read by the device, kept until the report is set
+	entry = conn->device->entry;
+	hid_pool_retain(entry);
+	req->request.kind = HID_REQUEST_SET_OUTPUT;
+	req->request.handle = entry;
+	strncpy(req->request.path, hid_pool_get_path(entry), sizeof(req->request.path) - 1); // probed when the report fails
+	req->request.path[sizeof(req->request.path) - 1] = '\0';
+	req->request.timeout_ms = 0;
+	memcpy(req->request.data, buffer, length);
+	req->request.length = length;
+	req->request.ctx = 0;
+	req->connection = 0;
+	req->output_of = conn;
+	req->seq = seq;
+	req->internal = 0;
+	if (submit_request(req, entry)) return (int) length;
+
+ERROR:
+	WEBHID_TRACE("output report is not queued");
+	free(req);
+	if (entry) hid_pool_release(entry);
+	conn->stats.output_errors++;
+	if (conn->options.ack) send_ack(conn, seq, -1, 0);
+	return -1;
 }
 
+/**
+ *  Tell the result of an output report set to the connection, when it asks acks
+ */
+static void complete_output(struct hidsocket_connection *conn, uint32_t seq, const struct hid_request *r)
+{
+	conn->stats.output_writes++;
+	if (r->result < 0) conn->stats.output_errors++;
+	if (conn->options.ack) send_ack(conn, seq, r->result, r->completed_us - r->submitted_us);
+}
+
+
 int webhid_read_input(struct mg_connection *nc, uint8_t *buffer, size_t length)
 {
 	struct hidsocket_connection *conn = search_connection(nc);
 	int ret;
 	if (conn) {
-		pthread_mutex_lock(&conn->mtx);
-		ret = vl_queue_pop_all(conn->queue_input, buffer, length);
-		pthread_mutex_unlock(&conn->mtx);
+		if (buffer && length) {
+			// reports are copied straight into buffer, which is never grown since they are limited to its length
+			struct mbuf out;
+			out.buf = (char *) buffer;
+			out.size = length;
+			out.len = 0;
+			read_input(conn, HIDSOCKET_FORMAT_LEGACY, &out, length);
+			ret = (int) out.len;
+		} else {
+			ret = read_input(conn, HIDSOCKET_FORMAT_LEGACY, 0, 0);
+		}
 	} else {
 		WEBHID_TRACE("connection is not found");
 		ret = -1;
@@ -500,9 +2256,7 @@ int webhid_write_output(struct mg_connection *nc, const uint8_t *buffer, size_t
 	struct hidsocket_connection *conn = search_connection(nc);
 	int ret;
 	if (conn) {
-		pthread_mutex_lock(&conn->mtx);
-		ret = hid_write(conn->device, buffer, length);
-		pthread_mutex_unlock(&conn->mtx);
+		ret = write_output(conn, buffer, length);
 	} else {
 		WEBHID_TRACE("connection is not found");
 		ret = -1;
@@ -510,32 +2264,212 @@ int webhid_write_output(struct mg_connection *nc, const uint8_t *buffer, size_t
 	return ret;
 }
 
+/**
+ *  Reserve WebSocket header of a frame at the end of send buffer
+ *  Payload of a frame from server is never masked, and is limited to fit in 4 bytes header
+ */
+static size_t begin_frame(struct mbuf *out) {
+	size_t mark = out->len;
+	mbuf_append(out, 0, HIDSOCKET_FRAME_HEADER_MAX);
+	return mark;
+}
+
+/**
+ *  Fill WebSocket header reserved by begin_frame, as mg_send_websocket_frame would
+ *  A short payload is moved back by 2 bytes, since its header takes only 2 bytes
+ *  It returns size of the payload
+ */
+static size_t end_frame(struct mg_connection *nc, size_t mark, int compressed) {
+	uint8_t *header = (uint8_t *) nc->send_mbuf.buf + mark;
+	size_t len = nc->send_mbuf.len - mark - HIDSOCKET_FRAME_HEADER_MAX;
+
+	header[0] = 0x80 | (compressed? 0x40: 0) | WEBSOCKET_OP_BINARY; // FIN, and RSV1 for permessage-deflate
+	if (len < 126) {
+		header[1] = (uint8_t) len;
+		memmove(header + 2, header + HIDSOCKET_FRAME_HEADER_MAX, len);
+		nc->send_mbuf.len -= HIDSOCKET_FRAME_HEADER_MAX - 2;
+	} else {
+		header[1] = 126;
+		header[2] = (uint8_t)(len >> 8);
+		header[3] = (uint8_t)(len & 0xff);
+	}
+	nc->last_io_time = (time_t) mg_time();
+	return len;
+}
+
+/**
+ *  Compress payload of a frame at the end of send buffer, when permessage-deflate is accepted and it is large enough
+ *  It returns 1 when the payload is compressed
+ */
+static int compress_frame(struct hidsocket_connection *conn, size_t payload)
+{
+	struct mbuf *out = &conn->connection->send_mbuf;
+	size_t len = out->len - payload, size;
+
+	if (!conn->deflate || conn->options.deflate_threshold < 0 || len < (size_t) conn->options.deflate_threshold) return 0;
+	if (hidsocket_deflate_buf_size < ws_deflate_bound(len)) {
+		uint8_t *buf = (uint8_t *) realloc(hidsocket_deflate_buf, ws_deflate_bound(len));
+		if (!buf) return 0;
+		hidsocket_deflate_buf = buf;
+		hidsocket_deflate_buf_size = ws_deflate_bound(len);
+	}
+	size = ws_deflate_compress(conn->deflate, (const uint8_t *) out->buf + payload, len, hidsocket_deflate_buf);
+	if (size == 0) return 0; // not compressible
+	memcpy(out->buf + payload, hidsocket_deflate_buf, size);
+	out->len = payload + size;
+	conn->stats.deflate_saved += len - size;
+	return 1;
+}
+
+/**
+ *  Send reports held for the connection in a frame
+ *  Reports are serialized straight into send buffer of the connection behind the headers reserved,
+ *  so neither intermediate buffer nor copy is needed
+ *  When no report is held, an empty frame is sent only if send_empty is true
+ *  It returns number of reports sent
+ */
+static int send_input_frame(struct hidsocket_connection *conn, int send_empty)
+{
+	struct mg_connection *nc = conn->connection;
+	struct mbuf *out = &nc->send_mbuf;
+	size_t mark = begin_frame(out);
+	size_t payload = mark + HIDSOCKET_FRAME_HEADER_MAX;
+	int num;
+
+	if (conn->options.format != HIDSOCKET_FORMAT_LEGACY) {
+		struct hidsocket_batch_header header;
+		mbuf_append(out, 0, sizeof(header)); // reserved, filled after reports are read
+		num = read_input(conn, conn->options.format, out, HIDSOCKET_FRAME_PAYLOAD_MAX - sizeof(header));
+		if (num > 0 || send_empty) {
+			header.version = HIDSOCKET_BATCH_VERSION;
+			header.header_size = (uint8_t) sizeof(header);
+			header.count = (uint16_t) num;
+			header.dropped = conn->num_dropped - conn->num_dropped_sent;
+			header.sent_us = hr_clock_get_us();
+			memcpy(out->buf + payload, &header, sizeof(header));
+			conn->num_dropped_sent = conn->num_dropped;
+		}
+	} else {
+		num = read_input(conn, HIDSOCKET_FORMAT_LEGACY, out, HIDSOCKET_FRAME_PAYLOAD_MAX);
+		if (num == 0 && send_empty) {
+			const uint32_t zero = 0;
+			mbuf_append(out, &zero, sizeof(uint32_t));
+		}
+	}
+
+	if (num > 0 || send_empty) {
+		conn->stats.frames_sent++;
+		conn->stats.bytes_sent += end_frame(nc, mark, compress_frame(conn, payload));
+	} else {
+		out->len = mark; // nothing to send, drop the headers reserved
+	}
+	return num;
+}
+
+/**
+ *  Send reports held for a push mode connection unless its socket is congested
+ *  Reports left are sent on MG_EV_SEND (see webhid_handle_sent), dropped by overflow policy meanwhile
+ *  While "hz=" is given, a frame sent too early is deferred to the timer of wakeup connection
+ */
+static int push_input(struct hidsocket_connection *conn)
+{
+	uint64_t now_us;
+	int num;
+
+	if (conn->connection->send_mbuf.len >= HIDSOCKET_SEND_BACKLOG_MAX) return 0;
+	if (conn->options.hz <= 0) return send_input_frame(conn, 0);
+
+	// rate limited: reports are aggregated until the next frame is allowed
+	now_us = hr_clock_get_us();
+	if (now_us < conn->next_frame_us) {
+		conn->deferred = 1;
+		if (wakeup_connection) {
+			double t = mg_time() + (conn->next_frame_us - now_us) / 1e6;
+			if (t < wakeup_connection->ev_timer_time) wakeup_connection->ev_timer_time = t;
+		}
+		return 0;
+	}
+	num = send_input_frame(conn, 0);
+	if (num > 0) conn->next_frame_us = now_us + 1000000 / conn->options.hz;
+	return num;
+}
+
+int webhid_handle_sent(struct mg_connection *nc)
+{
+	struct hidsocket_connection *conn = search_connection(nc);
+	if (conn && conn->options.push) {
+		push_input(conn);
+		return 1;
+	}
+	return 0;
+}
+
 int webhid_handle_frame(struct mg_connection *nc, struct websocket_message *wm)
 {
 	struct hidsocket_connection *conn = search_connection(nc);
 	WEBHID_TRACE("webhid_handle_frame() called");
 	if (conn) {
 		uint8_t opcode = (wm->flags & 0x0f);
-		uint8_t *data;
-		int len;
-		if (opcode == WEBSOCKET_OP_BINARY && wm->size > 0) {
-			webhid_write_output(nc, wm->data, wm->size);
-		} 
-		// Poll Input Report in every frame received
-		len = webhid_read_input(nc, 0, 0);
-		if (len > 0) {
-			data = (uint8_t *)malloc(len);
-			if (data) {
-				int len2  = webhid_read_input(nc, data, len);
-				WEBHID_ASSERT(len == len2);
-				mg_send_websocket_frame(nc, WEBSOCKET_OP_BINARY, data, len);
-				free(data);
-			} else {
-				WEBHID_TRACE("failed to allocate memory buffer for input report");
+		int is_output = (opcode == WEBSOCKET_OP_BINARY && wm->size > 0);
+		struct websocket_message inflated;
+		uint8_t data[HIDSOCKET_INFLATE_MAX];
+		if (conn->deflate && (wm->flags & 0x40)) {
+			// RSV1: message compressed by client
+			int len = ws_deflate_inflate(wm->data, wm->size, data, sizeof(data));
+			if (len < 0) {
+				WEBHID_TRACE("failed to decompress message");
+				nc->flags |= MG_F_SEND_AND_CLOSE;
+				return 0;
+			}
+			inflated = *wm;
+			inflated.data = data;
+			inflated.size = (size_t) len;
+			wm = &inflated;
+			is_output = (opcode == WEBSOCKET_OP_BINARY && wm->size > 0);
+		}
+		if (is_output) {
+			write_output(conn, wm->data, wm->size);
+		} else if (opcode == WEBSOCKET_OP_TEXT && !conn->options.push) {
+			// options could be given by a text frame (e.g. "mode=push&latency=2") instead of query string
+			struct mg_str params;
+			int format = conn->options.format;
+			int found;
+			params.p = (const char *)wm->data;
+			params.len = wm->size;
+			found = parse_options(&params, &conn->options);
+			if (needs_selection(&conn->options) && !select_fields(conn)) {
+				WEBHID_TRACE("report descriptor is not available");
+				conn->options.format = format;
+				conn->options.aggregate = HIDSOCKET_AGGREGATE_LATEST;
+			}
+			if (found && !update_history(conn)) {
+				WEBHID_TRACE("failed to allocate memory");
+				conn->options.changes_only = 0;
+				if (conn->options.format == HIDSOCKET_FORMAT_DELTA) conn->options.format = format;
+				update_history(conn);
+			}
+			if (found && conn->options.push) {
+				WEBHID_TRACE("switched to push mode");
+				conn->waiting_input = 0;
+				update_coalescing(conn->device);
+				update_flow_control(conn->device);
+				push_input(conn);
+				return 1;
 			}
+			if (found) update_coalescing(conn->device); // "changes=only" may be changed
+		}
+
+		if (conn->options.push) {
+			// input reports are sent by wakeup channel, never polled
+		} else if (!conn->options.wait) {
+			// Poll Input Report in every frame received, an empty frame when none is held
+			send_input_frame(conn, 1);
+			conn->waiting_input = 0;
+		} else if (send_input_frame(conn, is_output) > 0 || is_output) {
+			conn->waiting_input = 0;
 		} else {
-			const uint32_t zero = 0;
-			mg_send_websocket_frame(nc, WEBSOCKET_OP_BINARY, &zero, sizeof(uint32_t));
+			// nothing to reply now, wakeup channel answers as soon as a report arrives
+			conn->waiting_input = 1;
 		}
 		return 1;
 	} else {
@@ -544,12 +2478,105 @@ int webhid_handle_frame(struct mg_connection *nc, struct websocket_message *wm)
 	}
 }
 
+/**
+ *  Accept the first offer of permessage-deflate (RFC 7692) in Sec-WebSocket-Extensions
+ *  client_no_context_takeover is always answered, since messages from client are decompressed without window
+ *  It returns 1 when accepted, with the extension of response written into ext
+ */
+static int accept_deflate(struct hidsocket_connection *conn, const struct mg_str *offers, char *ext, size_t size_ext)
+{
+	const char *p = offers->p, *end = offers->p + offers->len;
+
+	while (p < end) {
+		const char *next = (const char *) memchr(p, ',', end - p);
+		const char *q = p;
+		int first = 1, valid = 1, no_context_takeover = 0, window_bits = 0;
+		if (!next) next = end;
+
+		while (q < next && valid) {
+			// "permessage-deflate; server_no_context_takeover; server_max_window_bits=10"
+			const char *e = (const char *) memchr(q, ';', next - q);
+			const char *t;
+			size_t len;
+			if (!e) e = next;
+			while (q < e && (*q == ' ' || *q == '\t')) q++;
+			for (t = e; t > q && (t[-1] == ' ' || t[-1] == '\t'); t--);
+			len = t - q;
+			if (first) {
+				valid = (len == 18 && memcmp(q, "permessage-deflate", 18) == 0);
+				first = 0;
+			} else if (len == 26 && memcmp(q, "server_no_context_takeover", 26) == 0) {
+				no_context_takeover = 1;
+			} else if (len == 26 && memcmp(q, "client_no_context_takeover", 26) == 0) {
+				// answered anyway
+			} else if (len >= 22 && memcmp(q, "client_max_window_bits", 22) == 0) {
+				// window of client is not limited, it is not kept by server
+			} else if (len > 23 && memcmp(q, "server_max_window_bits=", 23) == 0) {
+				window_bits = (int) strtol(q + 23 + (q[23] == '"'), NULL, 10);
+				if (window_bits < 8 || window_bits > 15) valid = 0;
+			} else {
+				valid = 0; // unknown parameter, the offer is declined
+			}
+			q = e + 1;
+		}
+
+		if (valid && !first) {
+			// the window answered is the one of context, it may be told even when client did not limit it (RFC 7692 7.1.2.1)
+			if (!window_bits || window_bits > WS_DEFLATE_WINDOW_BITS_MAX) window_bits = WS_DEFLATE_WINDOW_BITS_MAX;
+			conn->deflate = ws_deflate_create(window_bits, no_context_takeover);
+			if (!conn->deflate) return 0;
+			_snprintf_s(ext, size_ext, size_ext/sizeof(char), "permessage-deflate; client_no_context_takeover%s; server_max_window_bits=%d",
+				no_context_takeover? "; server_no_context_takeover": "", window_bits);
+			return 1;
+		}
+		p = next + 1;
+	}
+	return 0;
+}
+
+/**
+ *  Send handshake response with Sec-WebSocket-Extensions, as mg_ws_handshake would without it
+ *  mongoose does not send its own response when the handler of handshake request has sent one
+ */
+static void send_handshake(struct mg_connection *nc, struct http_message *hm, const char *ext)
+{
+	static const char *magic = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+	struct mg_str *key = mg_get_http_header(hm, "Sec-WebSocket-Key");
+	struct mg_str *protocol = mg_get_http_header(hm, "Sec-WebSocket-Protocol");
+	cs_sha1_ctx sha;
+	unsigned char digest[20];
+	char accept[32];
+
+	cs_sha1_init(&sha);
+	cs_sha1_update(&sha, (const unsigned char *) key->p, (uint32_t) key->len);
+	cs_sha1_update(&sha, (const unsigned char *) magic, (uint32_t) strlen(magic));
+	cs_sha1_final(digest, &sha);
+	mg_base64_encode(digest, sizeof(digest), accept);
+
+	mg_printf(nc, "%s", "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n");
+	if (protocol) {
+		int len = 0;
+		while ((size_t) len < protocol->len && protocol->p[len] != ',') len++; // the first one is chosen
+		mg_printf(nc, "Sec-WebSocket-Protocol: %.*s\r\n", len, protocol->p);
+	}
+	mg_printf(nc, "Sec-WebSocket-Extensions: %s\r\nSec-WebSocket-Accept: %s\r\n\r\n", ext, accept);
+}
+
 int webhid_handshake(struct mg_connection *nc, struct http_message *hm)
 {
 	WEBHID_TRACE("webhid_handshake() called");
+	if (refuse_pipelined(nc)) return 0;
 	if (uri_is_virtual_path(hm->uri.p)) {
 		if (webhid_connect(nc, hm)) {
+			struct hidsocket_connection *conn = search_connection(nc);
+			struct mg_str *offers = mg_get_http_header(hm, "Sec-WebSocket-Extensions");
+			char ext[128];
 			WEBHID_TRACE("WebSocket and HID were connected");
+			if (offers && mg_get_http_header(hm, "Sec-WebSocket-Key") && conn->options.deflate_threshold >= 0 &&
+				accept_deflate(conn, offers, ext, sizeof(ext))) {
+				WEBHID_TRACE("permessage-deflate was accepted");
+				send_handshake(nc, hm, ext);
+			}
 			return 1;
 		}
 	}		
@@ -570,9 +2597,509 @@ int webhid_control(struct mg_connection *nc, struct websocket_message *wm)
 	return 0;
 }
 
+/// Statistics
+/// Both formats are made from the same tables of counters
+
+struct hidsocket_stat_field {
+	const char *json_name;
+	const char *metric_name; /// Prometheus
+	const char *metric_type;
+	const char *help;
+	size_t offset; /// of uint64_t in stats struct
+};
+
+static const struct hidsocket_stat_field device_stat_fields[] = {
+	{ "reportsRead", "webhid_device_reports_read_total", "counter", "Input reports read from HID IF", offsetof(struct hidsocket_device_stats, reports_read) },
+	{ "bytesRead", "webhid_device_bytes_read_total", "counter", "Bytes of input reports read from HID IF", offsetof(struct hidsocket_device_stats, bytes_read) },
+	{ "readErrors", "webhid_device_read_errors_total", "counter", "Failed hid_read calls", offsetof(struct hidsocket_device_stats, read_errors) },
+	{ "loopIterations", "webhid_device_loop_iterations_total", "counter", "Services of the HID IF by its reader", offsetof(struct hidsocket_device_stats, loop_iterations) },
+	{ "blockedLoops", "webhid_device_blocked_loops_total", "counter", "Iterations waiting for a subscriber with block policy", offsetof(struct hidsocket_device_stats, blocked_loops) },
+	{ "reportsUnchanged", "webhid_device_reports_unchanged_total", "counter", "Input reports not stored since unchanged and every subscriber asks changes only", offsetof(struct hidsocket_device_stats, reports_unchanged) },
+	{ "reportsUnsubscribed", "webhid_device_reports_unsubscribed_total", "counter", "Input reports not stored since no subscriber asks their report ID", offsetof(struct hidsocket_device_stats, reports_unsubscribed) },
+};
+
+static const struct hidsocket_stat_field connection_stat_fields[] = {
+	{ "reportsSent", "webhid_connection_reports_sent_total", "counter", "Input reports forwarded to WebSocket", offsetof(struct hidsocket_connection_stats, reports_sent) },
+	{ "bytesSent", "webhid_connection_bytes_sent_total", "counter", "Bytes of input frames sent to WebSocket", offsetof(struct hidsocket_connection_stats, bytes_sent) },
+	{ "framesSent", "webhid_connection_frames_sent_total", "counter", "Input frames sent to WebSocket", offsetof(struct hidsocket_connection_stats, frames_sent) },
+	{ "queueDepth", "webhid_connection_queue_depth", "gauge", "Input reports pending", offsetof(struct hidsocket_connection_stats, queue_depth) },
+	{ "queueHighWater", "webhid_connection_queue_high_water", "gauge", "Most input reports pending at once", offsetof(struct hidsocket_connection_stats, queue_high_water) },
+	{ "dropped", "webhid_connection_dropped_total", "counter", "Input reports dropped by overflow", offsetof(struct hidsocket_connection_stats, dropped) },
+	{ "unchanged", "webhid_connection_unchanged_total", "counter", "Input reports not sent since unchanged from the previous one", offsetof(struct hidsocket_connection_stats, unchanged) },
+	{ "aggregated", "webhid_connection_aggregated_total", "counter", "Input reports folded into later ones by rate limit", offsetof(struct hidsocket_connection_stats, aggregated) },
+	{ "deflateSaved", "webhid_connection_deflate_saved_bytes_total", "counter", "Bytes of input frames saved by permessage-deflate", offsetof(struct hidsocket_connection_stats, deflate_saved) },
+	{ "outputWrites", "webhid_connection_output_writes_total", "counter", "Output reports written to HID IF", offsetof(struct hidsocket_connection_stats, output_writes) },
+	{ "outputErrors", "webhid_connection_output_errors_total", "counter", "Failed hid_write calls and output reports not queued", offsetof(struct hidsocket_connection_stats, output_errors) },
+};
+
+#define STAT_FIELD_VALUE(stats, field)	(*(const uint64_t *)((const uint8_t *)(stats) + (field)->offset))
+#define NUMOF_STAT_FIELDS(fields)	(sizeof(fields) / sizeof(fields[0]))
+
+static void format_virtual_path(char *buf, size_t size_buf, const struct hid_index_key *key)
+{
+	_snprintf_s(buf, size_buf, size_buf/sizeof(char), HID_VIRTUAL_PATH_FORMAT,
+		key->interface_number, key->vendor_id, key->product_id, key->usage_page, key->usage);
+}
+
+/**
+ *  Format a set of report IDs as a list of them and ranges (e.g. "1,3,8-10"), or "all"
+ */
+static void format_report_ids(char *buf, size_t size_buf, const uint32_t *mask)
+{
+	size_t len = 0;
+	int id = 1, last;
+
+	if (HIDSOCKET_HAS_REPORT_ID(mask, 0)) {
+		_snprintf_s(buf, size_buf, size_buf/sizeof(char), "all");
+		return;
+	}
+	buf[0] = '\0';
+	while (id < 256) {
+		if (!HIDSOCKET_HAS_REPORT_ID(mask, id)) {
+			id++;
+			continue;
+		}
+		for (last = id; last < 255 && HIDSOCKET_HAS_REPORT_ID(mask, last + 1); last++);
+		if (len + 9 > size_buf) break; // ",255-255" does not fit
+		len += _snprintf_s(buf + len, size_buf - len, (size_buf - len)/sizeof(char), (last > id)? "%s%d-%d": "%s%d", len? ",": "", id, last);
+		id = last + 1;
+	}
+}
+
+static void snapshot_connection(const struct hidsocket_connection *conn, struct hidsocket_connection_stats *stats)
+{
+	uint32_t depth = bc_ring_get_head(conn->device->ring_input) - conn->cursor;
+	*stats = conn->stats;
+	stats->queue_depth = (depth <= HIDSOCKET_INPUT_RING_SLOTS)? depth: HIDSOCKET_INPUT_RING_SLOTS;
+}
+
+static void send_stats_json(struct mg_connection *nc)
+{
+	bdl_list_node_t node;
+	const char *sep = "";
+	size_t i;
+
+	mg_printf(nc, "%s", "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nTransfer-Encoding: chunked\r\n\r\n");
+	mg_printf_http_chunk(nc, "{\"numofConnections\": %d, \"numofHandles\": %d, \"dropped\": %u, "
+		"\"restRunning\": %d, \"restCompleted\": %llu, \"restFailed\": %llu, \"devices\": [",
+		webhid_get_numof_connection(), hid_pool_get_numof_handles(), hidsocket_num_dropped,
+		bdl_list_get_size(rest_requests_list), (unsigned long long) rest_num_completed, (unsigned long long) rest_num_failed);
+
+	for (node = bdl_list_get_head(hidsocket_devices_list); node; node = bdl_list_get_next(hidsocket_devices_list, node)) {
+		const struct hidsocket_device *hd = (const struct hidsocket_device *)bdl_list_extract_content(node);
+		struct hidsocket_device_stats stats = hd->stats;
+		char path[HID_VIRTUAL_PATH_LENGTH + 2];
+		format_virtual_path(path, sizeof(path), hid_pool_get_key(hd->entry));
+		mg_printf_http_chunk(nc, "%s{\"virtualPath\": \"%s\", \"numofSubscribers\": %d", sep, path, bdl_list_get_size(hd->subscribers));
+		for (i = 0; i < NUMOF_STAT_FIELDS(device_stat_fields); i++) {
+			mg_printf_http_chunk(nc, ", \"%s\": %llu", device_stat_fields[i].json_name,
+				(unsigned long long) STAT_FIELD_VALUE(&stats, &device_stat_fields[i]));
+		}
+		mg_printf_http_chunk(nc, "}");
+		sep = ", ";
+	}
+
+	mg_printf_http_chunk(nc, "], \"connections\": [");
+	sep = "";
+	for (node = bdl_list_get_head(hidsocket_connections_list); node; node = bdl_list_get_next(hidsocket_connections_list, node)) {
+		const struct hidsocket_connection *conn = (const struct hidsocket_connection *)bdl_list_extract_content(node);
+		struct hidsocket_connection_stats stats;
+		char path[HID_VIRTUAL_PATH_LENGTH + 2];
+		char report_ids[4 * 256]; // enough for any set
+		snapshot_connection(conn, &stats);
+		format_virtual_path(path, sizeof(path), hid_pool_get_key(conn->device->entry));
+		format_report_ids(report_ids, sizeof(report_ids), conn->options.report_ids);
+		mg_printf_http_chunk(nc, "%s{\"id\": %u, \"virtualPath\": \"%s\", \"reportIds\": \"%s\", \"mode\": \"%s\"",
+			sep, conn->id, path, report_ids, conn->options.push? "push": conn->options.wait? "wait": "poll");
+		for (i = 0; i < NUMOF_STAT_FIELDS(connection_stat_fields); i++) {
+			mg_printf_http_chunk(nc, ", \"%s\": %llu", connection_stat_fields[i].json_name,
+				(unsigned long long) STAT_FIELD_VALUE(&stats, &connection_stat_fields[i]));
+		}
+		mg_printf_http_chunk(nc, "}");
+		sep = ", ";
+	}
+	mg_printf_http_chunk(nc, "] }");
+	mg_send_http_chunk(nc, "", 0);  /* Send empty chunk, the end of response */
+}
+
+static void send_stats_prometheus(struct mg_connection *nc)
+{
+	bdl_list_node_t node;
+	size_t i;
+
+	mg_printf(nc, "%s", "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nTransfer-Encoding: chunked\r\n\r\n");
+	mg_printf_http_chunk(nc,
+		"# HELP webhid_connections WebSocket-HID connections alive\n# TYPE webhid_connections gauge\nwebhid_connections %d\n"
+		"# HELP webhid_handles HID handles held open\n# TYPE webhid_handles gauge\nwebhid_handles %d\n"
+		"# HELP webhid_dropped_total Input reports dropped over all connections\n# TYPE webhid_dropped_total counter\nwebhid_dropped_total %u\n"
+		"# HELP webhid_rest_running REST requests of HID reports running\n# TYPE webhid_rest_running gauge\nwebhid_rest_running %d\n"
+		"# HELP webhid_rest_completed_total REST requests of HID reports completed\n# TYPE webhid_rest_completed_total counter\nwebhid_rest_completed_total %llu\n"
+		"# HELP webhid_rest_failed_total REST requests of HID reports failed\n# TYPE webhid_rest_failed_total counter\nwebhid_rest_failed_total %llu\n",
+		webhid_get_numof_connection(), hid_pool_get_numof_handles(), hidsocket_num_dropped,
+		bdl_list_get_size(rest_requests_list), (unsigned long long) rest_num_completed, (unsigned long long) rest_num_failed);
+
+	// samples are grouped by metric
+	for (i = 0; i < NUMOF_STAT_FIELDS(device_stat_fields); i++) {
+		const struct hidsocket_stat_field *f = &device_stat_fields[i];
+		mg_printf_http_chunk(nc, "# HELP %s %s\n# TYPE %s %s\n", f->metric_name, f->help, f->metric_name, f->metric_type);
+		for (node = bdl_list_get_head(hidsocket_devices_list); node; node = bdl_list_get_next(hidsocket_devices_list, node)) {
+			const struct hidsocket_device *hd = (const struct hidsocket_device *)bdl_list_extract_content(node);
+			char path[HID_VIRTUAL_PATH_LENGTH + 2];
+			format_virtual_path(path, sizeof(path), hid_pool_get_key(hd->entry));
+			mg_printf_http_chunk(nc, "%s{path=\"%s\"} %llu\n", f->metric_name, path,
+				(unsigned long long) STAT_FIELD_VALUE(&hd->stats, f));
+		}
+	}
+	for (i = 0; i < NUMOF_STAT_FIELDS(connection_stat_fields); i++) {
+		const struct hidsocket_stat_field *f = &connection_stat_fields[i];
+		mg_printf_http_chunk(nc, "# HELP %s %s\n# TYPE %s %s\n", f->metric_name, f->help, f->metric_name, f->metric_type);
+		for (node = bdl_list_get_head(hidsocket_connections_list); node; node = bdl_list_get_next(hidsocket_connections_list, node)) {
+			const struct hidsocket_connection *conn = (const struct hidsocket_connection *)bdl_list_extract_content(node);
+			struct hidsocket_connection_stats stats;
+			char path[HID_VIRTUAL_PATH_LENGTH + 2];
+			snapshot_connection(conn, &stats);
+			format_virtual_path(path, sizeof(path), hid_pool_get_key(conn->device->entry));
+			mg_printf_http_chunk(nc, "%s{id=\"%u\",path=\"%s\"} %llu\n", f->metric_name, conn->id, path,
+				(unsigned long long) STAT_FIELD_VALUE(&stats, f));
+		}
+	}
+	mg_send_http_chunk(nc, "", 0);  /* Send empty chunk, the end of response */
+}
+
+void webhid_stats(struct mg_connection *nc, struct http_message *hm)
+{
+	char format[16];
+	if (mg_get_http_var(&hm->query_string, "format", format, sizeof(format)) > 0 && strcmp(format, "prometheus") == 0) {
+		send_stats_prometheus(nc);
+	} else {
+		send_stats_json(nc);
+	}
+}
+
+/// Captures
+/// Every report read from a HID IF is appended to a capture log on the reading thread while it captures,
+/// and a capture keeps its HID IF read without WebSocket connections.
+/// Files of a capture are left after it stops, to be downloaded until the next capture of the HID IF starts
+
+/**
+ *  Directory of capture files by default
+ */
+#define WEBHID_CAPTURE_DIRECTORY_DEFAULT	"."
+/**
+ *  Records of a download are put into send buffer while this size of data is not sent yet,
+ *  so a long range is read from the files as the client takes it instead of being held in memory
+ */
+#define WEBHID_CAPTURE_SEND_BACKLOG_MAX	(64 * 1024)
+/**
+ *  Longest chunk of a download
+ */
+#define WEBHID_CAPTURE_CHUNK_MAX	(16 * 1024)
+/**
+ *  Bytes of prefix reserved for the name of files after the directory,
+ *  "/capture-{5 numbers of virtual path}" takes 33 of them and its terminator one
+ */
+#define WEBHID_CAPTURE_NAME_MAX	(40)
+
+struct hidsocket_capture {
+	struct hid_index_key key;
+	char prefix[CAPTURE_LOG_PREFIX_MAX];
+	capture_log_t log; /// 0 after the capture stopped
+	struct hidsocket_device *device; /// reading the HID IF while capturing, or while the log retired is appended
+	capture_log_t retired; /// log of the stopped capture, destroyed once reading thread leaves it
+	uint32_t retired_epoch; /// capture_epoch of the device when the log was retired
+	struct capture_log_info info; /// taken on stopping, and again on the retired log destroyed
+	bdl_list_node_t node;
+};
+
+static char capture_directory[CAPTURE_LOG_PREFIX_MAX - WEBHID_CAPTURE_NAME_MAX] = WEBHID_CAPTURE_DIRECTORY_DEFAULT;
+
+void webhid_set_capture_directory(const char *dir)
+{
+	if (strlen(dir) < sizeof(capture_directory)) strcpy(capture_directory, dir);
+	else WEBHID_TRACE("capture directory is too long, it is not changed");
+}
+
+static struct hidsocket_capture *search_capture(const struct hid_index_key *key)
+{
+	bdl_list_node_t node;
+	for (node = bdl_list_get_head(hidsocket_captures_list); node; node = bdl_list_get_next(hidsocket_captures_list, node)) {
+		struct hidsocket_capture *cap = (struct hidsocket_capture *)bdl_list_extract_content(node);
+		if (memcmp(&cap->key, key, sizeof(*key)) == 0) return cap;
+	}
+	return 0;
+}
+
+static void get_capture_info(const struct hidsocket_capture *cap, struct capture_log_info *info)
+{
+	if (cap->log) capture_log_get_info(cap->log, info);
+	else *info = cap->info;
+}
+
+/**
+ *  Start to capture a HID IF, files of the previous capture of it are deleted
+ *  It returns 1 on success; 0 on fail
+ */
+static int start_capture(struct hidsocket_capture *cap, size_t segment_size, uint32_t max_segments)
+{
+	struct hidsocket_device *hd = get_device(&cap->key);
+	capture_log_t log;
+
+	if (!hd) return 0;
+	capture_log_delete(cap->prefix, cap->info.first_segment, cap->info.last_segment);
+	memset(&cap->info, 0, sizeof(cap->info));
+	log = capture_log_create(cap->prefix, segment_size, max_segments);
+	if (!log) {
+		put_device(hd);
+		return 0;
+	}
+
+	atom_ptr_store_rel(&hd->capture, log);
+	cap->log = log;
+	cap->device = hd;
+	return 1;
+}
+
+/**
+ *  Destroy the log retired by a stopped capture once reading thread has left it,
+ *  force is given when reading thread of the device has stopped
+ *  It returns 1 when no log is left retired; 0 on not
+ */
+static int release_retired(struct hidsocket_capture *cap, int force)
+{
+	if (!cap->retired) return 1;
+	if (!force && atom_load_acq(&cap->device->capture_epoch) == cap->retired_epoch) return 0; // still appending
+	capture_log_get_info(cap->retired, &cap->info); // with the report appended last
+	capture_log_destroy(cap->retired);
+	cap->retired = 0;
+	cap->device = 0;
+	return 1;
+}
+
+/**
+ *  Release logs retired by stopped captures (of a device whose reading thread has stopped, if hd is given)
+ */
+static void release_retired_captures(const struct hidsocket_device *hd)
+{
+	bdl_list_node_t node;
+	if (!hidsocket_captures_list) return; // finalized, no log is retired
+	for (node = bdl_list_get_head(hidsocket_captures_list); node; node = bdl_list_get_next(hidsocket_captures_list, node)) {
+		struct hidsocket_capture *cap = (struct hidsocket_capture *)bdl_list_extract_content(node);
+		if (cap->retired && (!hd || cap->device == hd)) release_retired(cap, hd != 0);
+	}
+}
+
+/**
+ *  Stop a capture without waiting for reading thread,
+ *  the log is destroyed at once unless a report is being appended to it; otherwise it is retired to be destroyed later
+ */
+static void stop_capture(struct hidsocket_capture *cap)
+{
+	struct hidsocket_device *hd = cap->device;
+	uint32_t epoch;
+
+	if (!cap->log) return;
+	atom_ptr_exchange(&hd->capture, 0); // full barrier before the epoch is loaded
+	epoch = atom_load_acq(&hd->capture_epoch);
+	capture_log_get_info(cap->log, &cap->info);
+	cap->retired = cap->log;
+	cap->retired_epoch = epoch;
+	cap->log = 0;
+	if (!(epoch & 1)) release_retired(cap, 1); // appends from now on load no log
+	put_device(hd); // the retired log is released by finish_device if reading stops
+}
+
+static void destroy_capture_pvoid(void *cap)
+{
+	struct hidsocket_capture *c = (struct hidsocket_capture *)cap;
+	stop_capture(c); // files are left
+	while (!release_retired(c, 0)) msleep(1); // only on finalizing, a report is being appended
+	free(cap);
+}
+
+static void send_capture_json(struct mg_connection *nc, const struct hidsocket_capture *cap)
+{
+	struct capture_log_info info;
+	char path[HID_VIRTUAL_PATH_LENGTH + 2];
+
+	get_capture_info(cap, &info);
+	format_virtual_path(path, sizeof(path), &cap->key);
+	mg_printf(nc, "%s", "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nTransfer-Encoding: chunked\r\n\r\n");
+	mg_printf_http_chunk(nc, "{\"virtualPath\": \"%s\", \"capturing\": %s, \"prefix\": \"%s\", "
+		"\"firstSegment\": %u, \"lastSegment\": %u, \"records\": %u, \"lost\": %u, "
+		"\"startedUs\": %llu, \"nowUs\": %llu, \"wallClockOffsetUs\": %llu }",
+		path, cap->log? "true": "false", cap->prefix,
+		info.first_segment, info.last_segment, info.records, info.lost,
+		(unsigned long long) info.started_us, (unsigned long long) hr_clock_get_us(),
+		(unsigned long long) info.wall_clock_offset_us);
+	mg_send_http_chunk(nc, "", 0);  /* Send empty chunk, the end of response */
+}
+
+/**
+ *  Put records of a download into send buffer up to the backlog, and end the response after the last one
+ */
+static void send_capture_range(struct mg_connection *nc)
+{
+	capture_log_range_t r = (capture_log_range_t) nc->user_data;
+
+	while (r && nc->send_mbuf.len < WEBHID_CAPTURE_SEND_BACKLOG_MAX) {
+		size_t len;
+		const uint8_t *records = capture_log_read_range(r, WEBHID_CAPTURE_CHUNK_MAX, &len);
+		if (!records) {
+			mg_send_http_chunk(nc, "", 0);  /* Send empty chunk, the end of response */
+			capture_log_close_range(r);
+			nc->user_data = r = 0;
+			nc->flags |= MG_F_SEND_AND_CLOSE;
+		} else {
+			mg_send_http_chunk(nc, (const char *) records, len);
+		}
+	}
+}
+
+/**
+ *  Handler of a connection downloading records, it replaces the handler of HTTP server until the connection closes
+ */
+static void capture_download_handler(struct mg_connection *nc, int ev, void *ev_data)
+{
+	(void) ev_data;
+	if (ev == MG_EV_SEND) {
+		send_capture_range(nc);
+	} else if (ev == MG_EV_CLOSE && nc->user_data) {
+		capture_log_close_range((capture_log_range_t) nc->user_data);
+		nc->user_data = 0;
+	}
+}
+
+static int get_capture_var(struct http_message *hm, const char *name, char *buf, size_t size)
+{
+	return mg_get_http_var(&hm->query_string, name, buf, size) > 0 || mg_get_http_var(&hm->body, name, buf, size) > 0;
+}
+
+void webhid_capture(struct mg_connection *nc, struct http_message *hm)
+{
+	struct hid_index_key key;
+	struct hidsocket_capture *cap;
+	const char *cmd = hm->uri.p + HID_VIRTUAL_PATH_LENGTH + 7; /* after "capture" */
+	size_t len_cmd = hm->uri.len - HID_VIRTUAL_PATH_LENGTH - 7;
+	int is_set_request = (mg_vcmp(&hm->method, "POST") == 0 || mg_vcmp(&hm->method, "PUT") == 0);
+	int is_get_request = (!is_set_request && mg_vcmp(&hm->method, "GET") == 0);
+	char var[32];
+	char prefix[CAPTURE_LOG_PREFIX_MAX];
+
+	if (!hid_index_parse_virtual_path(hm->uri.p, hm->uri.len, &key)) {
+		send_report_error(nc, "404 Not Found", "HID virtual-path is incorrect", 0);
+		return;
+	}
+	cap = search_capture(&key);
+
+	if (is_set_request && len_cmd == 6 && memcmp(cmd, "/start", 6) == 0) {
+		size_t segment_size = 0;
+		uint32_t max_segments = 0;
+		WEBHID_TRACE("Start Capture");
+		if (cap && cap->log) {
+			send_report_error(nc, "409 Conflict", "Capture of the HID IF is running", 0);
+			return;
+		}
+		if (cap && !release_retired(cap, 0)) {
+			send_report_error(nc, "503 Service Unavailable", "Capture of the HID IF is stopping, retry", 0);
+			return;
+		}
+		if (get_capture_var(hm, "segment", var, sizeof(var))) segment_size = (size_t) strtoul(var, NULL, 0) * 1024 * 1024;
+		if (get_capture_var(hm, "segments", var, sizeof(var))) max_segments = (uint32_t) strtoul(var, NULL, 0);
+		if (!cap) {
+			int len = _snprintf_s(prefix, sizeof(prefix), _TRUNCATE, "%s/capture-%04x-%04x-%04x-%04x-%04x", capture_directory,
+				key.interface_number & 0xffff, key.vendor_id & 0xffff, key.product_id & 0xffff,
+				key.usage_page & 0xffff, key.usage & 0xffff);
+			if (len < 0 || (size_t) len >= sizeof(prefix)) { // -1 on truncation, or length wanted by C99 snprintf
+				send_report_error(nc, "500 Internal Server Error", "Fail to start capture (path of files is too long)", 0);
+				return;
+			}
+			cap = (struct hidsocket_capture *) calloc(1, sizeof(struct hidsocket_capture));
+			if (cap) cap->node = bdl_list_append_node(hidsocket_captures_list, cap);
+			if (!cap || !cap->node) {
+				free(cap);
+				send_report_error(nc, "500 Internal Server Error", "Fail to start capture", 0);
+				return;
+			}
+			cap->key = key;
+			strcpy(cap->prefix, prefix);
+		}
+		if (!start_capture(cap, segment_size, max_segments)) {
+			send_report_error(nc, "500 Internal Server Error", "Fail to start capture (HID is not found, or files cannot be created)", 0);
+			return;
+		}
+		send_capture_json(nc, cap);
+	}
+	else if (is_set_request && len_cmd == 5 && memcmp(cmd, "/stop", 5) == 0) {
+		WEBHID_TRACE("Stop Capture");
+		if (!cap || !cap->log) {
+			send_report_error(nc, "409 Conflict", "No capture of the HID IF is running", 0);
+			return;
+		}
+		stop_capture(cap);
+		send_capture_json(nc, cap);
+	}
+	else if (is_get_request && (len_cmd == 0 || (len_cmd == 1 && cmd[0] == '/'))) {
+		if (!cap) {
+			send_report_error(nc, "404 Not Found", "No capture of the HID IF", 0);
+			return;
+		}
+		release_retired(cap, 0); // to tell the report appended last
+		send_capture_json(nc, cap);
+	}
+	else if (is_get_request && len_cmd == 5 && memcmp(cmd, "/data", 5) == 0) {
+		struct capture_log_info info;
+		uint64_t from_us = 0, to_us = hr_clock_get_us();
+		capture_log_range_t r;
+		WEBHID_TRACE("Download Capture");
+		if (!cap) {
+			send_report_error(nc, "404 Not Found", "No capture of the HID IF", 0);
+			return;
+		}
+		if (get_capture_var(hm, "from", var, sizeof(var))) from_us = (uint64_t) strtoull(var, NULL, 0);
+		if (get_capture_var(hm, "to", var, sizeof(var))) to_us = (uint64_t) strtoull(var, NULL, 0);
+		get_capture_info(cap, &info);
+		r = capture_log_open_range(cap->prefix, info.first_segment, info.last_segment, from_us, to_us);
+		if (!r) {
+			send_report_error(nc, "500 Internal Server Error", "Fail to read capture", 0);
+			return;
+		}
+		mg_printf(nc, "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nTransfer-Encoding: chunked\r\n"
+			"Connection: close\r\nX-Wall-Clock-Offset-Us: %llu\r\n\r\n", (unsigned long long) info.wall_clock_offset_us);
+		nc->user_data = r;
+		nc->handler = capture_download_handler;
+		send_capture_range(nc);
+	}
+	else {
+		send_report_error(nc, "404 Not Found", "HID request type is invalid", 0);
+	}
+}
+
 void webhid_finalize(void)
 {
 	WEBHID_TRACE("webhid_finalize() called");
+	bdl_list_destroy(hidsocket_captures_list, destroy_capture_pvoid); // before devices recording them are left
+	hidsocket_captures_list = 0;
+	capture_log_finalize();
 	bdl_list_destroy(hidsocket_connections_list, destroy_connectin_pvoid);
 	hidsocket_connections_list = 0;
+	worker_pool_finalize(); // workers leave devices stopped by their last subscribers
+	finish_stopped_devices();
+	bdl_list_destroy(hidsocket_devices_list, free); // no device is left normally
+	hidsocket_devices_list = 0;
+	bdl_list_destroy(rest_requests_list, forget_request_pvoid); // before requests are freed by hid_request module
+	rest_requests_list = 0;
+	hid_request_finalize(); // before handles used by requests are closed
+	hid_pool_finalize();
+#ifdef WEBHID_HIDRAW_EPOLL
+	hidraw_epoll_finalize();
+#endif
+	hid_index_finalize();
+	free(hidsocket_deflate_buf);
+	hidsocket_deflate_buf = 0;
+	hidsocket_deflate_buf_size = 0;
+	wakeup_connection = 0;
+	if (wakeup_socks[1] != INVALID_SOCKET) {
+		closesocket(wakeup_socks[1]); // the other side is closed by mongoose
+		wakeup_socks[1] = INVALID_SOCKET;
+	}
 }
\ No newline at end of file
@@ -18,12 +18,36 @@ void webhid_enumerate(struct mg_connection *nc, struct http_message *hm);
 
 /**
  *  Handle a request to get/set HID report (Feature/ Input/ Output)
+ *  The report is got or set on another thread, and the response is sent when it completes
  */
 void webhid_request_report(struct mg_connection *nc, struct http_message *hm);
 
+/**
+ *  Forget a request of a HTTP connection being closed, its result is discarded when it completes
+ */
+void webhid_cancel_request(struct mg_connection *nc);
+
+/**
+ *  Handle a request to get statistics of connections and HID IFs
+ *  Formatted as JSON, or Prometheus text with query string "format=prometheus"
+ */
+void webhid_stats(struct mg_connection *nc, struct http_message *hm);
+
+/**
+ *  Handle a request to start/stop capture of a HID IF ("{virtualPath}capture/start", "{virtualPath}capture/stop"),
+ *  to get its state ("{virtualPath}capture") or to download reports captured ("{virtualPath}capture/data")
+ */
+void webhid_capture(struct mg_connection *nc, struct http_message *hm);
+
+/**
+ *  Set directory where capture files are made (current directory by default)
+ */
+void webhid_set_capture_directory(const char *dir);
+
 /**
  *  Handle and route a HTTP Request
- *  It returns 1 when the request is handled properly; 0 on passed through
+ *  A request pipelined while a HID request of the connection is running is refused by closing the connection
+ *  It returns 1 when the request is handled properly (or refused); 0 on passed through
  */
 int webhid_handle_request(struct mg_connection *nc, struct http_message *hm);
 
@@ -33,14 +57,20 @@ int webhid_handle_request(struct mg_connection *nc, struct http_message *hm);
 
 /**
  *  Initialize the module for usage of WebSockets
+ *  mgr is used to wake mongoose thread up when input reports arrive
  */
-void webhid_initialize(void);
+void webhid_initialize(struct mg_mgr *mgr);
 
 /**
  *  Returns number of Websocket-HID connection(s) still alive
  */
 int webhid_get_numof_connection(void);
 
+/**
+ *  Returns number of input reports dropped by overflow of connections' queues so far
+ */
+uint32_t webhid_get_numof_dropped(void);
+
 /**
  *  Connect WebSocket to a HID IF and start to read HID input report asynchronously
  *  Returns 1 on success; 0 on fail
@@ -66,8 +96,8 @@ void webhid_disconnect(struct mg_connection *nc);
 int webhid_read_input(struct mg_connection *nc, uint8_t *buffer, size_t length);
 
 /**
- *  Write HID output report
- *  It returns size to be written
+ *  Write HID output report, it is queued to be written on a thread shared with REST requests
+ *  It returns size to be written; -1 when it could not be queued
  */
 int webhid_write_output(struct mg_connection *nc, const uint8_t *buffer, size_t length);
 
@@ -77,6 +107,12 @@ int webhid_write_output(struct mg_connection *nc, const uint8_t *buffer, size_t
  */
 int webhid_handle_frame(struct mg_connection *nc, struct websocket_message *wm);
 
+/**
+ *  Handle MG_EV_SEND of a WebSocket to send input reports held back while the socket was congested
+ *  It returns 1 when the connection is handled; 0 on passed through
+ */
+int webhid_handle_sent(struct mg_connection *nc);
+
 /**
  *  Handle and route a WebSocket Handshake request
  *  It returns 1 when the request is handled properly; 0 on passed through
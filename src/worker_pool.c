@@ -0,0 +1,494 @@
+/**
+ *  Worker Pool module
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "atom.h"
+#include "bdl_list.h"
+#include "worker_pool.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <time.h>
+#endif
+
+#ifdef _DEBUG
+#include <stdio.h>
+#define WORKER_POOL_TRACE(msg)	\
+	printf("%s (% 4d): %s\r\n", __FUNCTION__, __LINE__, msg)
+#else //_DEBUG
+#define WORKER_POOL_TRACE(msg)
+#endif //_DEBUG
+
+/**
+ *  Workers are not started more than this even on a machine with more cores
+ */
+#define WORKER_POOL_MAX_WORKERS	(64)
+/**
+ *  Timeout given to the only task of a worker, and to waiting for waitables of tasks
+ */
+#define WORKER_POOL_BLOCK_MS	(50)
+/**
+ *  Upper bound of the interval polling tasks without waitable, doubled from 1 ms while they are idle
+ */
+#define WORKER_POOL_POLL_MAX_MS	(16)
+
+struct _worker_pool_task {
+	worker_pool_service_t service;
+	void *ctx;
+	worker_pool_waitable_t waitable;
+	void (*on_removed)(void *ctx); /// set before removed
+	atom_t removed; /// boolean, set by remove, the task is freed by the worker holding it
+	atom_t moving; /// boolean, set by rebalance and cleared by the worker taking it over, it is not moved again meanwhile
+	int move_to; /// worker to hand it over to, -1 when not moving (under mutex of the worker holding it)
+	atom_t work; /// work done since the last rebalance, added by worker
+	uint32_t load; /// work of the last interval
+	int worker; /// index of worker servicing it, or to take it over (caller thread only)
+	struct _worker_pool_task *next_pending;
+	bdl_list_node_t node; /// in tasks_list until removed
+};
+
+struct worker {
+	pthread_t th;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond_changed; /// worker waits for tasks
+#ifdef _WIN32
+	HANDLE wake; /// auto-reset event to stop waiting for waitables of tasks
+#endif
+	int changed; /// boolean, a task is pending, removed or moving (under mutex)
+	int woken; /// boolean, worker_pool_wake was called for a task of the worker (under mutex)
+	int requested_stop; /// boolean (under mutex)
+	worker_pool_task_t pending; /// tasks to be taken by the worker (under mutex)
+	worker_pool_task_t *tasks; /// tasks serviced, touched only by the worker (resized under mutex)
+	int num_tasks;
+	int capacity;
+	int num_assigned; /// tasks assigned including pending ones (caller thread only)
+	uint32_t load; /// sum of load of tasks (caller thread only)
+};
+
+static struct worker *workers = 0;
+static int num_workers = 0;
+static bdl_list_t tasks_list = 0; /// all tasks, to measure load
+
+static int get_numof_cores(void) {
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int) info.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0? (int) n: 1;
+#endif
+}
+
+/**
+ *  Let a worker apply changes of its tasks at the end of its pass, called under mutex of the worker
+ */
+static void signal_changed(struct worker *w) {
+	w->changed = 1;
+	pthread_cond_signal(&w->cond_changed);
+#ifdef _WIN32
+	SetEvent(w->wake);
+#endif
+}
+
+/**
+ *  Take pending tasks, and pick removed and moving ones out into the lists given, called by worker under mutex
+ */
+static void apply_changes(struct worker *w, worker_pool_task_t *removed, worker_pool_task_t *moving) {
+	int i, n = 0;
+
+	for (i = 0; i < w->num_tasks; i++) {
+		worker_pool_task_t t = w->tasks[i];
+		if (atom_load_acq(&t->removed)) {
+			t->next_pending = *removed;
+			*removed = t;
+		} else if (t->move_to >= 0) {
+			t->next_pending = *moving;
+			*moving = t;
+		} else {
+			w->tasks[n++] = t;
+		}
+	}
+	w->num_tasks = n;
+
+	while (w->pending) {
+		worker_pool_task_t t = w->pending;
+		if (atom_load_acq(&t->removed)) {
+			w->pending = t->next_pending;
+			t->next_pending = *removed;
+			*removed = t;
+		} else if (t->move_to >= 0) {
+			w->pending = t->next_pending;
+			t->next_pending = *moving;
+			*moving = t;
+		} else {
+			if (w->num_tasks == w->capacity) {
+				int capacity = w->capacity? w->capacity * 2: 8;
+				worker_pool_task_t *tasks = (worker_pool_task_t *)realloc(w->tasks, capacity * sizeof(worker_pool_task_t));
+				if (!tasks) {
+					WORKER_POOL_TRACE("failed to take task"); // retried on the next pass
+					break;
+				}
+				w->tasks = tasks;
+				w->capacity = capacity;
+			}
+			w->pending = t->next_pending;
+			w->tasks[w->num_tasks++] = t;
+			atom_store_rel(&t->moving, 0);
+		}
+	}
+
+	w->changed = (w->pending != 0);
+}
+
+static void push_pending(struct worker *w, worker_pool_task_t t) {
+	pthread_mutex_lock(&w->mutex);
+	t->next_pending = w->pending;
+	w->pending = t;
+	signal_changed(w);
+	pthread_mutex_unlock(&w->mutex);
+}
+
+/**
+ *  Free tasks removed and hand moving ones over to their new workers, called by worker without mutex
+ */
+static void settle_tasks(worker_pool_task_t removed, worker_pool_task_t moving) {
+	while (removed) {
+		worker_pool_task_t t = removed;
+		removed = t->next_pending;
+		if (t->on_removed) t->on_removed(t->ctx);
+		free(t);
+	}
+	while (moving) {
+		worker_pool_task_t t = moving;
+		int to = t->move_to;
+		moving = t->next_pending;
+		t->move_to = -1;
+		push_pending(workers + to, t); // removed meanwhile, it is freed by the new worker
+	}
+}
+
+#ifdef _WIN32
+/**
+ *  Wait until a waitable of tasks is signaled or timeout_ms passes
+ *  It returns 0 without waiting when a task has no waitable, or tasks are too many to wait at once
+ */
+static int wait_tasks(struct worker *w, int timeout_ms) {
+	HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+	DWORD n = 0;
+	int i;
+
+	handles[n++] = w->wake;
+	for (i = 0; i < w->num_tasks; i++) {
+		if (!w->tasks[i]->waitable || n == MAXIMUM_WAIT_OBJECTS) return 0;
+		handles[n++] = (HANDLE) w->tasks[i]->waitable;
+	}
+	WaitForMultipleObjects(n, handles, FALSE, (DWORD) timeout_ms);
+	return 1;
+}
+
+/**
+ *  Sleep timeout_ms unless tasks are changed or woken meanwhile
+ */
+static void idle_wait(struct worker *w, int timeout_ms) {
+	WaitForSingleObject(w->wake, (DWORD) timeout_ms);
+	pthread_mutex_lock(&w->mutex);
+	w->woken = 0;
+	pthread_mutex_unlock(&w->mutex);
+}
+#else
+static int wait_tasks(struct worker *w, int timeout_ms) {
+	(void) w;
+	(void) timeout_ms;
+	return 0;
+}
+
+static void idle_wait(struct worker *w, int timeout_ms) {
+	struct timespec ts;
+	int r = 0;
+
+	// deadline of pthread_cond_timedwait is on the wall clock
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock(&w->mutex);
+	while (!w->changed && !w->woken && !w->requested_stop && r == 0) {
+		r = pthread_cond_timedwait(&w->cond_changed, &w->mutex, &ts);
+	}
+	w->woken = 0;
+	pthread_mutex_unlock(&w->mutex);
+}
+#endif
+
+static void *proc_worker(void *param) {
+	struct worker *w = (struct worker *)param;
+	worker_pool_task_t removed = 0, moving = 0;
+	int poll_ms = 0; // interval polling idle tasks, 0 while they have work
+
+	pthread_mutex_lock(&w->mutex);
+	while (!w->requested_stop) {
+		int i, blocking, work = 0, due_ms = WORKER_POOL_BLOCK_MS, due_given = 0;
+		if (w->changed) apply_changes(w, &removed, &moving);
+		if (removed || moving) {
+			pthread_mutex_unlock(&w->mutex);
+			settle_tasks(removed, moving);
+			removed = moving = 0;
+			pthread_mutex_lock(&w->mutex);
+			continue;
+		}
+		if (w->num_tasks == 0) {
+			pthread_cond_wait(&w->cond_changed, &w->mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&w->mutex);
+
+		// the only task without waitable may block until its input arrives, others are serviced in turn
+		blocking = (w->num_tasks == 1 && !w->tasks[0]->waitable);
+		for (i = 0; i < w->num_tasks; i++) {
+			worker_pool_task_t t = w->tasks[i];
+			int due = -1;
+			int r = t->service(t->ctx, blocking? WORKER_POOL_BLOCK_MS: 0, &due);
+			if (r > 0) {
+				atom_fetch_add(&t->work, (uint32_t) r);
+				work += r;
+			}
+			if (due >= 0) due_given = 1;
+			if (due >= 0 && due < due_ms) due_ms = due;
+		}
+		if (work > 0) {
+			poll_ms = 0;
+		} else if (blocking) {
+			// the only task returned without blocking as it is due again, e.g. its consumer is behind
+			if (due_given) idle_wait(w, due_ms);
+		} else if (!wait_tasks(w, due_ms)) {
+			// all tasks are idle and some can only be polled, back off not to spin
+			poll_ms = poll_ms? poll_ms * 2: 1;
+			if (poll_ms > WORKER_POOL_POLL_MAX_MS) poll_ms = WORKER_POOL_POLL_MAX_MS;
+			idle_wait(w, poll_ms < due_ms? poll_ms: due_ms);
+		}
+
+		pthread_mutex_lock(&w->mutex);
+	}
+	if (w->changed) apply_changes(w, &removed, &moving);
+	pthread_mutex_unlock(&w->mutex);
+	settle_tasks(removed, 0);
+	while (moving) {
+		// left to the new worker, which takes or frees it on finalizing
+		worker_pool_task_t t = moving;
+		int to = t->move_to;
+		moving = t->next_pending;
+		t->move_to = -1;
+		push_pending(workers + to, t);
+	}
+
+	return 0;
+}
+
+static void attach_task(worker_pool_task_t t, int index) {
+	struct worker *w = workers + index;
+	t->worker = index;
+	push_pending(w, t);
+	w->num_assigned++;
+	w->load += t->load;
+}
+
+int worker_pool_initialize(int n) {
+	int i;
+
+	if (n <= 0) n = get_numof_cores();
+	if (n > WORKER_POOL_MAX_WORKERS) n = WORKER_POOL_MAX_WORKERS;
+	workers = (struct worker *)calloc(n, sizeof(struct worker));
+	tasks_list = bdl_list_create();
+	if (!workers || !tasks_list) {
+		WORKER_POOL_TRACE("failed to create pool");
+		worker_pool_finalize();
+		return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct worker *w = workers + i;
+		pthread_mutex_init(&w->mutex, NULL);
+		pthread_cond_init(&w->cond_changed, NULL);
+#ifdef _WIN32
+		w->wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (!w->wake || pthread_create(&w->th, 0, proc_worker, w) != 0) {
+			if (w->wake) CloseHandle(w->wake);
+#else
+		if (pthread_create(&w->th, 0, proc_worker, w) != 0) {
+#endif
+			WORKER_POOL_TRACE("failed to create thread");
+			pthread_cond_destroy(&w->cond_changed);
+			pthread_mutex_destroy(&w->mutex);
+			break;
+		}
+		num_workers++;
+	}
+	return num_workers;
+}
+
+worker_pool_task_t worker_pool_add(worker_pool_service_t service, void *ctx, worker_pool_waitable_t waitable) {
+	worker_pool_task_t t;
+	int i, index = 0;
+
+	if (num_workers == 0) return 0;
+	t = (worker_pool_task_t) malloc(sizeof(struct _worker_pool_task));
+	if (!t) return 0;
+	t->service = service;
+	t->ctx = ctx;
+	t->waitable = waitable;
+	t->on_removed = 0;
+	t->removed = 0;
+	t->moving = 0;
+	t->move_to = -1;
+	t->work = 0;
+	t->load = 0;
+	t->node = bdl_list_append_node(tasks_list, t);
+	if (!t->node) {
+		free(t);
+		return 0;
+	}
+
+	for (i = 1; i < num_workers; i++) {
+		const struct worker *w = workers + i;
+		const struct worker *best = workers + index;
+		if (w->load < best->load || (w->load == best->load && w->num_assigned < best->num_assigned)) index = i;
+	}
+	attach_task(t, index);
+	return t;
+}
+
+void worker_pool_remove(worker_pool_task_t t, void (*on_removed)(void *ctx)) {
+	struct worker *w = workers + t->worker; // the worker taking it over when it is moving
+	w->num_assigned--;
+	w->load -= t->load;
+	bdl_list_delete_node(tasks_list, t->node);
+	t->on_removed = on_removed;
+	pthread_mutex_lock(&w->mutex);
+	atom_store_rel(&t->removed, 1); // the worker may free it from now on
+	signal_changed(w);
+	pthread_mutex_unlock(&w->mutex);
+}
+
+/**
+ *  Let the worker of a task hand it over to another one at the end of its pass
+ */
+static void move_task(worker_pool_task_t t, int index) {
+	struct worker *w = workers + t->worker;
+	pthread_mutex_lock(&w->mutex);
+	t->move_to = index;
+	atom_store_rel(&t->moving, 1);
+	signal_changed(w);
+	pthread_mutex_unlock(&w->mutex);
+	w->num_assigned--;
+	w->load -= t->load;
+
+	t->worker = index;
+	workers[index].num_assigned++;
+	workers[index].load += t->load;
+}
+
+/**
+ *  Move a task of the busiest worker when it lowers the peak load by 1/8 at least,
+ *  or else even out the number of tasks so that more workers can block on their only task
+ */
+void worker_pool_rebalance(void) {
+	bdl_list_node_t node;
+	int i, busiest = 0, idlest = 0, most = 0, fewest = 0;
+	worker_pool_task_t move = 0;
+	uint32_t peak = 0;
+
+	if (num_workers < 2) return;
+	for (i = 0; i < num_workers; i++) workers[i].load = 0;
+	for (node = bdl_list_get_head(tasks_list); node; node = bdl_list_get_next(tasks_list, node)) {
+		worker_pool_task_t t = (worker_pool_task_t) bdl_list_extract_content(node);
+		t->load = atom_exchange(&t->work, 0);
+		workers[t->worker].load += t->load;
+	}
+	for (i = 1; i < num_workers; i++) {
+		if (workers[i].load > workers[busiest].load) busiest = i;
+		if (workers[i].load < workers[idlest].load ||
+			(workers[i].load == workers[idlest].load && workers[i].num_assigned < workers[idlest].num_assigned)) idlest = i;
+		if (workers[i].num_assigned > workers[most].num_assigned) most = i;
+		if (workers[i].num_assigned < workers[fewest].num_assigned) fewest = i;
+	}
+
+	if (workers[busiest].num_assigned >= 2) {
+		uint32_t lb = workers[busiest].load, li = workers[idlest].load;
+		peak = lb - lb / 8;
+		for (node = bdl_list_get_head(tasks_list); node; node = bdl_list_get_next(tasks_list, node)) {
+			worker_pool_task_t t = (worker_pool_task_t) bdl_list_extract_content(node);
+			uint32_t p;
+			if (t->worker != busiest || t->load == 0 || atom_load_acq(&t->moving)) continue;
+			p = (lb - t->load > li + t->load)? lb - t->load: li + t->load;
+			if (p < peak) {
+				peak = p;
+				move = t;
+			}
+		}
+	}
+	if (!move && workers[most].num_assigned - workers[fewest].num_assigned >= 2) {
+		for (node = bdl_list_get_head(tasks_list); node; node = bdl_list_get_next(tasks_list, node)) {
+			worker_pool_task_t t = (worker_pool_task_t) bdl_list_extract_content(node);
+			if (t->worker != most || atom_load_acq(&t->moving) ||
+				workers[fewest].load + t->load > workers[most].load - t->load) continue;
+			if (!move || t->load < move->load) move = t;
+		}
+		idlest = fewest;
+	}
+
+	if (move) move_task(move, idlest);
+}
+
+void worker_pool_wake(worker_pool_task_t t) {
+	struct worker *w = workers + t->worker;
+	pthread_mutex_lock(&w->mutex);
+	w->woken = 1;
+	pthread_cond_signal(&w->cond_changed);
+#ifdef _WIN32
+	SetEvent(w->wake);
+#endif
+	pthread_mutex_unlock(&w->mutex);
+}
+
+int worker_pool_get_worker(const worker_pool_task_t t) {
+	return t->worker;
+}
+
+void worker_pool_finalize(void) {
+	int i;
+	for (i = 0; i < num_workers; i++) {
+		struct worker *w = workers + i;
+		pthread_mutex_lock(&w->mutex);
+		w->requested_stop = 1;
+		signal_changed(w);
+		pthread_mutex_unlock(&w->mutex);
+	}
+	for (i = 0; i < num_workers; i++) pthread_join(workers[i].th, NULL);
+	for (i = 0; i < num_workers; i++) {
+		// tasks removed but handed over to a worker stopped already
+		struct worker *w = workers + i;
+		worker_pool_task_t removed = 0, moving = 0;
+		apply_changes(w, &removed, &moving);
+		settle_tasks(removed, 0);
+#ifdef _WIN32
+		CloseHandle(w->wake);
+#endif
+		pthread_cond_destroy(&w->cond_changed);
+		pthread_mutex_destroy(&w->mutex);
+		free(w->tasks);
+	}
+	free(workers);
+	workers = 0;
+	num_workers = 0;
+	if (tasks_list) bdl_list_destroy(tasks_list, free); // no task is left normally
+	tasks_list = 0;
+}
@@ -0,0 +1,76 @@
+/**
+ *  Worker Pool module
+ *  Fixed number of threads (one per core by default) service many tasks each, e.g. reading HID IFs.
+ *  A worker waits on waitables of its tasks at once (Windows), or lets its only task block;
+ *  it polls them in turn only when more tasks have no waitable.
+ *  Tasks are assigned to the least loaded worker and moved between workers by rebalancing.
+ *  All functions must be called from one thread (mongoose thread)
+ */
+
+#ifndef _WORKER_POOL_H_
+#define _WORKER_POOL_H_
+
+/**
+ *  Type of a task is pointer to struct
+ */
+struct _worker_pool_task;
+typedef struct _worker_pool_task *worker_pool_task_t;
+
+/**
+ *  Function to service a task once, called on a worker thread
+ *  It may block up to timeout_ms (0: must not block) and returns amount of work done (e.g. reports read),
+ *  which is the load of the task
+ *  It may set *due_ms (-1 on call) to the time within which it must be serviced again without its waitable signaled,
+ *  e.g. to flush reports coalesced within a latency budget
+ */
+typedef int (*worker_pool_service_t)(void *ctx, int timeout_ms, int *due_ms);
+
+/**
+ *  Object signaled while a task has work, waited by its worker instead of polling the task
+ *  Windows: HANDLE of event (e.g. of overlapped read); other platforms: always 0
+ */
+typedef void *worker_pool_waitable_t;
+
+/**
+ *  Start workers, num_workers of 0 means the number of cores
+ *  It returns the number of workers started
+ */
+int worker_pool_initialize(int num_workers);
+
+/**
+ *  Assign a task to the least loaded worker, waitable may be 0 to let the task be polled
+ *  It returns 0 on fail
+ */
+worker_pool_task_t worker_pool_add(worker_pool_service_t service, void *ctx, worker_pool_waitable_t waitable);
+
+/**
+ *  Remove a task without waiting for its worker
+ *  The worker calls on_removed(ctx) (may be NULL) on its thread at the end of its pass, when the service is no longer running,
+ *  and frees the task; t must not be used after this call
+ */
+void worker_pool_remove(worker_pool_task_t t, void (*on_removed)(void *ctx));
+
+/**
+ *  Measure load of tasks since the last call, and move a task from the most loaded worker
+ *  to the least loaded one when it evens them out. It is expected to be called periodically
+ */
+void worker_pool_rebalance(void);
+
+/**
+ *  Let the worker of a task end its wait and service tasks again, e.g. when a task left its input unread
+ *  for its consumer being behind, and the consumer has caught up. It is called by the caller thread
+ */
+void worker_pool_wake(worker_pool_task_t t);
+
+/**
+ *  Get the index of worker servicing a task
+ */
+int worker_pool_get_worker(const worker_pool_task_t t);
+
+/**
+ *  Stop workers, all tasks must be removed beforehand
+ *  on_removed of tasks not settled yet is called before it returns
+ */
+void worker_pool_finalize(void);
+
+#endif //#ifndef _WORKER_POOL_H_
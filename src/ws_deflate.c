@@ -0,0 +1,451 @@
+/**
+ *  WebSocket Deflate module
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ws_deflate.h"
+
+#ifdef _DEBUG
+#include <stdio.h>
+#define WS_DEFLATE_TRACE(msg)	\
+	printf("%s (% 4d): %s\r\n", __FUNCTION__, __LINE__, msg)
+#else //_DEBUG
+#define WS_DEFLATE_TRACE(msg)
+#endif //_DEBUG
+
+/**
+ *  Trigrams are hashed into this bits to find matches
+ */
+#define WS_DEFLATE_HASH_BITS	(12)
+/**
+ *  Candidates of a match tried at most, it bounds time to compress
+ */
+#define WS_DEFLATE_MAX_CHAIN	(16)
+
+#define MIN_MATCH		(3)
+#define MAX_MATCH		(258)
+#define END_OF_BLOCK	(256)
+
+/// Base values and extra bits of length codes (257..285) and distance codes (0..29)
+static const uint16_t length_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t length_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t distance_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+	1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t distance_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+struct _ws_deflate {
+	uint32_t window_size;
+	int no_context_takeover; /// boolean
+	uint8_t *work; /// window (the last data compressed) followed by the message being compressed
+	size_t work_size;
+	size_t window_len; /// bytes of window at the head of work
+	uint32_t base; /// stream position of work[0]
+	uint32_t head[1 << WS_DEFLATE_HASH_BITS]; /// stream position + 1 of the latest trigram by hash, 0 for none
+	uint32_t *prev; /// stream position + 1 of the previous trigram of the same hash, by position in window
+};
+
+//////////////////////////////////////////////////////////////////////////
+/// Compressor
+//////////////////////////////////////////////////////////////////////////
+
+struct bit_writer {
+	uint8_t *p;
+	uint32_t bits;
+	int num;
+};
+
+static void put_bits(struct bit_writer *w, uint32_t value, int n) {
+	w->bits |= value << w->num;
+	w->num += n;
+	while (w->num >= 8) {
+		*w->p++ = (uint8_t) w->bits;
+		w->bits >>= 8;
+		w->num -= 8;
+	}
+}
+
+/**
+ *  Huffman codes are packed from their most significant bit
+ */
+static void put_code(struct bit_writer *w, uint32_t code, int len) {
+	uint32_t reversed = 0;
+	int i;
+	for (i = 0; i < len; i++) reversed |= ((code >> i) & 1) << (len - 1 - i);
+	put_bits(w, reversed, len);
+}
+
+/**
+ *  Literal/length symbol in fixed Huffman codes
+ */
+static void put_symbol(struct bit_writer *w, int sym) {
+	if (sym <= 143) put_code(w, 0x30 + sym, 8);
+	else if (sym <= 255) put_code(w, 0x190 + sym - 144, 9);
+	else if (sym <= 279) put_code(w, sym - 256, 7);
+	else put_code(w, 0xC0 + sym - 280, 8);
+}
+
+static void put_match(struct bit_writer *w, size_t len, size_t dist) {
+	int i = 28, j = 29;
+	while (length_base[i] > len) i--;
+	put_symbol(w, 257 + i);
+	put_bits(w, (uint32_t)(len - length_base[i]), length_extra[i]);
+	while (distance_base[j] > dist) j--;
+	put_code(w, j, 5);
+	put_bits(w, (uint32_t)(dist - distance_base[j]), distance_extra[j]);
+}
+
+static uint32_t hash(const uint8_t *p) {
+	uint32_t v = ((uint32_t) p[0] << 16) | ((uint32_t) p[1] << 8) | p[2];
+	return (v * 2654435761u) >> (32 - WS_DEFLATE_HASH_BITS);
+}
+
+static void insert(ws_deflate_t d, uint32_t h, uint32_t pos) {
+	d->prev[pos & (d->window_size - 1)] = d->head[h];
+	d->head[h] = pos + 1;
+}
+
+static void reset(ws_deflate_t d) {
+	memset(d->head, 0, sizeof(d->head));
+	memset(d->prev, 0, d->window_size * sizeof(uint32_t));
+	d->window_len = 0;
+	d->base = 0;
+}
+
+ws_deflate_t ws_deflate_create(int window_bits, int no_context_takeover) {
+	ws_deflate_t d = (ws_deflate_t) malloc(sizeof(struct _ws_deflate));
+	if (!d) return 0;
+	if (window_bits > WS_DEFLATE_WINDOW_BITS_MAX) window_bits = WS_DEFLATE_WINDOW_BITS_MAX;
+	if (window_bits < 8) window_bits = 8;
+	d->window_size = (uint32_t) 1 << window_bits;
+	d->no_context_takeover = no_context_takeover;
+	d->work = 0;
+	d->work_size = 0;
+	d->prev = (uint32_t *) malloc(d->window_size * sizeof(uint32_t));
+	if (!d->prev) {
+		free(d);
+		return 0;
+	}
+	reset(d);
+	return d;
+}
+
+void ws_deflate_destroy(ws_deflate_t d) {
+	free(d->work);
+	free(d->prev);
+	free(d);
+}
+
+size_t ws_deflate_bound(size_t src_len) {
+	// 9 bits per literal at most, and bits of block headers and end of block
+	return src_len + src_len / 8 + 8;
+}
+
+size_t ws_deflate_compress(ws_deflate_t d, const uint8_t *src, size_t src_len, uint8_t *dst) {
+	struct bit_writer w;
+	size_t pos, end, out;
+	uint8_t *work;
+
+	if (d->base + (uint64_t) d->window_len + src_len >= 0x80000000u) reset(d); // keep stream positions from wrapping
+	if (d->window_len + src_len > d->work_size) {
+		size_t size = d->window_len + src_len;
+		if (size < d->work_size * 2) size = d->work_size * 2;
+		work = (uint8_t *) realloc(d->work, size);
+		if (!work) {
+			WS_DEFLATE_TRACE("failed to allocate memory");
+			reset(d);
+			return 0;
+		}
+		d->work = work;
+		d->work_size = size;
+	}
+	work = d->work;
+	memcpy(work + d->window_len, src, src_len);
+
+	w.p = dst;
+	w.bits = 0;
+	w.num = 0;
+	put_bits(&w, 0, 1); // not final, the stream continues with the next message
+	put_bits(&w, 1, 2); // fixed Huffman codes
+
+	pos = d->window_len;
+	end = d->window_len + src_len;
+	while (pos < end) {
+		size_t best_len = 0, best_dist = 0;
+		if (end - pos >= MIN_MATCH) {
+			uint32_t h = hash(work + pos);
+			uint32_t spos = d->base + (uint32_t) pos;
+			uint32_t cand = d->head[h];
+			size_t max_len = (end - pos < MAX_MATCH)? end - pos: MAX_MATCH;
+			int chain = WS_DEFLATE_MAX_CHAIN;
+			while (cand && chain--) {
+				uint32_t cpos = cand - 1;
+				const uint8_t *a, *b = work + pos;
+				size_t len = 0;
+				if (cpos < d->base || spos - cpos > d->window_size) break;
+				a = work + (cpos - d->base);
+				while (len < max_len && a[len] == b[len]) len++;
+				if (len > best_len) {
+					best_len = len;
+					best_dist = spos - cpos;
+					if (len == max_len) break;
+				}
+				cand = d->prev[cpos & (d->window_size - 1)];
+				if (cand - 1 >= cpos) break; // slot was taken by a newer trigram
+			}
+			insert(d, h, spos);
+		}
+
+		if (best_len >= MIN_MATCH) {
+			size_t i;
+			put_match(&w, best_len, best_dist);
+			for (i = 1; i < best_len; i++) {
+				if (pos + i + MIN_MATCH <= end) insert(d, hash(work + pos + i), d->base + (uint32_t)(pos + i));
+			}
+			pos += best_len;
+		} else {
+			put_symbol(&w, work[pos]);
+			pos++;
+		}
+	}
+	put_symbol(&w, END_OF_BLOCK);
+	put_bits(&w, 0, 3); // empty stored block of sync flush, its LEN and NLEN (0x00 0x00 0xff 0xff) are removed
+	if (w.num > 0) *w.p++ = (uint8_t) w.bits;
+
+	out = w.p - dst;
+	if (out >= src_len || d->no_context_takeover) {
+		reset(d); // peer does not see the message compressed, so its window does not have it
+		return (out >= src_len)? 0: out;
+	}
+
+	// the last data is kept as window of the next message
+	if (end > d->window_size) {
+		size_t keep = d->window_size;
+		memmove(work, work + end - keep, keep);
+		d->base += (uint32_t)(end - keep);
+		d->window_len = keep;
+	} else {
+		d->window_len = end;
+	}
+	return out;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// Decompressor
+//////////////////////////////////////////////////////////////////////////
+
+/**
+ *  0x00 0x00 0xff 0xff removed by the peer is read after the data
+ */
+static const uint8_t inflate_tail[4] = { 0x00, 0x00, 0xff, 0xff };
+
+struct bit_reader {
+	const uint8_t *src;
+	size_t len; /// without tail
+	size_t pos;
+	uint32_t bits;
+	int num;
+	int error; /// boolean, data ran out
+};
+
+struct huffman {
+	uint16_t count[16]; /// number of codes by length
+	uint16_t symbol[288]; /// symbols ordered by code
+};
+
+static int get_byte(struct bit_reader *r) {
+	size_t pos = r->pos++;
+	if (pos < r->len) return r->src[pos];
+	if (pos < r->len + sizeof(inflate_tail)) return inflate_tail[pos - r->len];
+	r->error = 1;
+	return 0;
+}
+
+static uint32_t get_bits(struct bit_reader *r, int n) {
+	uint32_t v;
+	while (r->num < n) {
+		r->bits |= (uint32_t) get_byte(r) << r->num;
+		r->num += 8;
+	}
+	v = r->bits & ((1u << n) - 1);
+	r->bits >>= n;
+	r->num -= n;
+	return v;
+}
+
+/**
+ *  Build canonical Huffman codes from lengths of symbols
+ *  It returns 0 when lengths are over-subscribed
+ */
+static int build_huffman(struct huffman *h, const uint8_t *lengths, int n) {
+	uint16_t offsets[16];
+	int i, left = 1;
+
+	memset(h->count, 0, sizeof(h->count));
+	for (i = 0; i < n; i++) h->count[lengths[i]]++;
+	h->count[0] = 0;
+	for (i = 1; i < 16; i++) {
+		left = (left << 1) - h->count[i];
+		if (left < 0) return 0;
+	}
+	offsets[1] = 0;
+	for (i = 1; i < 15; i++) offsets[i + 1] = offsets[i] + h->count[i];
+	for (i = 0; i < n; i++) {
+		if (lengths[i]) h->symbol[offsets[lengths[i]]++] = (uint16_t) i;
+	}
+	return 1;
+}
+
+/**
+ *  Decode a symbol bit by bit, it returns -1 on invalid code
+ */
+static int decode_symbol(struct bit_reader *r, const struct huffman *h) {
+	int code = 0, first = 0, index = 0, len;
+	for (len = 1; len < 16; len++) {
+		int count = h->count[len];
+		code |= (int) get_bits(r, 1);
+		if (code - count < first) return h->symbol[index + (code - first)];
+		index += count;
+		first = (first + count) << 1;
+		code <<= 1;
+		if (r->error) break;
+	}
+	return -1;
+}
+
+/**
+ *  Decode a block of Huffman codes, it returns 0 on error
+ */
+static int inflate_codes(struct bit_reader *r, const struct huffman *lencode, const struct huffman *distcode,
+	uint8_t *dst, size_t dst_size, size_t *out)
+{
+	for (;;) {
+		int sym = decode_symbol(r, lencode);
+		if (sym < 0 || r->error) return 0;
+		if (sym < 256) {
+			if (*out >= dst_size) return 0;
+			dst[(*out)++] = (uint8_t) sym;
+		} else if (sym == END_OF_BLOCK) {
+			return 1;
+		} else {
+			size_t len, dist;
+			sym -= 257;
+			if (sym >= 29) return 0;
+			len = length_base[sym] + get_bits(r, length_extra[sym]);
+			sym = decode_symbol(r, distcode);
+			if (sym < 0 || sym >= 30) return 0;
+			dist = distance_base[sym] + get_bits(r, distance_extra[sym]);
+			if (r->error || dist > *out || len > dst_size - *out) return 0;
+			while (len--) {
+				dst[*out] = dst[*out - dist];
+				(*out)++;
+			}
+		}
+	}
+}
+
+static int inflate_stored(struct bit_reader *r, uint8_t *dst, size_t dst_size, size_t *out) {
+	uint32_t len, nlen;
+	r->bits = 0; // skip to byte boundary
+	r->num = 0;
+	len = get_bits(r, 16);
+	nlen = get_bits(r, 16);
+	if (r->error || len != (~nlen & 0xFFFF) || len > dst_size - *out) return 0;
+	while (len--) dst[(*out)++] = (uint8_t) get_byte(r);
+	return !r->error;
+}
+
+static int inflate_fixed(struct bit_reader *r, uint8_t *dst, size_t dst_size, size_t *out) {
+	struct huffman lencode, distcode;
+	uint8_t lengths[288];
+	int i;
+	for (i = 0; i < 144; i++) lengths[i] = 8;
+	for (; i < 256; i++) lengths[i] = 9;
+	for (; i < 280; i++) lengths[i] = 7;
+	for (; i < 288; i++) lengths[i] = 8;
+	build_huffman(&lencode, lengths, 288);
+	for (i = 0; i < 30; i++) lengths[i] = 5;
+	build_huffman(&distcode, lengths, 30);
+	return inflate_codes(r, &lencode, &distcode, dst, dst_size, out);
+}
+
+static int inflate_dynamic(struct bit_reader *r, uint8_t *dst, size_t dst_size, size_t *out) {
+	static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+	struct huffman lencode, distcode;
+	uint8_t lengths[288 + 32];
+	int nlen, ndist, ncode, i = 0;
+
+	nlen = (int) get_bits(r, 5) + 257;
+	ndist = (int) get_bits(r, 5) + 1;
+	ncode = (int) get_bits(r, 4) + 4;
+	if (nlen > 286 || ndist > 30) return 0;
+
+	memset(lengths, 0, 19);
+	for (i = 0; i < ncode; i++) lengths[order[i]] = (uint8_t) get_bits(r, 3);
+	if (r->error || !build_huffman(&lencode, lengths, 19)) return 0;
+
+	i = 0;
+	while (i < nlen + ndist) {
+		int sym = decode_symbol(r, &lencode);
+		int repeat;
+		uint8_t len = 0;
+		if (sym < 0 || r->error) return 0;
+		if (sym < 16) {
+			lengths[i++] = (uint8_t) sym;
+			continue;
+		}
+		if (sym == 16) {
+			if (i == 0) return 0;
+			len = lengths[i - 1];
+			repeat = 3 + (int) get_bits(r, 2);
+		} else if (sym == 17) {
+			repeat = 3 + (int) get_bits(r, 3);
+		} else {
+			repeat = 11 + (int) get_bits(r, 7);
+		}
+		if (i + repeat > nlen + ndist) return 0;
+		while (repeat--) lengths[i++] = len;
+	}
+	if (lengths[END_OF_BLOCK] == 0) return 0;
+
+	if (!build_huffman(&lencode, lengths, nlen) || !build_huffman(&distcode, lengths + nlen, ndist)) return 0;
+	return inflate_codes(r, &lencode, &distcode, dst, dst_size, out);
+}
+
+int ws_deflate_inflate(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_size) {
+	struct bit_reader r;
+	size_t out = 0;
+	int final = 0;
+
+	r.src = src;
+	r.len = src_len;
+	r.pos = 0;
+	r.bits = 0;
+	r.num = 0;
+	r.error = 0;
+
+	// blocks continue until the final one or the end of data (with tail) at a block boundary
+	while (!final && r.pos < r.len + sizeof(inflate_tail)) {
+		int type, ok;
+		final = (int) get_bits(&r, 1);
+		type = (int) get_bits(&r, 2);
+		if (type == 0) ok = inflate_stored(&r, dst, dst_size, &out);
+		else if (type == 1) ok = inflate_fixed(&r, dst, dst_size, &out);
+		else if (type == 2) ok = inflate_dynamic(&r, dst, dst_size, &out);
+		else ok = 0;
+		if (!ok || r.error) {
+			WS_DEFLATE_TRACE("malformed data");
+			return -1;
+		}
+	}
+	return (int) out;
+}
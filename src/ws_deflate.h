@@ -0,0 +1,54 @@
+/**
+ *  WebSocket Deflate module
+ *  Compression of messages for permessage-deflate extension of WebSocket (RFC 7692)
+ *  Compressor emits LZ77 matches with fixed Huffman codes, and keeps its window across messages
+ *  (context takeover) so that a message refers to data of the previous ones.
+ *  Decompressor accepts any DEFLATE data but keeps no window, so client_no_context_takeover must be negotiated
+ */
+
+#ifndef _WS_DEFLATE_H_
+#define _WS_DEFLATE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ *  Largest window used by compressor (4KB), less than allowed by the extension to save memory per connection
+ */
+#define WS_DEFLATE_WINDOW_BITS_MAX	(12)
+
+/**
+ *  Type of compression context is pointer to struct
+ */
+struct _ws_deflate;
+typedef struct _ws_deflate *ws_deflate_t;
+
+/**
+ *  Create a compression context
+ *  window_bits (8 to 15) is limited to WS_DEFLATE_WINDOW_BITS_MAX,
+ *  and the window is cleared on every message when no_context_takeover is true
+ */
+ws_deflate_t ws_deflate_create(int window_bits, int no_context_takeover);
+
+void ws_deflate_destroy(ws_deflate_t d);
+
+/**
+ *  Returns size of buffer enough to compress a message of src_len
+ */
+size_t ws_deflate_bound(size_t src_len);
+
+/**
+ *  Compress a message, without trailing 0x00 0x00 0xff 0xff as the extension requires
+ *  dst must have ws_deflate_bound(src_len) bytes at least
+ *  It returns size of data compressed; 0 when it is not smaller than the message,
+ *  which must be sent uncompressed then (the window is cleared, so the context stays in sync with peer)
+ */
+size_t ws_deflate_compress(ws_deflate_t d, const uint8_t *src, size_t src_len, uint8_t *dst);
+
+/**
+ *  Decompress a message compressed without context takeover
+ *  It returns size of the message; -1 when data is malformed or the message is longer than dst_size
+ */
+int ws_deflate_inflate(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_size);
+
+#endif //#ifndef _WS_DEFLATE_H_